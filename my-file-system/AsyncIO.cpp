@@ -0,0 +1,381 @@
+#include "AsyncIO.h"
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <condition_variable>
+#include <cstring>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <thread>
+#include <unistd.h>
+
+namespace
+{
+    int ioUringSetup(unsigned int entries, io_uring_params *params)
+    {
+        return static_cast<int>(syscall(__NR_io_uring_setup, entries, params));
+    }
+
+    int ioUringEnter(int ringFd, unsigned int toSubmit, unsigned int minComplete, unsigned int flags)
+    {
+        return static_cast<int>(syscall(__NR_io_uring_enter, ringFd, toSubmit, minComplete, flags, nullptr, 0));
+    }
+
+    unsigned *ringField(void *ring, unsigned offset)
+    {
+        return reinterpret_cast<unsigned *>(static_cast<char *>(ring) + offset);
+    }
+}
+
+size_t IORequest::getLength() const
+{
+    size_t length = 0;
+    for (const iovec &buffer : buffers)
+    {
+        length += buffer.iov_len;
+    }
+    return length;
+}
+
+AsyncIOEngine::~AsyncIOEngine()
+{
+}
+
+std::unique_ptr<AsyncIOEngine> AsyncIOEngine::create(unsigned int queueDepth)
+{
+    queueDepth = std::max(1u, queueDepth);
+    std::unique_ptr<IoUringEngine> ring = IoUringEngine::create(queueDepth);
+    if (ring)
+    {
+        return std::move(ring);
+    }
+    return std::unique_ptr<AsyncIOEngine>(new ThreadPoolEngine(queueDepth));
+}
+
+// Finishes a request with blocking preadv/pwritev, skipping the bytes already moved
+void AsyncIOEngine::completeSynchronously(IORequest &request, size_t alreadyTransferred)
+{
+    size_t total = request.getLength();
+    size_t done = alreadyTransferred;
+    while (done < total)
+    {
+        std::vector<iovec> remaining;
+        size_t skip = done;
+        for (const iovec &buffer : request.buffers)
+        {
+            if (skip >= buffer.iov_len)
+            {
+                skip -= buffer.iov_len;
+                continue;
+            }
+            remaining.push_back(iovec{static_cast<char *>(buffer.iov_base) + skip, buffer.iov_len - skip});
+            skip = 0;
+        }
+
+        ssize_t moved = request.write
+                            ? pwritev(request.fd, remaining.data(), static_cast<int>(std::min<size_t>(remaining.size(), IOV_MAX)), request.offset + done)
+                            : preadv(request.fd, remaining.data(), static_cast<int>(std::min<size_t>(remaining.size(), IOV_MAX)), request.offset + done);
+        if (moved < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (moved <= 0)
+        {
+            request.result = moved < 0 ? -errno : static_cast<ssize_t>(done);
+            return;
+        }
+        done += moved;
+    }
+    request.result = static_cast<ssize_t>(done);
+}
+
+IoUringEngine::IoUringEngine(unsigned int queueDepth)
+    : queueDepth(queueDepth), maxRings(std::max(8u, 2 * std::thread::hardware_concurrency())), ringFailed(false)
+{
+}
+
+std::unique_ptr<IoUringEngine> IoUringEngine::create(unsigned int queueDepth)
+{
+    std::unique_ptr<Ring> ring = Ring::create(queueDepth);
+    if (!ring)
+    {
+        return nullptr;
+    }
+    std::unique_ptr<IoUringEngine> engine(new IoUringEngine(queueDepth));
+    engine->idleRings.push_back(ring.get());
+    engine->rings.push_back(std::move(ring));
+    return engine;
+}
+
+IoUringEngine::~IoUringEngine()
+{
+}
+
+std::unique_ptr<IoUringEngine::Ring> IoUringEngine::Ring::create(unsigned int queueDepth)
+{
+    io_uring_params params;
+    std::memset(&params, 0, sizeof(params));
+    int ringFd = ioUringSetup(queueDepth, &params);
+    if (ringFd < 0)
+    {
+        return nullptr;
+    }
+
+    std::unique_ptr<Ring> ring(new Ring());
+    ring->ringFd = ringFd;
+    ring->entries = params.sq_entries;
+    size_t sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        sqRingSize = cqRingSize = std::max(sqRingSize, cqRingSize);
+    }
+
+    void *sqRing = mmap(nullptr, sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQ_RING);
+    if (sqRing == MAP_FAILED)
+    {
+        return nullptr;
+    }
+    ring->sqRing = sqRing;
+    ring->sqRingSize = sqRingSize;
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        ring->cqRing = sqRing;
+    }
+    else
+    {
+        void *cqRing = mmap(nullptr, cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_CQ_RING);
+        if (cqRing == MAP_FAILED)
+        {
+            return nullptr;
+        }
+        ring->cqRing = cqRing;
+        ring->cqRingSize = cqRingSize;
+    }
+
+    size_t sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+    void *sqes = mmap(nullptr, sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED)
+    {
+        return nullptr;
+    }
+    ring->sqes = static_cast<io_uring_sqe *>(sqes);
+    ring->sqesSize = sqesSize;
+
+    ring->sqTail = ringField(ring->sqRing, params.sq_off.tail);
+    ring->sqMask = ringField(ring->sqRing, params.sq_off.ring_mask);
+    ring->sqArray = ringField(ring->sqRing, params.sq_off.array);
+    ring->cqHead = ringField(ring->cqRing, params.cq_off.head);
+    ring->cqTail = ringField(ring->cqRing, params.cq_off.tail);
+    ring->cqMask = ringField(ring->cqRing, params.cq_off.ring_mask);
+    ring->cqes = reinterpret_cast<io_uring_cqe *>(static_cast<char *>(ring->cqRing) + params.cq_off.cqes);
+    return ring;
+}
+
+IoUringEngine::Ring::~Ring()
+{
+    if (sqes)
+    {
+        munmap(sqes, sqesSize);
+    }
+    if (cqRing && cqRing != sqRing)
+    {
+        munmap(cqRing, cqRingSize);
+    }
+    if (sqRing)
+    {
+        munmap(sqRing, sqRingSize);
+    }
+    if (ringFd >= 0)
+    {
+        close(ringFd);
+    }
+}
+
+bool IoUringEngine::Ring::execute(std::vector<IORequest> &requests)
+{
+    size_t submitted = 0;
+    size_t completed = 0;
+    unsigned int inFlight = 0;
+    unsigned int unsubmitted = 0;
+    bool success = true;
+
+    while (completed < requests.size())
+    {
+        // Fill the submission ring up to the queue depth
+        while (!broken && submitted < requests.size() && inFlight < entries)
+        {
+            IORequest &request = requests[submitted];
+            unsigned tail = *sqTail;
+            unsigned index = tail & *sqMask;
+            io_uring_sqe &sqe = sqes[index];
+            std::memset(&sqe, 0, sizeof(sqe));
+            sqe.opcode = request.write ? IORING_OP_WRITEV : IORING_OP_READV;
+            sqe.fd = request.fd;
+            sqe.off = static_cast<uint64_t>(request.offset);
+            sqe.addr = reinterpret_cast<uint64_t>(request.buffers.data());
+            sqe.len = static_cast<uint32_t>(request.buffers.size());
+            sqe.user_data = submitted;
+            sqArray[index] = index;
+            __atomic_store_n(sqTail, tail + 1, __ATOMIC_RELEASE);
+            ++submitted;
+            ++inFlight;
+            ++unsubmitted;
+        }
+
+        if (broken)
+        {
+            // Requests the kernel already took still complete into the ring without entering it
+            std::this_thread::yield();
+        }
+        else
+        {
+            int consumed = ioUringEnter(ringFd, unsubmitted, 1, IORING_ENTER_GETEVENTS);
+            if (consumed >= 0)
+            {
+                unsubmitted -= consumed;
+            }
+            else if (errno != EINTR && errno != EAGAIN && errno != EBUSY)
+            {
+                // Finish everything the kernel never took with blocking calls
+                broken = true;
+                for (size_t i = submitted - unsubmitted; i < requests.size(); ++i)
+                {
+                    completeSynchronously(requests[i], 0);
+                    success = success && requests[i].result == static_cast<ssize_t>(requests[i].getLength());
+                }
+                completed += requests.size() - (submitted - unsubmitted);
+                submitted = requests.size();
+                inFlight -= unsubmitted;
+                unsubmitted = 0;
+            }
+        }
+
+        unsigned head = *cqHead;
+        unsigned tail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+        for (; head != tail; ++head)
+        {
+            const io_uring_cqe &cqe = cqes[head & *cqMask];
+            IORequest &request = requests[cqe.user_data];
+            request.result = cqe.res;
+            if (cqe.res == -EINVAL || cqe.res == -EOPNOTSUPP)
+            {
+                completeSynchronously(request, 0);
+            }
+            else if (cqe.res >= 0 && static_cast<size_t>(cqe.res) < request.getLength())
+            {
+                completeSynchronously(request, cqe.res);
+            }
+            success = success && request.result == static_cast<ssize_t>(request.getLength());
+            ++completed;
+            --inFlight;
+        }
+        __atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+    }
+    return success;
+}
+
+IoUringEngine::Ring *IoUringEngine::acquireRing()
+{
+    std::unique_lock<std::mutex> lock(ringsMutex);
+    while (!ringFailed)
+    {
+        if (!idleRings.empty())
+        {
+            Ring *ring = idleRings.back();
+            idleRings.pop_back();
+            return ring;
+        }
+        if (rings.size() < maxRings)
+        {
+            std::unique_ptr<Ring> ring = Ring::create(queueDepth);
+            if (ring)
+            {
+                rings.push_back(std::move(ring));
+                return rings.back().get();
+            }
+            // The kernel will not hand out more rings, so callers share the ones there are
+            maxRings = static_cast<unsigned int>(rings.size());
+            continue;
+        }
+        ringReleased.wait(lock);
+    }
+    return nullptr;
+}
+
+void IoUringEngine::releaseRing(Ring *ring)
+{
+    std::lock_guard<std::mutex> lock(ringsMutex);
+    if (ring->broken)
+    {
+        ringFailed = true;
+    }
+    else
+    {
+        idleRings.push_back(ring);
+    }
+    ringReleased.notify_all();
+}
+
+ThreadPoolEngine &IoUringEngine::fallbackEngine()
+{
+    std::lock_guard<std::mutex> lock(ringsMutex);
+    if (!fallback)
+    {
+        fallback.reset(new ThreadPoolEngine(queueDepth));
+    }
+    return *fallback;
+}
+
+bool IoUringEngine::execute(std::vector<IORequest> &requests)
+{
+    Ring *ring = ringFailed ? nullptr : acquireRing();
+    if (!ring)
+    {
+        return fallbackEngine().execute(requests);
+    }
+    bool success = ring->execute(requests);
+    releaseRing(ring);
+    return success;
+}
+
+const char *IoUringEngine::getName() const
+{
+    return ringFailed ? "thread pool" : "io_uring";
+}
+
+ThreadPoolEngine::ThreadPoolEngine(unsigned int queueDepth) : pool(std::min(queueDepth, 64u))
+{
+}
+
+bool ThreadPoolEngine::execute(std::vector<IORequest> &requests)
+{
+    std::mutex doneMutex;
+    std::condition_variable allDone;
+    size_t remaining = requests.size();
+    bool success = true;
+
+    for (IORequest &request : requests)
+    {
+        pool.submit([&]
+                    {
+            completeSynchronously(request, 0);
+            std::lock_guard<std::mutex> lock(doneMutex);
+            success = success && request.result == static_cast<ssize_t>(request.getLength());
+            if (--remaining == 0)
+            {
+                allDone.notify_all();
+            } });
+    }
+
+    std::unique_lock<std::mutex> lock(doneMutex);
+    allDone.wait(lock, [&]
+                 { return remaining == 0; });
+    return success;
+}
+
+const char *ThreadPoolEngine::getName() const
+{
+    return "thread pool";
+}
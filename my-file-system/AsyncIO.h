@@ -0,0 +1,114 @@
+#ifndef ASYNCIO_H
+#define ASYNCIO_H
+
+#include "ThreadPool.h"
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+// One positioned transfer; buffers are filled or drained in order starting at offset
+struct IORequest
+{
+    int fd;
+    off_t offset;
+    std::vector<iovec> buffers;
+    bool write;
+    ssize_t result;
+
+    size_t getLength() const;
+};
+
+class AsyncIOEngine
+{
+public:
+    virtual ~AsyncIOEngine();
+
+    // Submits every request, keeping at most the queue depth in flight, and waits for all completions
+    virtual bool execute(std::vector<IORequest> &requests) = 0;
+    virtual const char *getName() const = 0;
+
+    // Returns io_uring when the kernel supports it, otherwise the thread-pool backend
+    static std::unique_ptr<AsyncIOEngine> create(unsigned int queueDepth);
+
+protected:
+    static void completeSynchronously(IORequest &request, size_t alreadyTransferred);
+};
+
+class ThreadPoolEngine;
+
+class IoUringEngine : public AsyncIOEngine
+{
+public:
+    static std::unique_ptr<IoUringEngine> create(unsigned int queueDepth);
+    ~IoUringEngine();
+
+    bool execute(std::vector<IORequest> &requests) override;
+    const char *getName() const override;
+
+private:
+    // One ring and its mappings, used by a single execute call at a time
+    struct Ring
+    {
+        int ringFd = -1;
+        unsigned int entries = 0;
+        void *sqRing = nullptr;
+        size_t sqRingSize = 0;
+        void *cqRing = nullptr;
+        size_t cqRingSize = 0;
+        io_uring_sqe *sqes = nullptr;
+        size_t sqesSize = 0;
+        unsigned *sqTail = nullptr;
+        unsigned *sqMask = nullptr;
+        unsigned *sqArray = nullptr;
+        unsigned *cqHead = nullptr;
+        unsigned *cqTail = nullptr;
+        unsigned *cqMask = nullptr;
+        io_uring_cqe *cqes = nullptr;
+        // Set when io_uring_enter fails for good; entries already published cannot be taken back, so
+        // the ring is never entered again
+        bool broken = false;
+
+        static std::unique_ptr<Ring> create(unsigned int queueDepth);
+        ~Ring();
+        bool execute(std::vector<IORequest> &requests);
+    };
+
+    explicit IoUringEngine(unsigned int queueDepth);
+    Ring *acquireRing();
+    void releaseRing(Ring *ring);
+    ThreadPoolEngine &fallbackEngine();
+
+    // Concurrent calls each borrow a ring, so none waits on another's completions. Rings are created
+    // on demand up to maxRings, which leaves room for callers blocked on the disk rather than the CPU;
+    // a caller beyond that waits for one to come back.
+    unsigned int queueDepth;
+    unsigned int maxRings;
+    std::vector<std::unique_ptr<Ring>> rings;
+    std::vector<Ring *> idleRings;
+    std::mutex ringsMutex;
+    std::condition_variable ringReleased;
+    // Once a ring breaks every call goes to the thread-pool backend
+    std::atomic<bool> ringFailed;
+    std::unique_ptr<ThreadPoolEngine> fallback;
+};
+
+class ThreadPoolEngine : public AsyncIOEngine
+{
+public:
+    explicit ThreadPoolEngine(unsigned int queueDepth);
+
+    bool execute(std::vector<IORequest> &requests) override;
+    const char *getName() const override;
+
+private:
+    ThreadPool pool;
+};
+
+#endif // ASYNCIO_H
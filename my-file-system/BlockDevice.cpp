@@ -0,0 +1,437 @@
+#include "BlockDevice.h"
+#include "CRC32C.h"
+#include <algorithm>
+#include <cstring>
+#include <climits>
+#include <fcntl.h>
+#include <iostream>
+#include <unistd.h>
+
+namespace
+{
+    // Longest transfer a run of adjacent blocks is merged into, so big chains still spread over the queue
+    const size_t maxRunBytes = 1024 * 1024;
+}
+
+BlockDevice::BlockDevice(const FAT12 &fat, unsigned int queueDepth) : fat(fat), queueDepth(std::max(1u, queueDepth)), fd(-1), stripeUnit(0), verifyReads(false)
+{
+}
+
+BlockDevice::~BlockDevice()
+{
+    close();
+}
+
+// The image may not exist yet when the device is constructed, so it is opened on first use
+int BlockDevice::descriptor()
+{
+    std::lock_guard<std::mutex> lock(openMutex);
+    if (fd < 0)
+    {
+        fd = ::open(fat.getFileName().c_str(), O_RDWR | O_CLOEXEC);
+        if (fd < 0)
+        {
+            std::cerr << "Failed to open file system.\n";
+        }
+    }
+    for (size_t i = memberFds.size(); i < stripeMembers.size(); ++i)
+    {
+        int member = ::open(stripeMembers[i].c_str(), O_RDWR | O_CLOEXEC);
+        if (member < 0)
+        {
+            std::cerr << "Failed to open stripe member " << stripeMembers[i] << ".\n";
+            return -1;
+        }
+        memberFds.push_back(member);
+    }
+    if (!engine)
+    {
+        engine = AsyncIOEngine::create(queueDepth);
+    }
+    return fd;
+}
+
+void BlockDevice::close()
+{
+    std::lock_guard<std::mutex> lock(openMutex);
+    if (fd >= 0)
+    {
+        ::close(fd);
+        fd = -1;
+    }
+    for (int member : memberFds)
+    {
+        ::close(member);
+    }
+    memberFds.clear();
+}
+
+// Maps a block to the file and offset holding it
+void BlockDevice::locate(int block, int &file, off_t &offset) const
+{
+    const off_t blockSize = static_cast<off_t>(fat.getBlockSize());
+    if (stripeMembers.empty())
+    {
+        file = fd;
+        offset = static_cast<off_t>(block) * blockSize;
+        return;
+    }
+    off_t unit = block / stripeUnit;
+    off_t row = unit / static_cast<off_t>(memberFds.size());
+    file = memberFds[unit % memberFds.size()];
+    offset = (row * stripeUnit + block % stripeUnit) * blockSize;
+}
+
+bool BlockDevice::readBlock(int block, char *buffer)
+{
+    return readBlocks(std::vector<int>(1, block), buffer, static_cast<size_t>(fat.getBlockSize()));
+}
+
+bool BlockDevice::writeBlock(int block, const char *buffer)
+{
+    return writeBlocks(std::vector<int>(1, block), buffer, static_cast<size_t>(fat.getBlockSize()));
+}
+
+// Reads length bytes laid out block after block; the whole chain is submitted at once
+bool BlockDevice::readBlocks(const std::vector<int> &blocks, char *buffer, size_t length)
+{
+    int file = descriptor();
+    if (file < 0)
+    {
+        return false;
+    }
+
+    const size_t blockSize = static_cast<size_t>(fat.getBlockSize());
+    const bool verify = verifyReads && !checksums.empty();
+    std::vector<char> tail;
+    std::vector<IORequest> requests;
+    size_t count = 0;
+    for (; count < blocks.size() && count * blockSize < length; ++count)
+    {
+        size_t bytes = std::min(blockSize, length - count * blockSize);
+        char *data = buffer + count * blockSize;
+        if (verify && bytes < blockSize)
+        {
+            // A checksum covers the whole block, so a partial block is read in full
+            tail.resize(blockSize);
+            data = tail.data();
+            bytes = blockSize;
+        }
+        appendTransfer(requests, blocks[count], data, bytes, false);
+    }
+    if (!engine->execute(requests))
+    {
+        return false;
+    }
+    if (!verify)
+    {
+        return true;
+    }
+
+    bool intact = true;
+    for (size_t i = 0; i < count; ++i)
+    {
+        bool partial = (i + 1) * blockSize > length;
+        const char *data = partial ? tail.data() : buffer + i * blockSize;
+        if (checksumBlock(data) != checksums[blocks[i]])
+        {
+            std::cerr << "Checksum mismatch in block " << blocks[i] << ".\n";
+            intact = false;
+        }
+        if (partial)
+        {
+            std::memcpy(buffer + i * blockSize, tail.data(), length - i * blockSize);
+        }
+    }
+    return intact;
+}
+
+// Writes whole blocks; a partial final block is padded with zeros
+bool BlockDevice::writeBlocks(const std::vector<int> &blocks, const char *buffer, size_t length)
+{
+    int file = descriptor();
+    if (file < 0)
+    {
+        return false;
+    }
+
+    const size_t blockSize = static_cast<size_t>(fat.getBlockSize());
+    std::vector<char> tail(blockSize, 0);
+    std::vector<char> zeros;
+    std::vector<uint32_t> newChecksums;
+    std::vector<IORequest> requests;
+    for (size_t i = 0; i < blocks.size(); ++i)
+    {
+        size_t offset = i * blockSize;
+        size_t bytes = offset < length ? std::min(blockSize, length - offset) : 0;
+        char *data;
+        if (bytes == blockSize)
+        {
+            data = const_cast<char *>(buffer) + offset;
+        }
+        else if (bytes == 0)
+        {
+            zeros.resize(blockSize, 0);
+            data = zeros.data();
+        }
+        else
+        {
+            std::memcpy(tail.data(), buffer + offset, bytes);
+            data = tail.data();
+        }
+        appendTransfer(requests, blocks[i], data, blockSize, true);
+        if (!checksums.empty())
+        {
+            newChecksums.push_back(checksumBlock(data));
+        }
+    }
+    if (!engine->execute(requests))
+    {
+        return false;
+    }
+    for (size_t i = 0; i < newChecksums.size(); ++i)
+    {
+        checksums[blocks[i]] = newChecksums[i];
+    }
+    return true;
+}
+
+// Punches the blocks out of the image so the host reclaims their space; they read back as zeros
+bool BlockDevice::discardBlocks(std::vector<int> blocks)
+{
+    int file = descriptor();
+    if (file < 0)
+    {
+        return false;
+    }
+
+    for (const Extent &extent : mergeExtents(blocks))
+    {
+        if (fallocate(extent.file, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, extent.offset, extent.length) != 0)
+        {
+            return false;
+        }
+    }
+
+    if (!checksums.empty())
+    {
+        std::vector<char> zeros(static_cast<size_t>(fat.getBlockSize()), 0);
+        uint32_t zeroChecksum = checksumBlock(zeros.data());
+        for (int block : blocks)
+        {
+            checksums[block] = zeroChecksum;
+        }
+    }
+    return true;
+}
+
+// Makes every block written so far durable. The descriptors are duplicated so a stripe change cannot
+// close them mid-flush, and the open lock is not held while the flush waits on the disk.
+bool BlockDevice::syncData()
+{
+    if (descriptor() < 0)
+    {
+        return false;
+    }
+    std::vector<int> files;
+    {
+        std::lock_guard<std::mutex> lock(openMutex);
+        files.push_back(::dup(fd));
+        for (int member : memberFds)
+        {
+            files.push_back(::dup(member));
+        }
+    }
+    bool synced = true;
+    for (int file : files)
+    {
+        synced = file >= 0 && ::fdatasync(file) == 0 && synced;
+        if (file >= 0)
+        {
+            ::close(file);
+        }
+    }
+    return synced;
+}
+
+// Full fsync of the image file, which also covers the metadata saved past the data area and the
+// file's length; fdatasync may leave the length behind
+bool BlockDevice::syncImage()
+{
+    if (descriptor() < 0)
+    {
+        return false;
+    }
+    int file;
+    {
+        std::lock_guard<std::mutex> lock(openMutex);
+        file = ::dup(fd);
+    }
+    bool synced = file >= 0 && ::fsync(file) == 0;
+    if (file >= 0)
+    {
+        ::close(file);
+    }
+    return synced;
+}
+
+void BlockDevice::setChecksums(const std::vector<uint32_t> &table)
+{
+    checksums = table;
+}
+
+const std::vector<uint32_t> &BlockDevice::getChecksums() const
+{
+    return checksums;
+}
+
+// Asks the kernel to start reading the blocks into the page cache
+void BlockDevice::adviseBlocks(const std::vector<int> &blocks)
+{
+    if (descriptor() < 0)
+    {
+        return;
+    }
+    for (const Extent &extent : mergeExtents(blocks))
+    {
+        posix_fadvise(extent.file, extent.offset, extent.length, POSIX_FADV_WILLNEED);
+    }
+}
+
+// Sorts the blocks by file and offset and joins the ones that are adjacent in the same file
+std::vector<BlockDevice::Extent> BlockDevice::mergeExtents(std::vector<int> blocks) const
+{
+    const off_t blockSize = static_cast<off_t>(fat.getBlockSize());
+    // Chains are mostly in order already, so the sorts are skipped when they have nothing to do
+    if (!std::is_sorted(blocks.begin(), blocks.end()))
+    {
+        std::sort(blocks.begin(), blocks.end());
+    }
+    blocks.erase(std::unique(blocks.begin(), blocks.end()), blocks.end());
+    std::vector<std::pair<int, off_t>> positions(blocks.size());
+    for (size_t i = 0; i < blocks.size(); ++i)
+    {
+        locate(blocks[i], positions[i].first, positions[i].second);
+    }
+    if (!std::is_sorted(positions.begin(), positions.end()))
+    {
+        std::sort(positions.begin(), positions.end());
+    }
+
+    std::vector<Extent> extents;
+    for (const auto &position : positions)
+    {
+        if (!extents.empty() && extents.back().file == position.first && extents.back().offset + extents.back().length == position.second)
+        {
+            extents.back().length += blockSize;
+        }
+        else
+        {
+            extents.push_back(Extent{position.first, position.second, blockSize});
+        }
+    }
+    return extents;
+}
+
+// Adds a block to the last request when it continues that request on disk, so a physically
+// contiguous run becomes one preadv/pwritev; the buffer pieces are merged when they touch too
+void BlockDevice::appendTransfer(std::vector<IORequest> &requests, int block, char *data, size_t bytes, bool write) const
+{
+    int file;
+    off_t offset;
+    locate(block, file, offset);
+    if (!requests.empty())
+    {
+        IORequest &last = requests.back();
+        size_t lastLength = last.getLength();
+        if (last.fd == file && last.write == write && last.offset + static_cast<off_t>(lastLength) == offset &&
+            lastLength + bytes <= maxRunBytes && last.buffers.size() < IOV_MAX)
+        {
+            iovec &piece = last.buffers.back();
+            if (static_cast<char *>(piece.iov_base) + piece.iov_len == data)
+            {
+                piece.iov_len += bytes;
+            }
+            else
+            {
+                last.buffers.push_back(iovec{data, bytes});
+            }
+            return;
+        }
+    }
+    requests.push_back(IORequest{file, offset, {iovec{data, bytes}}, write, 0});
+}
+
+// Switches the block layout; the members must already exist. Blocks are not moved.
+void BlockDevice::setStripes(const std::vector<std::string> &members, int unitBlocks)
+{
+    std::lock_guard<std::mutex> lock(openMutex);
+    for (int member : memberFds)
+    {
+        ::close(member);
+    }
+    memberFds.clear();
+    stripeMembers = members;
+    stripeUnit = members.empty() ? 0 : std::max(1, unitBlocks);
+}
+
+const std::vector<std::string> &BlockDevice::getStripeMembers() const
+{
+    return stripeMembers;
+}
+
+int BlockDevice::getStripeUnit() const
+{
+    return stripeUnit;
+}
+
+void BlockDevice::setVerifyReads(bool verify)
+{
+    verifyReads = verify;
+}
+
+uint32_t BlockDevice::checksumBlock(const char *data) const
+{
+    return CRC32C::compute(data, static_cast<size_t>(fat.getBlockSize()));
+}
+
+// Reads the blocks whole and compares them with the table; mismatches are appended to badBlocks
+bool BlockDevice::verifyBlocks(const std::vector<int> &blocks, std::vector<int> &badBlocks)
+{
+    int file = descriptor();
+    if (file < 0 || checksums.empty())
+    {
+        return false;
+    }
+
+    const size_t blockSize = static_cast<size_t>(fat.getBlockSize());
+    std::vector<char> buffer(blocks.size() * blockSize);
+    std::vector<IORequest> requests;
+    for (size_t i = 0; i < blocks.size(); ++i)
+    {
+        appendTransfer(requests, blocks[i], buffer.data() + i * blockSize, blockSize, false);
+    }
+    if (!engine->execute(requests))
+    {
+        return false;
+    }
+    for (size_t i = 0; i < blocks.size(); ++i)
+    {
+        if (checksumBlock(buffer.data() + i * blockSize) != checksums[blocks[i]])
+        {
+            badBlocks.push_back(blocks[i]);
+        }
+    }
+    return true;
+}
+
+unsigned int BlockDevice::getQueueDepth() const
+{
+    return queueDepth;
+}
+
+const char *BlockDevice::getEngineName()
+{
+    descriptor();
+    return engine->getName();
+}
@@ -0,0 +1,66 @@
+#ifndef BLOCKDEVICE_H
+#define BLOCKDEVICE_H
+
+#include "AsyncIO.h"
+#include "FAT12.h"
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Block layer over the image file: every data and directory block transfer goes through here
+class BlockDevice
+{
+public:
+    BlockDevice(const FAT12 &fat, unsigned int queueDepth = 32);
+    ~BlockDevice();
+
+    bool readBlock(int block, char *buffer);
+    bool writeBlock(int block, const char *buffer);
+    bool readBlocks(const std::vector<int> &blocks, char *buffer, size_t length);
+    bool writeBlocks(const std::vector<int> &blocks, const char *buffer, size_t length);
+    bool discardBlocks(std::vector<int> blocks);
+    bool syncData();
+    bool syncImage();
+    void adviseBlocks(const std::vector<int> &blocks);
+    void setChecksums(const std::vector<uint32_t> &table);
+    const std::vector<uint32_t> &getChecksums() const;
+    void setVerifyReads(bool verify);
+    bool verifyBlocks(const std::vector<int> &blocks, std::vector<int> &badBlocks);
+    uint32_t checksumBlock(const char *data) const;
+    void setStripes(const std::vector<std::string> &members, int unitBlocks);
+    const std::vector<std::string> &getStripeMembers() const;
+    int getStripeUnit() const;
+    unsigned int getQueueDepth() const;
+    const char *getEngineName();
+    void close();
+
+private:
+    int descriptor();
+    void locate(int block, int &file, off_t &offset) const;
+    void appendTransfer(std::vector<IORequest> &requests, int block, char *data, size_t bytes, bool write) const;
+    struct Extent
+    {
+        int file;
+        off_t offset;
+        off_t length;
+    };
+    std::vector<Extent> mergeExtents(std::vector<int> blocks) const;
+
+    const FAT12 &fat;
+    unsigned int queueDepth;
+    std::unique_ptr<AsyncIOEngine> engine;
+    int fd;
+    // Files the data blocks are striped over, stripeUnit blocks at a time in turn; empty when the
+    // image file holds the data itself
+    std::vector<std::string> stripeMembers;
+    std::vector<int> memberFds;
+    int stripeUnit;
+    std::mutex openMutex;
+    // CRC32C of every block as last written; empty when checksums are off
+    std::vector<uint32_t> checksums;
+    bool verifyReads;
+};
+
+#endif // BLOCKDEVICE_H
@@ -0,0 +1,223 @@
+#include "CRC32C.h"
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <nmmintrin.h>
+#define CRC32C_X86 1
+#endif
+
+namespace
+{
+    const uint32_t polynomial = 0x82F63B78; // Reflected Castagnoli polynomial
+
+    struct SliceTables
+    {
+        uint32_t table[8][256];
+
+        SliceTables()
+        {
+            for (uint32_t i = 0; i < 256; ++i)
+            {
+                uint32_t crc = i;
+                for (int bit = 0; bit < 8; ++bit)
+                {
+                    crc = (crc >> 1) ^ (polynomial & (0 - (crc & 1)));
+                }
+                table[0][i] = crc;
+            }
+            for (int slice = 1; slice < 8; ++slice)
+            {
+                for (uint32_t i = 0; i < 256; ++i)
+                {
+                    table[slice][i] = (table[slice - 1][i] >> 8) ^ table[0][table[slice - 1][i] & 0xFF];
+                }
+            }
+        }
+    };
+
+    const SliceTables &sliceTables()
+    {
+        static const SliceTables tables;
+        return tables;
+    }
+
+    // Eight bytes per step through eight lookup tables (little-endian load order)
+    uint32_t softwareCrc(const unsigned char *data, size_t length, uint32_t crc)
+    {
+        const uint32_t(&t)[8][256] = sliceTables().table;
+        while (length >= 8)
+        {
+            uint32_t low;
+            uint32_t high;
+            std::memcpy(&low, data, sizeof(low));
+            std::memcpy(&high, data + 4, sizeof(high));
+            low ^= crc;
+            crc = t[7][low & 0xFF] ^ t[6][(low >> 8) & 0xFF] ^ t[5][(low >> 16) & 0xFF] ^ t[4][low >> 24] ^
+                  t[3][high & 0xFF] ^ t[2][(high >> 8) & 0xFF] ^ t[1][(high >> 16) & 0xFF] ^ t[0][high >> 24];
+            data += 8;
+            length -= 8;
+        }
+        while (length-- > 0)
+        {
+            crc = t[0][(crc ^ *data++) & 0xFF] ^ (crc >> 8);
+        }
+        return crc;
+    }
+
+#ifdef CRC32C_X86
+#if defined(__x86_64__)
+    // Multiplies a CRC register by x^(8 * bytes) modulo the polynomial, i.e. feeds it that many zero
+    // bytes, with one table lookup per register byte
+    struct ShiftTable
+    {
+        size_t bytes;
+        uint32_t table[4][256];
+
+        // The shift is linear, so only the 32 single-bit registers are shifted bit by bit
+        explicit ShiftTable(size_t bytes) : bytes(bytes)
+        {
+            uint32_t basis[32];
+            for (int bit = 0; bit < 32; ++bit)
+            {
+                uint32_t crc = 1u << bit;
+                for (size_t step = 0; step < 8 * bytes; ++step)
+                {
+                    crc = (crc >> 1) ^ (polynomial & (0 - (crc & 1)));
+                }
+                basis[bit] = crc;
+            }
+            fill(basis);
+        }
+
+        // Longer shifts are built by repeating a shorter one
+        ShiftTable(const ShiftTable &base, int repeat) : bytes(base.bytes * repeat)
+        {
+            uint32_t basis[32];
+            for (int bit = 0; bit < 32; ++bit)
+            {
+                basis[bit] = 1u << bit;
+                for (int i = 0; i < repeat; ++i)
+                {
+                    basis[bit] = base.shift(basis[bit]);
+                }
+            }
+            fill(basis);
+        }
+
+        void fill(const uint32_t (&basis)[32])
+        {
+            for (int slice = 0; slice < 4; ++slice)
+            {
+                for (uint32_t i = 0; i < 256; ++i)
+                {
+                    uint32_t crc = 0;
+                    for (int bit = 0; bit < 8; ++bit)
+                    {
+                        crc ^= (i >> bit & 1) ? basis[8 * slice + bit] : 0;
+                    }
+                    table[slice][i] = crc;
+                }
+            }
+        }
+
+        uint32_t shift(uint32_t crc) const
+        {
+            return table[0][crc & 0xFF] ^ table[1][(crc >> 8) & 0xFF] ^ table[2][(crc >> 16) & 0xFF] ^ table[3][crc >> 24];
+        }
+    };
+
+    // Lane lengths for the interleaved loop, longest first
+    const ShiftTable *const *shiftTables()
+    {
+        static const ShiftTable small(64);
+        static const ShiftTable medium(small, 4);
+        static const ShiftTable large(medium, 8);
+        static const ShiftTable *const tables[] = {&large, &medium, &small};
+        return tables;
+    }
+#endif
+
+    __attribute__((target("sse4.2"))) uint32_t hardwareCrc(const unsigned char *data, size_t length, uint32_t crc)
+    {
+#if defined(__x86_64__)
+        // crc32 has a latency of three cycles but issues every cycle, so three independent lanes
+        // are run side by side and joined by shifting the earlier lanes past the later ones
+        const ShiftTable *const *tables = shiftTables();
+        for (int tier = 0; tier < 3; ++tier)
+        {
+            const ShiftTable &table = *tables[tier];
+            const size_t lane = table.bytes;
+            while (length >= 3 * lane)
+            {
+                uint64_t crc0 = crc;
+                uint64_t crc1 = 0;
+                uint64_t crc2 = 0;
+                for (size_t offset = 0; offset < lane; offset += 8)
+                {
+                    uint64_t word0;
+                    uint64_t word1;
+                    uint64_t word2;
+                    std::memcpy(&word0, data + offset, sizeof(word0));
+                    std::memcpy(&word1, data + lane + offset, sizeof(word1));
+                    std::memcpy(&word2, data + 2 * lane + offset, sizeof(word2));
+                    crc0 = _mm_crc32_u64(crc0, word0);
+                    crc1 = _mm_crc32_u64(crc1, word1);
+                    crc2 = _mm_crc32_u64(crc2, word2);
+                }
+                crc = table.shift(static_cast<uint32_t>(crc0)) ^ static_cast<uint32_t>(crc1);
+                crc = table.shift(crc) ^ static_cast<uint32_t>(crc2);
+                data += 3 * lane;
+                length -= 3 * lane;
+            }
+        }
+
+        uint64_t wide = crc;
+        while (length >= 8)
+        {
+            uint64_t word;
+            std::memcpy(&word, data, sizeof(word));
+            wide = _mm_crc32_u64(wide, word);
+            data += 8;
+            length -= 8;
+        }
+        crc = static_cast<uint32_t>(wide);
+#endif
+        while (length >= 4)
+        {
+            uint32_t word;
+            std::memcpy(&word, data, sizeof(word));
+            crc = _mm_crc32_u32(crc, word);
+            data += 4;
+            length -= 4;
+        }
+        while (length-- > 0)
+        {
+            crc = _mm_crc32_u8(crc, *data++);
+        }
+        return crc;
+    }
+#endif
+}
+
+bool CRC32C::hardwareAccelerated()
+{
+#ifdef CRC32C_X86
+    static const bool available = __builtin_cpu_supports("sse4.2");
+    return available;
+#else
+    return false;
+#endif
+}
+
+uint32_t CRC32C::compute(const void *data, size_t length, uint32_t crc)
+{
+    const unsigned char *bytes = static_cast<const unsigned char *>(data);
+    crc = ~crc;
+#ifdef CRC32C_X86
+    if (hardwareAccelerated())
+    {
+        return ~hardwareCrc(bytes, length, crc);
+    }
+#endif
+    return ~softwareCrc(bytes, length, crc);
+}
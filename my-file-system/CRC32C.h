@@ -0,0 +1,16 @@
+#ifndef CRC32C_H
+#define CRC32C_H
+
+#include <cstddef>
+#include <cstdint>
+
+// CRC-32C (Castagnoli). Uses the SSE4.2 crc32 instruction when the CPU has it and a
+// slicing-by-8 table implementation otherwise.
+class CRC32C
+{
+public:
+    static uint32_t compute(const void *data, size_t length, uint32_t crc = 0);
+    static bool hardwareAccelerated();
+};
+
+#endif // CRC32C_H
@@ -0,0 +1,178 @@
+#include "DedupeIndex.h"
+#include <cstring>
+
+namespace
+{
+    const uint64_t prime1 = 0x9E3779B185EBCA87ULL;
+    const uint64_t prime2 = 0xC2B2AE3D27D4EB4FULL;
+    const uint64_t prime3 = 0x165667B19E3779F9ULL;
+
+    uint64_t rotateLeft(uint64_t value, int bits)
+    {
+        return (value << bits) | (value >> (64 - bits));
+    }
+
+    uint64_t finalize(uint64_t value)
+    {
+        value ^= value >> 33;
+        value *= 0xFF51AFD7ED558CCDULL;
+        value ^= value >> 33;
+        value *= 0xC4CEB9FE1A85EC53ULL;
+        value ^= value >> 33;
+        return value;
+    }
+}
+
+bool DedupeIndex::Fingerprint::operator<(const Fingerprint &other) const
+{
+    return low != other.low ? low < other.low : high < other.high;
+}
+
+DedupeIndex::DedupeIndex(FAT12 &fat) : fat(fat)
+{
+}
+
+// Two independent 64-bit multiply-rotate lanes over the block, seeded with its length and successor
+DedupeIndex::Fingerprint DedupeIndex::fingerprint(const char *data, size_t length, int nextBlock)
+{
+    uint64_t seed = (static_cast<uint64_t>(static_cast<uint32_t>(nextBlock)) << 32) ^ length;
+    uint64_t low = seed ^ prime1;
+    uint64_t high = seed ^ prime2;
+
+    size_t i = 0;
+    for (; i + 8 <= length; i += 8)
+    {
+        uint64_t word;
+        std::memcpy(&word, data + i, sizeof(word));
+        low = rotateLeft(low ^ (word * prime2), 31) * prime1;
+        high = rotateLeft(high + (word * prime3), 29) * prime2;
+    }
+    if (i < length)
+    {
+        uint64_t word = 0;
+        std::memcpy(&word, data + i, length - i);
+        low = rotateLeft(low ^ (word * prime2), 31) * prime1;
+        high = rotateLeft(high + (word * prime3), 29) * prime2;
+    }
+
+    Fingerprint result;
+    result.low = finalize(low ^ rotateLeft(high, 17));
+    result.high = finalize(high + low);
+    return result;
+}
+
+int DedupeIndex::find(const Fingerprint &fingerprint) const
+{
+    std::lock_guard<std::mutex> lock(indexMutex);
+    auto it = blocksByFingerprint.find(fingerprint);
+    return it == blocksByFingerprint.end() ? -1 : it->second;
+}
+
+// Looks up a matching block and takes a reference on it while the index is locked, so a
+// concurrent release cannot free and recycle it in between; returns -1 when nothing matches or the
+// match cannot take another owner, so the caller stores a fresh copy
+int DedupeIndex::acquire(const Fingerprint &fingerprint)
+{
+    std::lock_guard<std::mutex> lock(indexMutex);
+    auto it = blocksByFingerprint.find(fingerprint);
+    if (it == blocksByFingerprint.end() || !fat.shareBlock(it->second))
+    {
+        return -1;
+    }
+    return it->second;
+}
+
+void DedupeIndex::insert(const Fingerprint &fingerprint, int block)
+{
+    std::lock_guard<std::mutex> lock(indexMutex);
+    auto previous = fingerprintsByBlock.find(block);
+    if (previous != fingerprintsByBlock.end())
+    {
+        blocksByFingerprint.erase(previous->second);
+    }
+    // A full block with the same content is replaced by the fresh copy and is no longer indexed
+    auto replaced = blocksByFingerprint.find(fingerprint);
+    if (replaced != blocksByFingerprint.end() && replaced->second != block)
+    {
+        fingerprintsByBlock.erase(replaced->second);
+    }
+    blocksByFingerprint[fingerprint] = block;
+    fingerprintsByBlock[block] = fingerprint;
+}
+
+// Drops one reference to a block and removes it from the index once it is freed
+bool DedupeIndex::release(int block)
+{
+    std::lock_guard<std::mutex> lock(indexMutex);
+    if (!fat.releaseBlock(block))
+    {
+        return false;
+    }
+    auto it = fingerprintsByBlock.find(block);
+    if (it != fingerprintsByBlock.end())
+    {
+        blocksByFingerprint.erase(it->second);
+        fingerprintsByBlock.erase(it);
+    }
+    return true;
+}
+
+// Must be called whenever a block's bytes or next link change in place
+void DedupeIndex::forget(int block)
+{
+    std::lock_guard<std::mutex> lock(indexMutex);
+    auto it = fingerprintsByBlock.find(block);
+    if (it != fingerprintsByBlock.end())
+    {
+        blocksByFingerprint.erase(it->second);
+        fingerprintsByBlock.erase(it);
+    }
+}
+
+void DedupeIndex::clear()
+{
+    std::lock_guard<std::mutex> lock(indexMutex);
+    blocksByFingerprint.clear();
+    fingerprintsByBlock.clear();
+}
+
+size_t DedupeIndex::size() const
+{
+    std::lock_guard<std::mutex> lock(indexMutex);
+    return blocksByFingerprint.size();
+}
+
+void DedupeIndex::save(std::ostream &out) const
+{
+    std::lock_guard<std::mutex> lock(indexMutex);
+    for (const auto &item : blocksByFingerprint)
+    {
+        int32_t block = item.second;
+        out.write(reinterpret_cast<const char *>(&item.first.low), sizeof(item.first.low));
+        out.write(reinterpret_cast<const char *>(&item.first.high), sizeof(item.first.high));
+        out.write(reinterpret_cast<const char *>(&block), sizeof(block));
+    }
+}
+
+// Entries pointing at blocks that are no longer allocated are dropped while loading
+void DedupeIndex::load(std::istream &in, uint32_t length)
+{
+    std::lock_guard<std::mutex> lock(indexMutex);
+    blocksByFingerprint.clear();
+    fingerprintsByBlock.clear();
+    const uint32_t recordSize = 2 * sizeof(uint64_t) + sizeof(int32_t);
+    for (uint32_t i = 0; i < length / recordSize; ++i)
+    {
+        Fingerprint fingerprint;
+        int32_t block;
+        in.read(reinterpret_cast<char *>(&fingerprint.low), sizeof(fingerprint.low));
+        in.read(reinterpret_cast<char *>(&fingerprint.high), sizeof(fingerprint.high));
+        in.read(reinterpret_cast<char *>(&block), sizeof(block));
+        if (in && fat.isBlockBusy(block))
+        {
+            blocksByFingerprint[fingerprint] = block;
+            fingerprintsByBlock[block] = fingerprint;
+        }
+    }
+    in.ignore(length % recordSize);
+}
@@ -0,0 +1,46 @@
+#ifndef DEDUPEINDEX_H
+#define DEDUPEINDEX_H
+
+#include "FAT12.h"
+#include <cstdint>
+#include <iostream>
+#include <map>
+#include <mutex>
+
+// Maps block fingerprints to the block holding that content. A FAT block has a single next link,
+// so the fingerprint covers the block's bytes and its successor: two chains share a block only
+// when everything after it is shared as well.
+class DedupeIndex
+{
+public:
+    struct Fingerprint
+    {
+        uint64_t low;
+        uint64_t high;
+
+        bool operator<(const Fingerprint &other) const;
+    };
+
+    explicit DedupeIndex(FAT12 &fat);
+
+    static Fingerprint fingerprint(const char *data, size_t length, int nextBlock);
+
+    int find(const Fingerprint &fingerprint) const;
+    int acquire(const Fingerprint &fingerprint);
+    void insert(const Fingerprint &fingerprint, int block);
+    bool release(int block);
+    void forget(int block);
+    void clear();
+    size_t size() const;
+
+    void save(std::ostream &out) const;
+    void load(std::istream &in, uint32_t length);
+
+private:
+    FAT12 &fat;
+    std::map<Fingerprint, int> blocksByFingerprint;
+    std::map<int, Fingerprint> fingerprintsByBlock;
+    mutable std::mutex indexMutex;
+};
+
+#endif // DEDUPEINDEX_H
@@ -1,4 +1,5 @@
 #include "DirectoryEntry.h"
+#include <algorithm>
 #include <ctime>
 #include <sstream>
 
@@ -12,7 +13,7 @@ DirectoryEntry::DirectoryEntry()
     std::memset(dateField, 0, sizeof(dateField));
 }
 
-DirectoryEntry::DirectoryEntry(const std::string &name, uint16_t firstBlockNumber, uint32_t size, char attributes)
+DirectoryEntry::DirectoryEntry(std::string_view name, uint16_t firstBlockNumber, uint32_t size, char attributes)
     : attributes(attributes), firstBlockNumber(firstBlockNumber), size(size)
 {
     setFileName(name);
@@ -26,6 +27,31 @@ std::string DirectoryEntry::getFileName() const
     return std::string(fileName);
 }
 
+std::string_view DirectoryEntry::getFileNameView() const
+{
+    return std::string_view(fileName, strnlen(fileName, sizeof(fileName)));
+}
+
+uint64_t DirectoryEntry::getNameKey() const
+{
+    static_assert(sizeof(fileName) == sizeof(uint64_t), "name key must cover the name field");
+    uint64_t key;
+    std::memcpy(&key, fileName, sizeof(key));
+    return key;
+}
+
+// Builds the key a stored name would have; names that could never be stored produce no key
+bool DirectoryEntry::makeNameKey(std::string_view name, uint64_t &key)
+{
+    if (name.size() >= sizeof(fileName) || name.find('\0') != std::string_view::npos)
+    {
+        return false;
+    }
+    key = 0;
+    std::memcpy(&key, name.data(), name.size());
+    return true;
+}
+
 uint32_t DirectoryEntry::getSize() const
 {
     return size;
@@ -41,20 +67,24 @@ char DirectoryEntry::getAttributes() const
     return attributes;
 }
 
-void DirectoryEntry::setFileName(const std::string &name)
+void DirectoryEntry::setFileName(std::string_view name)
 {
+    // Fields are zero-padded like strncpy, so equal names always have equal keys
+    auto copyField = [](char *field, size_t fieldSize, std::string_view value)
+    {
+        value = value.substr(0, std::min(value.find('\0'), fieldSize - 1));
+        std::memset(field, 0, fieldSize);
+        std::memcpy(field, value.data(), value.size());
+    };
     size_t dotPos = name.find_last_of('.');
-    if (dotPos == std::string::npos || dotPos > 8)
+    if (dotPos == std::string_view::npos || dotPos > 8)
     {
-        std::strncpy(fileName, name.c_str(), sizeof(fileName) - 1);
-        fileName[sizeof(fileName) - 1] = '\0';
+        copyField(fileName, sizeof(fileName), name);
     }
     else
     {
-        std::strncpy(fileName, name.substr(0, dotPos).c_str(), sizeof(fileName) - 1);
-        fileName[sizeof(fileName) - 1] = '\0';
-        std::strncpy(extension, name.substr(dotPos + 1).c_str(), sizeof(extension) - 1);
-        extension[sizeof(extension) - 1] = '\0';
+        copyField(fileName, sizeof(fileName), name.substr(0, dotPos));
+        copyField(extension, sizeof(extension), name.substr(dotPos + 1));
     }
 }
 
@@ -84,10 +114,17 @@ std::string DirectoryEntry::getPassword() const
     return std::string(reserved);
 }
 
+std::string_view DirectoryEntry::getPasswordView() const
+{
+    return std::string_view(reserved, strnlen(reserved, sizeof(reserved)));
+}
+
 void DirectoryEntry::setCurrentTime(char *timeField, char *dateField)
 {
+    // localtime_r: writers in different directories stamp entries at the same time
     std::time_t t = std::time(nullptr);
-    std::tm *now = std::localtime(&t);
+    std::tm local;
+    std::tm *now = localtime_r(&t, &local);
 
     uint16_t timeValue = (now->tm_hour << 11) | ((now->tm_min - 2) << 6) | (now->tm_sec / 2);
     timeField[0] = timeValue & 0xFF;
@@ -103,9 +140,20 @@ void DirectoryEntry::updateModificationTime()
     setCurrentTime(timeField, dateField);
 }
 
+// Packed FAT time and date words as stored in the entry
+uint16_t DirectoryEntry::getTimeValue() const
+{
+    return (timeField[1] << 8) | timeField[0];
+}
+
+uint16_t DirectoryEntry::getDateValue() const
+{
+    return (dateField[1] << 8) | dateField[0];
+}
+
 std::string DirectoryEntry::getFormattedTime() const
 {
-    uint16_t timeValue = (timeField[1] << 8) | timeField[0];
+    uint16_t timeValue = getTimeValue();
     int hour = (timeValue >> 11) & 0x1F;
     int minute = (timeValue >> 5) & 0x3F;
     int second = (timeValue & 0x1F) * 2;
@@ -118,7 +166,7 @@ std::string DirectoryEntry::getFormattedTime() const
 
 std::string DirectoryEntry::getFormattedDate() const
 {
-    uint16_t dateValue = (dateField[1] << 8) | dateField[0];
+    uint16_t dateValue = getDateValue();
     int year = ((dateValue >> 9) & 0x7F) + 1980;
     int month = (dateValue >> 5) & 0x0F;
     int day = dateValue & 0x1F;
@@ -1,29 +1,39 @@
 #ifndef DIRECTORYENTRY_H
 #define DIRECTORYENTRY_H
 
+#include <cstdint>
 #include <string>
+#include <string_view>
 #include <cstring>
 
 class DirectoryEntry {
 public:
     DirectoryEntry();
-    DirectoryEntry(const std::string &name, uint16_t firstBlockNumber, uint32_t size, char attributes);
+    DirectoryEntry(std::string_view name, uint16_t firstBlockNumber, uint32_t size, char attributes);
 
     std::string getFileName() const;
+    // Views the name in place, for callers that must not allocate per entry
+    std::string_view getFileNameView() const;
+    // The name field read as one integer; two entries match when their keys are equal
+    uint64_t getNameKey() const;
+    static bool makeNameKey(std::string_view name, uint64_t &key);
     uint32_t getSize() const;
     uint16_t getFirstBlock() const;
     char getAttributes() const;
 
-    void setFileName(const std::string &name);
+    void setFileName(std::string_view name);
     void setAttributes(char attr);
     void setFirstBlock(uint16_t block);
     void setSize(uint32_t s);
     void setPassword(const std::string &password);
     std::string getPassword() const;
+    std::string_view getPasswordView() const;
     void setCurrentTime(char *timeField, char *dateField);
     void updateModificationTime();
     std::string getFormattedTime() const;
     std::string getFormattedDate() const;
+    uint16_t getTimeValue() const;
+    uint16_t getDateValue() const;
 
 private:
     char fileName[8];
@@ -1,10 +1,34 @@
 #include "FAT12.h"
+#include <algorithm>
 #include <fstream>
-#include <cstring>
 
-FAT12::FAT12(double blockSizeKB, const std::string &fileName) : fileName(fileName), blockSize(static_cast<double>(blockSizeKB * 1024))
+namespace
+{
+    // Getters read the table without the allocator lock, so every field a reader can see is loaded and
+    // stored whole. FATEntry stays a plain struct: it is written to disk and copied into snapshots.
+    template <typename T>
+    T load(const T &field)
+    {
+        return __atomic_load_n(&field, __ATOMIC_ACQUIRE);
+    }
+
+    template <typename T>
+    void store(T &field, T value)
+    {
+        __atomic_store_n(&field, value, __ATOMIC_RELEASE);
+    }
+
+    void reset(FAT12::FATEntry &entry, bool busy, int nextBlock)
+    {
+        store(entry.holeBlocks, uint8_t(0));
+        store(entry.shareCount, uint16_t(0));
+        store(entry.nextBlock, nextBlock);
+        store(entry.isBusy, busy);
+    }
+}
+
+FAT12::FAT12(double blockSizeKB, const std::string &fileName) : fileName(fileName), blockSize(static_cast<double>(blockSizeKB * 1024)), totalBlocks(defaultTotalBlocks), FAT(defaultTotalBlocks, FATEntry{false, 0, 0, -1}), freeBlocks(defaultTotalBlocks)
 {
-    std::memset(FAT, 0, sizeof(FAT));
 }
 
 void FAT12::initializeFileSystem()
@@ -21,8 +45,11 @@ void FAT12::initializeFileSystem()
     for (int i = 0; i < totalBlocks; ++i)
     {
         FAT[i].isBusy = false;
+        FAT[i].holeBlocks = 0;
+        FAT[i].shareCount = 0;
         FAT[i].nextBlock = -1;
     }
+    freeBlocks = totalBlocks;
 
     // Allocate the root directory block
     allocateBlock();
@@ -56,32 +83,119 @@ int FAT12::getFATEntrySize() const
 
 int FAT12::allocateBlock()
 {
+    std::lock_guard<std::mutex> lock(allocatorMutex);
     for (int i = 0; i < totalBlocks; ++i)
     {
         if (!FAT[i].isBusy)
         {
-            FAT[i].isBusy = true;
-            FAT[i].nextBlock = -1;
+            reset(FAT[i], true, -1);
+            --freeBlocks;
             return i;
         }
     }
     return -1; // No free blocks available
 }
 
+// Allocates count blocks in one pass and links them; returns an empty chain if space runs out
+std::vector<int> FAT12::allocateChain(int count)
+{
+    std::lock_guard<std::mutex> lock(allocatorMutex);
+    std::vector<int> blocks;
+    if (count > freeBlocks)
+    {
+        return blocks;
+    }
+    for (int i = 0; i < totalBlocks && static_cast<int>(blocks.size()) < count; ++i)
+    {
+        if (!FAT[i].isBusy)
+        {
+            blocks.push_back(i);
+        }
+    }
+
+    if (static_cast<int>(blocks.size()) < count)
+    {
+        return std::vector<int>();
+    }
+
+    for (size_t i = 0; i < blocks.size(); ++i)
+    {
+        reset(FAT[blocks[i]], true, i + 1 < blocks.size() ? blocks[i + 1] : -1);
+    }
+    freeBlocks -= count;
+    return blocks;
+}
+
 void FAT12::freeBlock(int block)
 {
+    std::lock_guard<std::mutex> lock(allocatorMutex);
     if (block >= 0 && block < totalBlocks)
     {
-        FAT[block].isBusy = false;
-        FAT[block].nextBlock = -1;
+        freeBlocks += FAT[block].isBusy ? 1 : 0;
+        reset(FAT[block], false, -1);
+    }
+}
+
+// Adds an owner to a block so a cloned chain can reference it without copying data; returns false,
+// leaving the block untouched, when it is free or its owner count is already at the limit
+bool FAT12::shareBlock(int block)
+{
+    std::lock_guard<std::mutex> lock(allocatorMutex);
+    if (block < 0 || block >= totalBlocks || !FAT[block].isBusy || FAT[block].shareCount == UINT16_MAX)
+    {
+        return false;
+    }
+    store(FAT[block].shareCount, uint16_t(FAT[block].shareCount + 1));
+    return true;
+}
+
+// Drops one owner and frees the block once nobody references it; returns true when freed
+bool FAT12::releaseBlock(int block)
+{
+    std::lock_guard<std::mutex> lock(allocatorMutex);
+    if (block < 0 || block >= totalBlocks || !FAT[block].isBusy)
+    {
+        return false;
+    }
+    if (FAT[block].shareCount > 0)
+    {
+        store(FAT[block].shareCount, uint16_t(FAT[block].shareCount - 1));
+        return false;
+    }
+    store(FAT[block].nextBlock, -1);
+    store(FAT[block].isBusy, false);
+    ++freeBlocks;
+    return true;
+}
+
+int FAT12::getRefCount(int block) const
+{
+    if (block >= 0 && block < totalBlocks && load(FAT[block].isBusy))
+    {
+        return load(FAT[block].shareCount) + 1;
     }
+    return 0;
 }
 
+int FAT12::getSharedBlockCount() const
+{
+    int sharedBlocks = 0;
+    for (int i = 0; i < totalBlocks; ++i)
+    {
+        if (load(FAT[i].isBusy) && load(FAT[i].shareCount) > 0)
+        {
+            ++sharedBlocks;
+        }
+    }
+    return sharedBlocks;
+}
+
+// Links and holes belong to the owner of an allocated block, so setting them needs no lock
 void FAT12::setNextBlock(int block, int nextBlock)
 {
     if (block >= 0 && block < totalBlocks)
     {
-        FAT[block].nextBlock = nextBlock;
+        store(FAT[block].nextBlock, nextBlock);
     }
 }
 
@@ -89,16 +203,33 @@ int FAT12::getNextBlock(int block) const
 {
     if (block >= 0 && block < totalBlocks)
     {
-        return FAT[block].nextBlock;
+        return load(FAT[block].nextBlock);
     }
     return -1;
 }
 
+void FAT12::setHoleBlocks(int block, int count)
+{
+    if (block >= 0 && block < totalBlocks)
+    {
+        store(FAT[block].holeBlocks, static_cast<uint8_t>(count < maxHoleBlocks ? count : maxHoleBlocks));
+    }
+}
+
+int FAT12::getHoleBlocks(int block) const
+{
+    if (block >= 0 && block < totalBlocks)
+    {
+        return load(FAT[block].holeBlocks);
+    }
+    return 0;
+}
+
 bool FAT12::isBlockBusy(int block) const
 {
     if (block >= 0 && block < totalBlocks)
     {
-        return FAT[block].isBusy;
+        return load(FAT[block].isBusy);
     }
     return false;
 }
@@ -108,6 +239,36 @@ void FAT12::setBlockSize(double newBlockSize)
     blockSize = newBlockSize;
 }
 
+// Grows or shrinks the table; blocks cut off by a shrink must already be free
+void FAT12::setTotalBlocks(int count)
+{
+    std::lock_guard<std::mutex> lock(allocatorMutex);
+    freeBlocks += count - totalBlocks;
+    FAT.resize(count, FATEntry{false, 0, 0, -1});
+    totalBlocks = count;
+}
+
+// Moves a block's entry to a free slot; the caller repoints links and copies the data
+void FAT12::relocateBlock(int from, int to)
+{
+    std::lock_guard<std::mutex> lock(allocatorMutex);
+    FAT[to] = FAT[from];
+    FAT[from] = FATEntry{false, 0, 0, -1};
+}
+
+int FAT12::getFreeBlockCount() const
+{
+    return freeBlocks;
+}
+
+// For callers that fill the table directly, such as loading an image
+void FAT12::recountFreeBlocks()
+{
+    std::lock_guard<std::mutex> lock(allocatorMutex);
+    freeBlocks = static_cast<int>(std::count_if(FAT.begin(), FAT.end(), [](const FATEntry &entry)
+                                                { return !entry.isBusy; }));
+}
+
 double FAT12::getBlockSize() const
 {
     return blockSize;
@@ -3,6 +3,10 @@
 
 #include <string>
 #include <iostream>
+#include <vector>
+#include <atomic>
+#include <cstdint>
+#include <mutex>
 
 class FAT12
 {
@@ -15,20 +19,48 @@ public:
     double getBlockSize() const;
     int getFATEntrySize() const;
     int allocateBlock();
+    std::vector<int> allocateChain(int count);
     void freeBlock(int block);
+    bool shareBlock(int block);
+    bool releaseBlock(int block);
+    int getRefCount(int block) const;
+    int getSharedBlockCount() const;
     void setNextBlock(int block, int nextBlock);
     int getNextBlock(int block) const;
+    void setHoleBlocks(int block, int count);
+    int getHoleBlocks(int block) const;
     bool isBlockBusy(int block) const;
     void setBlockSize(double blockSize);
+    void setTotalBlocks(int count);
+    void relocateBlock(int from, int to);
+    int getFreeBlockCount() const;
+    void recountFreeBlocks();
     std::string fileName;
     double blockSize;
-    static const int totalBlocks = 4096;
+    // Images written before resize support always have this many blocks
+    static const int defaultTotalBlocks = 4096;
+    // Directory entries keep the first block in 16 bits, with 0xFFFF meaning no block
+    static const int maxTotalBlocks = 0xFFFF;
+    int totalBlocks;
+    static const int maxHoleBlocks = 255;
     struct FATEntry
     {
         bool isBusy;
+        // Zero blocks that logically follow this one before nextBlock; they have no storage
+        uint8_t holeBlocks;
+        // Owners beyond the first; stored in what used to be padding so older images load as unshared
+        uint16_t shareCount;
         int nextBlock;
     };
-    FATEntry FAT[totalBlocks];
+    static_assert(sizeof(FATEntry) == 8, "FAT entries are stored on disk as 8 bytes");
+    std::vector<FATEntry> FAT;
+
+private:
+    // Serializes allocating, sharing, releasing and freeing blocks. Lookups such as getNextBlock and
+    // isBlockBusy take no lock, and neither do the link and hole setters used on blocks the caller owns.
+    mutable std::mutex allocatorMutex;
+    // Kept in step by every allocator call so statfs never scans the table
+    std::atomic<int> freeBlocks;
 };
 
 #endif // FAT12_H
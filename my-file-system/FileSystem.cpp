@@ -4,9 +4,320 @@
 #include <sstream>
 #include <algorithm>
 #include <cstring>
+#include <atomic>
 #include <bitset>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <filesystem>
+#include <iomanip>
+#include <set>
+#include <tuple>
+#include "ThreadPool.h"
+#include "LZCodec.h"
+#include "CRC32C.h"
+#include "TarHeader.h"
+#include "ReadAhead.h"
+#include "PatternSearch.h"
+
+namespace
+{
+    // Block 0 is reserved for the superblock: block size, then magic, version and feature flags
+    const uint32_t superblockMagic = 0x32314146; // "FA12"
+    // Version 2 adds the block count after the feature bits
+    const uint32_t superblockVersion = 2;
+    const uint32_t featureDedupe = 0x01;
+    const uint32_t featureDiscard = 0x02;
+    const uint32_t featureChecksums = 0x04;
+
+    // Metadata sections follow the directory entries as tag, length, payload; tag 0 ends the list
+    const uint32_t sectionEnd = 0;
+    const uint32_t sectionDedupeIndex = 1;
+    const uint32_t sectionBlockChecksums = 2;
+    // CRC32C of the superblock fields and every metadata byte before this section
+    const uint32_t sectionMetadataChecksum = 3;
+    const uint32_t sectionSnapshot = 4;
+    const uint32_t sectionStripes = 5;
+    const uint32_t sectionUsage = 6;
+
+    const size_t scrubBatchBlocks = 256;
+    // Blocks moved per read/write pair when a shrink empties the tail
+    const size_t resizeBatchBlocks = 256;
+
+    // Archive data moves through one buffer of this size per operation
+    const size_t tarChunkBytes = 1024 * 1024;
+
+    // grep reads each file through a buffer of this size
+    const size_t searchChunkBytes = 1024 * 1024;
+
+    // An inline file's data follows its entry on the same page, 31 bytes to a slot. The first byte of
+    // every data slot stays zero, so name scans read the slot as empty.
+    const size_t inlineSlotBytes = sizeof(DirectoryEntry) - 1;
+    const size_t inlineMaxBytes = 4 * inlineSlotBytes;
+
+    size_t inlineDataSlots(size_t size)
+    {
+        return (size + inlineSlotBytes - 1) / inlineSlotBytes;
+    }
+
+    // Data slots that follow a page slot; zero for anything but an inline file's entry
+    size_t inlineSlots(const DirectoryEntry &slot)
+    {
+        return (slot.getAttributes() & 0x08) && !slot.getFileNameView().empty() ? inlineDataSlots(slot.getSize()) : 0;
+    }
+
+    bool slotsFree(const std::vector<DirectoryEntry> &page, size_t first, size_t count)
+    {
+        if (first + count > page.size())
+        {
+            return false;
+        }
+        for (size_t i = first; i < first + count; ++i)
+        {
+            if (!page[i].getFileNameView().empty())
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    void storeInlineData(std::vector<DirectoryEntry> &page, size_t slot, const std::string &content)
+    {
+        for (size_t i = 0; i < inlineDataSlots(content.size()); ++i)
+        {
+            char *bytes = reinterpret_cast<char *>(&page[slot + 1 + i]);
+            std::memset(bytes, 0, sizeof(DirectoryEntry));
+            content.copy(bytes + 1, inlineSlotBytes, i * inlineSlotBytes);
+        }
+    }
+
+    bool loadInlineData(const std::vector<DirectoryEntry> &page, size_t slot, std::string &content)
+    {
+        size_t size = page[slot].getSize();
+        if (slot + inlineDataSlots(size) >= page.size())
+        {
+            return false;
+        }
+        content.clear();
+        for (size_t i = 0; i < inlineDataSlots(size); ++i)
+        {
+            const char *bytes = reinterpret_cast<const char *>(&page[slot + 1 + i]);
+            content.append(bytes + 1, std::min(inlineSlotBytes, size - content.size()));
+        }
+        return true;
+    }
+
+    // Empties an inline file's data slots before its entry is replaced or removed
+    void clearInlineData(std::vector<DirectoryEntry> &page, size_t slot)
+    {
+        size_t end = std::min(page.size(), slot + 1 + inlineSlots(page[slot]));
+        std::fill(page.begin() + slot + 1, page.begin() + end, DirectoryEntry());
+    }
+
+    // Listing formatters append into one reusable buffer instead of going through streams
+    void appendNumber(std::string &buffer, uint64_t value)
+    {
+        char digits[20];
+        int count = 0;
+        do
+        {
+            digits[count++] = static_cast<char>('0' + value % 10);
+            value /= 10;
+        } while (value > 0);
+        while (count > 0)
+        {
+            buffer.push_back(digits[--count]);
+        }
+    }
+
+    void appendTwoDigits(std::string &buffer, int value)
+    {
+        if (value < 10)
+        {
+            buffer.push_back('0');
+        }
+        appendNumber(buffer, static_cast<uint64_t>(value));
+    }
+
+    // Same layout as getFormattedDate() and getFormattedTime()
+    void appendTimestamp(std::string &buffer, const DirectoryEntry &entry)
+    {
+        uint16_t dateValue = entry.getDateValue();
+        uint16_t timeValue = entry.getTimeValue();
+        appendNumber(buffer, ((dateValue >> 9) & 0x7F) + 1980);
+        buffer.push_back('-');
+        appendTwoDigits(buffer, (dateValue >> 5) & 0x0F);
+        buffer.push_back('-');
+        appendTwoDigits(buffer, dateValue & 0x1F);
+        buffer.push_back(' ');
+        appendTwoDigits(buffer, (timeValue >> 11) & 0x1F);
+        buffer.push_back(':');
+        appendTwoDigits(buffer, (timeValue >> 5) & 0x3F);
+        buffer.push_back(':');
+        appendTwoDigits(buffer, (timeValue & 0x1F) * 2);
+    }
+
+    void appendJsonString(std::string &buffer, std::string_view value)
+    {
+        static const char hex[] = "0123456789abcdef";
+        buffer.push_back('"');
+        for (unsigned char c : value)
+        {
+            if (c == '"' || c == '\\')
+            {
+                buffer.push_back('\\');
+                buffer.push_back(static_cast<char>(c));
+            }
+            else if (c < 0x20 || c >= 0x7F)
+            {
+                buffer.append("\\u00");
+                buffer.push_back(hex[c >> 4]);
+                buffer.push_back(hex[c & 0x0F]);
+            }
+            else
+            {
+                buffer.push_back(static_cast<char>(c));
+            }
+        }
+        buffer.push_back('"');
+    }
+
+    // Same letters as getAttributesString(), written straight from the attribute bits
+    void appendAttributes(std::string &buffer, char attributes)
+    {
+        buffer.push_back((attributes & 0x01) ? 'r' : '-');
+        buffer.push_back((attributes & 0x02) ? 'w' : '-');
+        if (attributes & 0x04)
+        {
+            buffer.push_back('c');
+        }
+    }
+
+    // Modification time as dir shows it, in the local time zone. Packed dates can decode to the
+    // future; those are clamped to now so extracting tools do not complain.
+    int64_t entryTime(const DirectoryEntry &entry)
+    {
+        uint16_t dateValue = entry.getDateValue();
+        uint16_t timeValue = entry.getTimeValue();
+        std::tm time = {};
+        time.tm_year = ((dateValue >> 9) & 0x7F) + 80;
+        time.tm_mon = ((dateValue >> 5) & 0x0F) - 1;
+        time.tm_mday = dateValue & 0x1F;
+        time.tm_hour = (timeValue >> 11) & 0x1F;
+        time.tm_min = (timeValue >> 5) & 0x3F;
+        time.tm_sec = (timeValue & 0x1F) * 2;
+        time.tm_isdst = -1;
+        std::time_t seconds = std::mktime(&time);
+        std::time_t now = std::time(nullptr);
+        return static_cast<int64_t>(seconds == -1 || seconds > now ? now : seconds);
+    }
+
+    // Matches one [...] class at pattern[p]; p is left past the closing bracket. An unterminated
+    // bracket is an ordinary character.
+    bool matchBracket(std::string_view pattern, size_t &p, char c)
+    {
+        size_t i = p + 1;
+        bool negate = i < pattern.size() && (pattern[i] == '!' || pattern[i] == '^');
+        if (negate)
+        {
+            ++i;
+        }
+        bool matched = false;
+        size_t first = i;
+        for (; i < pattern.size() && (pattern[i] != ']' || i == first); ++i)
+        {
+            if (i + 2 < pattern.size() && pattern[i + 1] == '-' && pattern[i + 2] != ']')
+            {
+                matched |= pattern[i] <= c && c <= pattern[i + 2];
+                i += 2;
+            }
+            else
+            {
+                matched |= pattern[i] == c;
+            }
+        }
+        if (i >= pattern.size())
+        {
+            ++p;
+            return c == '[';
+        }
+        p = i + 1;
+        return matched != negate;
+    }
+
+    // Shell-style glob with *, ? and [...], matched in place with one backtrack point for the
+    // last star
+    bool globMatch(std::string_view pattern, std::string_view name)
+    {
+        size_t p = 0;
+        size_t n = 0;
+        size_t starPattern = std::string_view::npos;
+        size_t starName = 0;
+        while (n < name.size())
+        {
+            if (p < pattern.size() && pattern[p] == '*')
+            {
+                starPattern = ++p;
+                starName = n;
+                continue;
+            }
+            if (p < pattern.size())
+            {
+                size_t next = p;
+                bool matched = pattern[p] == '[' ? matchBracket(pattern, next, name[n])
+                                                 : (++next, pattern[p] == '?' || pattern[p] == name[n]);
+                if (matched)
+                {
+                    p = next;
+                    ++n;
+                    continue;
+                }
+            }
+            if (starPattern == std::string_view::npos)
+            {
+                return false;
+            }
+            p = starPattern;
+            n = ++starName;
+        }
+        while (p < pattern.size() && pattern[p] == '*')
+        {
+            ++p;
+        }
+        return p == pattern.size();
+    }
+
+    // Packed date and time as one number that orders like the timestamp
+    uint32_t modificationStamp(const DirectoryEntry &entry)
+    {
+        return static_cast<uint32_t>(entry.getDateValue()) << 16 | entry.getTimeValue();
+    }
 
-FileSystem::FileSystem(double blockSizeKB, const std::string &fileName) : fat(blockSizeKB, fileName)
+    void writeSection(std::ostream &file, uint32_t tag, const std::string &payload)
+    {
+        uint32_t length = payload.size();
+        file.write(reinterpret_cast<const char *>(&tag), sizeof(tag));
+        file.write(reinterpret_cast<const char *>(&length), sizeof(length));
+        file.write(payload.data(), payload.size());
+    }
+
+    // Locks two directories exclusively without deadlocking against another pair
+    void lockDirectoryPair(std::unique_lock<std::shared_mutex> &first, std::unique_lock<std::shared_mutex> &second)
+    {
+        if (first.mutex() == second.mutex())
+        {
+            first.lock();
+            second.release();
+        }
+        else
+        {
+            std::lock(first, second);
+        }
+    }
+}
+
+FileSystem::FileSystem(double blockSizeKB, const std::string &fileName, unsigned int ioQueueDepth) : fat(blockSizeKB, fileName), device(fat, ioQueueDepth), dedupe(fat), features(0), metadataChecksum(MetadataChecksum::Absent), snapshotHolds(FAT12::defaultTotalBlocks, 0), rootEntry(nullptr), rootDirectoryBlock(-1), usageValid(false), syncPolicy(SyncPolicy::None), syncIntervalMs(1000), flusherStop(false)
 {
     if (filesystemExists(fileName))
     {
@@ -18,6 +329,11 @@ FileSystem::FileSystem(double blockSizeKB, const std::string &fileName) : fat(bl
     }
 }
 
+FileSystem::~FileSystem()
+{
+    stopFlusher();
+}
+
 void FileSystem::initializeFileSystem()
 {
     if (filesystemExists(fat.getFileName()))
@@ -29,6 +345,11 @@ void FileSystem::initializeFileSystem()
         fat.initializeFileSystem();
         directoryEntries.clear();
 
+        // New images start out zero filled and checksummed
+        features |= featureChecksums;
+        std::vector<char> zeros(static_cast<size_t>(fat.getBlockSize()), 0);
+        device.setChecksums(std::vector<uint32_t>(fat.getTotalBlocks(), device.checksumBlock(zeros.data())));
+
         // Add the root directory
         int rootBlock = fat.allocateBlock();
         DirectoryEntry root("/", rootBlock, 0, 0x13); // 0x10: directory attribute
@@ -38,10 +359,12 @@ void FileSystem::initializeFileSystem()
         // Write the root directory to the file
         writeDirectoryEntryToPage(root.getFirstBlock(), root);
     }
+    rebuildEntryIndex();
 }
 
 void FileSystem::listDirectory() const
 {
+    std::shared_lock<std::shared_mutex> entriesLock(entriesMutex);
     for (const auto &entry : directoryEntries)
     {
         std::cout << "File Name: " << entry.getFileName()
@@ -55,6 +378,7 @@ void FileSystem::listDirectory() const
 
 void FileSystem::printDirectoryPages()
 {
+    std::unique_lock<std::shared_mutex> treeLock(treeMutex);
     std::cout << "Directory Pages:\n";
     for (const auto &entry : directoryEntries)
     {
@@ -63,20 +387,17 @@ void FileSystem::printDirectoryPages()
             std::cout << "Directory: " << entry.getFileName() << " at block " << entry.getFirstBlock() << "\n";
 
             int block = entry.getFirstBlock();
+            std::vector<DirectoryEntry> page;
             while (block != -1)
             {
-                std::ifstream file(fat.getFileName(), std::ios::binary);
-                if (!file.is_open())
+                if (!readDirectoryPage(block, page))
                 {
                     std::cerr << "Failed to open file system.\n";
                     return;
                 }
 
-                file.seekg(block * fat.getBlockSize(), std::ios::beg);
-                for (size_t i = 0; i < fat.getBlockSize() / sizeof(DirectoryEntry); ++i)
+                for (const DirectoryEntry &dirEntry : page)
                 {
-                    DirectoryEntry dirEntry;
-                    file.read(reinterpret_cast<char *>(&dirEntry), sizeof(DirectoryEntry));
                     if (!dirEntry.getFileName().empty())
                     {
                         std::cout << "File Name: " << dirEntry.getFileName()
@@ -88,7 +409,6 @@ void FileSystem::printDirectoryPages()
                     }
                 }
                 block = fat.getNextBlock(block);
-                file.close();
             }
         }
     }
@@ -102,15 +422,21 @@ void FileSystem::printFileSystem() const
 
 void FileSystem::makeDirectory(const std::string &dirName)
 {
-    std::string parentName = getParentDirectoryName(dirName);
-    std::string splittedDirName = getDirectoryName(dirName);
+    std::unique_lock<std::shared_mutex> treeLock(treeMutex);
+    std::string_view parentName = getParentDirectoryName(dirName);
+    std::string_view splittedDirName = getDirectoryName(dirName);
 
-    DirectoryEntry *parentDir = findDirectoryEntry(parentName);
+    DirectoryEntry *parentDir = findDirectory(parentName);
     if (!parentDir)
     {
         std::cerr << "Parent directory " << parentName << " does not exist.\n";
         return;
     }
+    if (splittedDirName.empty() || fileExistinDirectoryEntry(parentDir, splittedDirName))
+    {
+        std::cerr << "File already exists.\n";
+        return;
+    }
 
     int block = fat.allocateBlock();
     if (block == -1)
@@ -121,74 +447,75 @@ void FileSystem::makeDirectory(const std::string &dirName)
 
     DirectoryEntry newDir(splittedDirName, block, 0, 0x13); // Set as directory
     newDir.updateModificationTime();
-    directoryEntries.push_back(newDir);
+    addDirectoryEntry(newDir, parentDir);
 
-    writeDirectoryEntryToPage(newDir.getFirstBlock(), newDir);
-    writeDirectoryEntryToPage(newDir.getFirstBlock(), *findDirectoryEntry(parentName));
-    writeDirectoryEntryToPage(findDirectoryEntry(parentName)->getFirstBlock(), newDir);
+    // Freed blocks keep their old bytes, so the new directory page is built from scratch
+    appendDirectoryEntries(newDir.getFirstBlock(), {newDir, *parentDir}, true);
+    writeDirectoryEntryToPage(parentDir->getFirstBlock(), newDir);
+    addDirectoryUsage(block, parentDir->getFirstBlock());
+    chargeUsage(parentDir->getFirstBlock(), entryUsage(newDir));
 }
 
 void FileSystem::removeDirectory(const std::string &dirName)
 {
+    std::unique_lock<std::shared_mutex> treeLock(treeMutex);
     std::cout << "Removing directory: " << dirName << "\n";
-    auto it = std::find_if(directoryEntries.begin(), directoryEntries.end(),
-                           [&](const DirectoryEntry &entry)
-                           { return entry.getFileName() == dirName && ((entry.getAttributes() & 0x10) || (entry.getAttributes() & 0x11) || (entry.getAttributes() & 0x12) || (entry.getAttributes() & 0x13)); });
+    std::string_view shortDirName = getDirectoryName(dirName);
+    DirectoryEntry *it = shortDirName.empty() ? nullptr : findDirectory(dirName);
 
-    if (it == directoryEntries.end())
+    if (!it)
     {
         std::cerr << "Directory not found.\n";
         return;
     }
 
-    int dirBlock = it->getFirstBlock();
-    bool isEmpty = true;
-
-    for (const auto &entry : directoryEntries)
+    // Emptiness is decided by the directory's own pages; slot 1 links back to the parent
+    std::vector<DirectoryEntry> page;
+    if (!readDirectoryPage(it->getFirstBlock(), page))
     {
-        if (entry.getFirstBlock() != dirBlock && entry.getFileName() != dirName &&
-            fat.getNextBlock(entry.getFirstBlock()) == dirBlock)
-        {
-            isEmpty = false;
-            break;
-        }
+        std::cerr << "Failed to open file system.\n";
+        return;
     }
-
-    if (!isEmpty)
+    if (!readDirectoryChildren(*it).empty())
     {
         std::cerr << "Directory is not empty.\n";
         return;
     }
 
-    int block = it->getFirstBlock();
-    do
+    updateDirectoryEntryInPage(page[1].getFirstBlock(), shortDirName, DirectoryEntry());
+    for (int block : getChain(it->getFirstBlock()))
     {
-        int nextBlock = fat.getNextBlock(block);
-        fat.freeBlock(block);
-        block = nextBlock;
-    } while (block != -1);
+        // Released rather than freed: a snapshot may still hold the page
+        fat.releaseBlock(block);
+    }
 
-    directoryEntries.erase(it);
+    chargeUsage(page[1].getFirstBlock(), entryUsage(*it), -1);
+    removeDirectoryUsage(it->getFirstBlock());
+    std::unique_lock<std::shared_mutex> entriesLock(entriesMutex);
+    eraseDirectoryEntryUnlocked(it);
 }
 
 // Function to check if a file exists in the directory entry
-bool FileSystem::fileExistinDirectoryEntry(DirectoryEntry *parent, const std::string &path)
+bool FileSystem::fileExistinDirectoryEntry(DirectoryEntry *parent, std::string_view name)
 {
+    uint64_t key;
+    if (!DirectoryEntry::makeNameKey(name, key))
+    {
+        return false;
+    }
     int block = parent->getFirstBlock();
+    std::vector<DirectoryEntry> page;
     while (block != -1)
     {
-        std::ifstream file(fat.getFileName(), std::ios::binary);
-        if (!file.is_open())
+        if (!readDirectoryPage(block, page))
         {
             std::cerr << "Failed to open file system.\n";
             return false;
         }
 
-        file.seekg(block * fat.getBlockSize(), std::ios::beg);
-        DirectoryEntry dirEntry;
-        while (file.read(reinterpret_cast<char *>(&dirEntry), sizeof(dirEntry)))
+        for (const DirectoryEntry &dirEntry : page)
         {
-            if (dirEntry.getFileName() == path)
+            if (dirEntry.getNameKey() == key)
             {
                 return true;
             }
@@ -200,25 +527,23 @@ bool FileSystem::fileExistinDirectoryEntry(DirectoryEntry *parent, const std::st
 
 void FileSystem::writeFile(const std::string &fileName, const std::string &content)
 {
-    std::string parentName = getParentDirectoryName(fileName);
-    std::string shortFileName = getDirectoryName(fileName);
-
-    auto it = std::find_if(directoryEntries.begin(), directoryEntries.end(),
-                           [&](const DirectoryEntry &entry)
-                           { return entry.getFileName() == parentName && ((entry.getAttributes() & 0x10) || (entry.getAttributes() & 0x11) || (entry.getAttributes() & 0x12) || (entry.getAttributes() & 0x13)); });
+    std::shared_lock<std::shared_mutex> treeLock(treeMutex);
+    std::string_view parentName = getParentDirectoryName(fileName);
+    std::string_view shortFileName = getDirectoryName(fileName);
 
-    if (it == directoryEntries.end())
+    DirectoryEntry *parentDir = findDirectory(parentName);
+    if (!parentDir)
     {
         std::cerr << "Parent directory not found.\n";
         return;
     }
     // If the file exists, check write permission
-    if (!(it->getAttributes() & 0x02)) // Check if the file has write permission
+    if (!(parentDir->getAttributes() & 0x02)) // Check if the file has write permission
     {
         std::cerr << "Write permission denied.\n";
         return;
     }
-    DirectoryEntry *parentDir = &(*it);
+    std::unique_lock<std::shared_mutex> dirLock(directoryLock(parentDir->getFirstBlock()));
 
     // Check if the file already exists
     if (fileExistinDirectoryEntry(parentDir, shortFileName))
@@ -227,990 +552,4266 @@ void FileSystem::writeFile(const std::string &fileName, const std::string &conte
         return;
     }
 
-    int block = fat.allocateBlock();
-    if (block == -1)
+    DirectoryEntry newFile(shortFileName, 0, content.size(), 0x23); // Set as file
+    newFile.updateModificationTime();
+    if (!storeFile(parentDir->getFirstBlock(), newFile, content))
     {
         std::cerr << "No space left to allocate new file.\n";
         return;
     }
+    addDirectoryEntry(newFile, parentDir);
+    chargeUsage(parentDir->getFirstBlock(), entryUsage(newFile));
+}
 
-    DirectoryEntry newFile(shortFileName, block, content.size(), 0x23); // Set as file
-    newFile.updateModificationTime();
-    directoryEntries.push_back(newFile);
-
-    // Write the new file entry to the parent directory's block
-    writeDirectoryEntryToPage(parentDir->getFirstBlock(), newFile);
+void FileSystem::readFile(const std::string &fileName, std::string &content)
+{
+    std::shared_lock<std::shared_mutex> treeLock(treeMutex);
+    content.clear();
 
-    // Write the content to the allocated blocks
-    std::string::size_type contentIndex = 0;
-    int currentBlock = block;
-    while (contentIndex < content.size())
+    DirectoryEntry *parentDir = findDirectory(getParentDirectoryName(fileName));
+    if (!parentDir)
     {
-        std::ofstream file(fat.getFileName(), std::ios::binary | std::ios::in | std::ios::out);
-        if (!file.is_open())
-        {
-            std::cerr << "Failed to open filesystem file.\n";
-            return;
-        }
-
-        file.seekp(currentBlock * fat.getBlockSize(), std::ios::beg);
-        std::string::size_type bytesToWrite = std::min(static_cast<std::string::size_type>(fat.getBlockSize()), content.size() - contentIndex);
-        file.write(content.c_str() + contentIndex, bytesToWrite);
-        contentIndex += bytesToWrite;
-        file.close();
+        std::cerr << "Parent directory not found.\n";
+        return;
+    }
+    std::shared_lock<std::shared_mutex> dirLock(directoryLock(parentDir->getFirstBlock()));
 
-        if (contentIndex < content.size())
-        {
-            int nextBlock = fat.allocateBlock();
-            if (nextBlock == -1)
-            {
-                std::cerr << "No space left to allocate new block.\n";
-                return;
-            }
+    DirectoryEntry *entry = findChildEntry(parentDir, getDirectoryName(fileName));
+    if (!entry)
+    {
+        std::cerr << "File not found.\n";
+        return;
+    }
 
-            fat.setNextBlock(currentBlock, nextBlock);
-            currentBlock = nextBlock;
-        }
-        else
-        {
-            fat.setNextBlock(currentBlock, -1);
-        }
+    if (!(entry->getAttributes() & 0x01)) // Check if the file has read permission
+    {
+        std::cerr << "Read permission denied.\n";
+        return;
     }
-    newFile.updateModificationTime();
+
+    readChain(*entry, content);
 }
 
-void FileSystem::listDirectory(const std::string &path) const
+// Reads exactly the recorded size of a file so trailing block bytes are never returned.
+// Compressed files record their logical size; the whole chain is read and decoded.
+void FileSystem::readChain(const DirectoryEntry &entry, std::string &content) const
 {
-    std::cout << "Listing contents of directory: " << path << "\n";
-
-    auto dirEntryIt = std::find_if(directoryEntries.begin(), directoryEntries.end(),
-                                   [&](const DirectoryEntry &entry)
-                                   {
-                                       return entry.getFileName() == path && ((entry.getAttributes() & 0x10) || (entry.getAttributes() & 0x11) || (entry.getAttributes() & 0x12) || (entry.getAttributes() & 0x13));
-                                   });
-
-    if (dirEntryIt == directoryEntries.end())
+    if (entry.getAttributes() & 0x08)
     {
-        std::cerr << "Directory not found.\n";
+        if (!readInline(entry, content))
+        {
+            std::cerr << "Failed to read filesystem file.\n";
+            content.clear();
+        }
         return;
     }
 
-    int block = dirEntryIt->getFirstBlock();
+    std::vector<int> blocks = getChain(entry.getFirstBlock());
+    const size_t blockSize = static_cast<size_t>(fat.getBlockSize());
+    size_t logicalBlocks = blocks.size();
+    for (int block : blocks)
+    {
+        logicalBlocks += fat.getHoleBlocks(block);
+    }
 
-    while (block != -1)
+    if (entry.getAttributes() & 0x04)
     {
-        std::ifstream file(fat.getFileName(), std::ios::binary);
-        if (!file.is_open())
+        std::string stored;
+        if (!readChainData(blocks, stored, logicalBlocks * blockSize))
         {
-            std::cerr << "Failed to open file system.\n";
-            return;
+            std::cerr << "Failed to read filesystem file.\n";
+            content.clear();
         }
-
-        file.seekg(block * fat.getBlockSize(), std::ios::beg);
-
-        for (size_t i = 0; i < fat.getBlockSize() / sizeof(DirectoryEntry); ++i)
+        else if (!LZCodec::decompress(stored.data(), stored.size(), entry.getSize(), content))
         {
-            DirectoryEntry dirEntry;
-            file.read(reinterpret_cast<char *>(&dirEntry), sizeof(DirectoryEntry));
-
-            if (std::strlen(dirEntry.getFileName().c_str()) > 0)
-            {
-                std::cout << "    File Name: " << dirEntry.getFileName()
-                          << ", Size: " << dirEntry.getSize()
-                          << ", First Block: " << dirEntry.getFirstBlock()
-                          << ", Attributes: " << getAttributesString(dirEntry.getAttributes())
-                          << ", Password: " << (dirEntry.getPassword().empty() ? "No" : dirEntry.getPassword())
-                          << ", Last Modified: " << dirEntry.getFormattedDate() << " " << dirEntry.getFormattedTime()
-                          << "\n";
-            }
+            std::cerr << "Compressed data is corrupt.\n";
+            content.clear();
         }
+        return;
+    }
 
-        block = fat.getNextBlock(block);
+    if (!readChainData(blocks, content, std::min<size_t>(entry.getSize(), logicalBlocks * blockSize)))
+    {
+        std::cerr << "Failed to read filesystem file.\n";
+        content.clear();
     }
 }
 
-void FileSystem::deleteFile(const std::string &fileName)
+// Reads the first length logical bytes of a chain; holes read back as zeros without any I/O
+bool FileSystem::readChainData(const std::vector<int> &blocks, std::string &data, size_t length) const
 {
-    std::string parentName = getParentDirectoryName(fileName);
-    std::string shortFileName = getDirectoryName(fileName);
-
-    // Find the parent directory entry
-    DirectoryEntry *parentDir = findDirectoryEntry(parentName);
-    if (!parentDir)
+    const size_t blockSize = static_cast<size_t>(fat.getBlockSize());
+    data.assign(length, '\0');
+
+    std::vector<int> mapped;
+    std::vector<size_t> offsets;
+    size_t offset = 0;
+    bool sparse = false;
+    for (size_t i = 0; i < blocks.size() && offset < length; ++i)
     {
-        std::cerr << "Parent directory not found.\n";
-        return;
+        mapped.push_back(blocks[i]);
+        offsets.push_back(offset);
+        int holeBlocks = fat.getHoleBlocks(blocks[i]);
+        sparse = sparse || holeBlocks > 0;
+        offset += (1 + holeBlocks) * blockSize;
     }
-    // Remove the file entry from the parent directory's block
-    int parentBlock = parentDir->getFirstBlock();
-    bool fileFound = false;
-    while (parentBlock != -1)
+    if (mapped.empty())
     {
-        std::fstream file(fat.getFileName(), std::ios::binary | std::ios::in | std::ios::out);
-        if (!file.is_open())
-        {
-            std::cerr << "Failed to open file system.\n";
-            return;
-        }
-
-        file.seekg(parentBlock * fat.getBlockSize(), std::ios::beg);
-
-        for (size_t i = 0; i < fat.getBlockSize() / sizeof(DirectoryEntry); ++i)
-        {
-            DirectoryEntry dirEntry;
-            file.read(reinterpret_cast<char *>(&dirEntry), sizeof(DirectoryEntry));
-
-            if (dirEntry.getFileName() == shortFileName)
-            {
-                // Clear the entry
-                dirEntry = DirectoryEntry(); // Value-initialize the DirectoryEntry object
-                file.seekp(parentBlock * fat.getBlockSize() + i * sizeof(DirectoryEntry), std::ios::beg);
-                file.write(reinterpret_cast<const char *>(&dirEntry), sizeof(DirectoryEntry));
-                fileFound = true;
-                break;
-            }
-        }
-
-        if (fileFound)
-            break;
+        return true;
+    }
+    if (!sparse)
+    {
+        return device.readBlocks(mapped, &data[0], length);
+    }
 
-        parentBlock = fat.getNextBlock(parentBlock);
+    std::string staging(mapped.size() * blockSize, '\0');
+    if (!device.readBlocks(mapped, &staging[0], staging.size()))
+    {
+        return false;
+    }
+    for (size_t i = 0; i < mapped.size(); ++i)
+    {
+        data.replace(offsets[i], std::min(blockSize, length - offsets[i]), staging, i * blockSize, std::min(blockSize, length - offsets[i]));
     }
+    return true;
+}
 
-    if (!fileFound)
+// Resolves a whole FAT chain up front so its blocks can be submitted together
+std::vector<int> FileSystem::getChain(int firstBlock) const
+{
+    std::vector<int> blocks;
+    for (int block = firstBlock; block != -1 && static_cast<int>(blocks.size()) < fat.getTotalBlocks(); block = fat.getNextBlock(block))
     {
-        std::cerr << "File not found in parent directory.\n";
-        return;
+        blocks.push_back(block);
     }
+    return blocks;
+}
 
-    auto it = directoryEntries.begin();
+// An inline file has no chain of its own; its first block is the directory page holding its data
+std::vector<int> FileSystem::getChain(const DirectoryEntry &entry) const
+{
+    if (entry.getAttributes() & 0x08)
+    {
+        return std::vector<int>();
+    }
+    return getChain(entry.getFirstBlock());
+}
 
-    for (; it != directoryEntries.end(); ++it)
+// Takes one more reference on every block, or on none of them when one is already at the FAT's limit
+bool FileSystem::shareChain(const std::vector<int> &chain)
+{
+    for (size_t i = 0; i < chain.size(); ++i)
     {
-        if (it->getFileName() == shortFileName)
+        if (!fat.shareBlock(chain[i]))
         {
-            int block = it->getFirstBlock();
-            do
+            for (size_t j = 0; j < i; ++j)
             {
-                int nextBlock = fat.getNextBlock(block);
-
-                // Clear the content of the block
-                std::fstream file(fat.getFileName(), std::ios::binary | std::ios::in | std::ios::out);
-                if (file.is_open())
-                {
-                    file.seekp(block * fat.getBlockSize(), std::ios::beg);
-                    std::vector<char> emptyBlock(static_cast<int>(fat.getBlockSize()), 0);
-                    file.write(emptyBlock.data(), emptyBlock.size());
-                    file.close();
-                }
-
-                fat.freeBlock(block);
-                block = nextBlock;
-            } while (block != -1);
-
-            directoryEntries.erase(it);
-            break;
+                fat.releaseBlock(chain[j]);
+            }
+            return false;
         }
     }
+    return true;
 }
 
-void FileSystem::readFile(const std::string &fileName, const std::string &outputFile, const std::string &password)
+// Writes a new file's data and its entry in the directory. Small uncompressed files go inline when a
+// page of the directory has room for the entry and its data slots together; the rest get a chain.
+bool FileSystem::storeFile(int directoryBlock, DirectoryEntry &entry, const std::string &content)
 {
-    std::string shortFileName = getDirectoryName(fileName);
-    std::string targetShortFileName = getDirectoryName(outputFile);
-
-    DirectoryEntry *entry = findDirectoryEntry(shortFileName);
-    if (!entry)
+    entry.setAttributes(entry.getAttributes() & ~0x08);
+    if (!(entry.getAttributes() & 0x04) && content.size() <= inlineMaxBytes && writeInlineEntry(directoryBlock, entry, content))
     {
-        std::cerr << "File not found.\n";
-        return;
+        return true;
     }
-
-    if (!(entry->getAttributes() & 0x01)) // Check if the file has read permission
+    int block = writeChain(content, entry.getAttributes() & 0x04);
+    if (block == -1)
     {
-        std::cerr << "Read permission denied.\n";
-        return;
+        return false;
     }
+    entry.setFirstBlock(block);
+    writeDirectoryEntryToPage(directoryBlock, entry);
+    return true;
+}
 
-    if (shortFileName.empty())
-    {
-        deleteFile(outputFile);
-        writeFileToFile(outputFile, fileName);
-    }
-    else
+// Looks for a run of empty slots long enough for the entry and its data on one page. When every
+// page is full the directory grows by a page, which costs no more than a data block would.
+bool FileSystem::writeInlineEntry(int directoryBlock, DirectoryEntry &entry, const std::string &content)
+{
+    const size_t needed = 1 + inlineDataSlots(content.size());
+    std::vector<DirectoryEntry> page;
+    std::vector<int> chain = getChain(directoryBlock);
+    int freshBlock = -1;
+    for (size_t index = 0; index <= chain.size(); ++index)
     {
-        if (strcmp(password.c_str(), findDirectoryEntry(shortFileName)->getPassword().c_str()) == 0)
+        int block;
+        if (index < chain.size())
         {
-            if (!findDirectoryEntry(shortFileName)->getPassword().empty())
-                std::cout << "Password is correct.\n";
-            deleteFile(outputFile);
-            writeFileToFile(outputFile, fileName);
+            block = chain[index];
+            if (!readDirectoryPage(block, page))
+            {
+                return false;
+            }
         }
         else
         {
-            std::cerr << "Password is incorrect.\n";
+            freshBlock = block = fat.allocateBlock();
+            if (block == -1)
+            {
+                return false;
+            }
+            page.assign(static_cast<size_t>(fat.getBlockSize()) / sizeof(DirectoryEntry), DirectoryEntry());
+        }
+        size_t run = 0;
+        for (size_t i = 0; i < page.size(); ++i)
+        {
+            if (!page[i].getFileNameView().empty())
+            {
+                run = 0;
+                i += inlineSlots(page[i]);
+                continue;
+            }
+            if (++run < needed)
+            {
+                continue;
+            }
+            size_t slot = i + 1 - needed;
+            DirectoryEntry stored = entry;
+            stored.setFirstBlock(block);
+            stored.setAttributes(entry.getAttributes() | 0x08);
+            stored.setSize(content.size());
+            page[slot] = stored;
+            storeInlineData(page, slot, content);
+            if (!writeDirectoryPage(block, page))
+            {
+                if (freshBlock != -1)
+                {
+                    fat.freeBlock(freshBlock);
+                }
+                return false;
+            }
+            if (freshBlock != -1)
+            {
+                fat.setNextBlock(chain.back(), freshBlock);
+            }
+            entry = stored;
+            return true;
+        }
+    }
+    if (freshBlock != -1)
+    {
+        fat.freeBlock(freshBlock);
+    }
+    return false;
+}
+
+// One read: the page named by the entry holds both the entry and its data
+bool FileSystem::readInline(const DirectoryEntry &entry, std::string &content) const
+{
+    std::vector<DirectoryEntry> page;
+    if (!readDirectoryPage(entry.getFirstBlock(), page))
+    {
+        return false;
+    }
+    uint64_t key = entry.getNameKey();
+    for (size_t i = 0; i < page.size(); ++i)
+    {
+        if (page[i].getNameKey() == key && (page[i].getAttributes() & 0x08))
+        {
+            return loadInlineData(page, i, content);
+        }
+        i += inlineSlots(page[i]);
+    }
+    return false;
+}
+
+// Allocates a chain sized for content and writes it in one submission; returns the first block or -1
+int FileSystem::writeChain(const std::string &content, bool compressed)
+{
+    if (compressed)
+    {
+        std::string stored;
+        LZCodec::compress(content, stored);
+        return writeChain(stored);
+    }
+
+    if (features & featureDedupe)
+    {
+        return writeDedupedChain(content);
+    }
+
+    const size_t blockSize = static_cast<size_t>(fat.getBlockSize());
+    int blockCount = std::max<int>(1, static_cast<int>((content.size() + blockSize - 1) / blockSize));
+
+    // All-zero blocks after the first are left as holes counted on the preceding data block
+    std::vector<size_t> dataOffsets;
+    std::vector<int> holeBlocks;
+    for (int i = 0; i < blockCount; ++i)
+    {
+        size_t offset = i * blockSize;
+        size_t bytes = std::min(blockSize, content.size() - std::min(offset, content.size()));
+        bool zeroBlock = content.find_first_not_of('\0', offset) >= offset + bytes;
+        if (i == 0 || !zeroBlock || holeBlocks.back() == FAT12::maxHoleBlocks)
+        {
+            dataOffsets.push_back(offset);
+            holeBlocks.push_back(0);
+        }
+        else
+        {
+            ++holeBlocks.back();
+        }
+    }
+
+    std::vector<int> blocks = fat.allocateChain(static_cast<int>(dataOffsets.size()));
+    if (blocks.empty())
+    {
+        return -1;
+    }
+
+    bool written;
+    if (static_cast<int>(blocks.size()) == blockCount)
+    {
+        written = device.writeBlocks(blocks, content.data(), content.size());
+    }
+    else
+    {
+        std::string staging(blocks.size() * blockSize, '\0');
+        for (size_t i = 0; i < blocks.size(); ++i)
+        {
+            fat.setHoleBlocks(blocks[i], holeBlocks[i]);
+            size_t offset = std::min(dataOffsets[i], content.size());
+            staging.replace(i * blockSize, std::min(blockSize, content.size() - offset), content, offset, blockSize);
+        }
+        written = device.writeBlocks(blocks, staging.data(), staging.size());
+    }
+    if (!written)
+    {
+        std::cerr << "Failed to write filesystem file.\n";
+    }
+    return blocks.front();
+}
+
+// Writes a chain back to front so each block's fingerprint can include its successor. Blocks whose
+// content and tail already exist are shared; only the remaining blocks are allocated and written.
+int FileSystem::writeDedupedChain(const std::string &content)
+{
+    const size_t blockSize = static_cast<size_t>(fat.getBlockSize());
+    int blockCount = std::max<int>(1, static_cast<int>((content.size() + blockSize - 1) / blockSize));
+    std::vector<int> chain;
+    std::vector<int> newBlocks;
+    std::vector<DedupeIndex::Fingerprint> newFingerprints;
+    std::string staging;
+
+    int nextBlock = -1;
+    for (int i = blockCount - 1; i >= 0; --i)
+    {
+        size_t offset = std::min(content.size(), i * blockSize);
+        size_t bytes = std::min(blockSize, content.size() - offset);
+        DedupeIndex::Fingerprint fingerprint = DedupeIndex::fingerprint(content.data() + offset, bytes, nextBlock);
+
+        int block = dedupe.acquire(fingerprint);
+        if (block == -1)
+        {
+            block = fat.allocateBlock();
+            if (block == -1)
+            {
+                for (int acquired : chain)
+                {
+                    dedupe.release(acquired);
+                }
+                return -1;
+            }
+            fat.setNextBlock(block, nextBlock);
+            newBlocks.push_back(block);
+            newFingerprints.push_back(fingerprint);
+            staging.append(content, offset, bytes);
+            staging.resize(newBlocks.size() * blockSize, '\0');
+        }
+        chain.push_back(block);
+        nextBlock = block;
+    }
+
+    if (!device.writeBlocks(newBlocks, staging.data(), staging.size()))
+    {
+        std::cerr << "Failed to write filesystem file.\n";
+    }
+    // Publish the new blocks only once their data is on disk
+    for (size_t i = 0; i < newBlocks.size(); ++i)
+    {
+        dedupe.insert(newFingerprints[i], newBlocks[i]);
+    }
+    return nextBlock;
+}
+
+// Re-links an existing file so that its blocks are shared with identical indexed ones. Private blocks
+// are re-pointed in place, so the pass changes only FAT links; data is written only when a block
+// shared with a clone has to diverge. Returns the new first block.
+int FileSystem::deduplicateChain(const DirectoryEntry &entry)
+{
+    const size_t blockSize = static_cast<size_t>(fat.getBlockSize());
+    std::vector<int> original = getChain(entry);
+    for (int block : original)
+    {
+        // Fingerprints assume one block per position, so sparse files are left alone
+        if (fat.getHoleBlocks(block) > 0)
+        {
+            return entry.getFirstBlock();
+        }
+    }
+    std::string content(original.size() * blockSize, '\0');
+    if (original.empty() || !device.readBlocks(original, &content[0], content.size()))
+    {
+        return entry.getFirstBlock();
+    }
+    size_t size = std::min<size_t>(entry.getSize(), content.size());
+    if (entry.getAttributes() & 0x04)
+    {
+        size = LZCodec::encodedLength(content.data(), content.size(), entry.getSize());
+    }
+
+    std::vector<int> chain(original.size(), -1);
+    int nextBlock = -1;
+    for (int i = static_cast<int>(original.size()) - 1; i >= 0; --i)
+    {
+        size_t offset = std::min(size, i * blockSize);
+        size_t bytes = std::min(blockSize, size - offset);
+        DedupeIndex::Fingerprint fingerprint = DedupeIndex::fingerprint(content.data() + offset, bytes, nextBlock);
+
+        int match = dedupe.find(fingerprint);
+        if (match == original[i])
+        {
+            chain[i] = match;
+        }
+        else if (match != -1 && (match = dedupe.acquire(fingerprint)) != -1)
+        {
+            chain[i] = match;
+        }
+        else if (fat.getNextBlock(original[i]) == nextBlock || liveRefCount(original[i]) == 1)
+        {
+            dedupe.forget(original[i]);
+            fat.setNextBlock(original[i], nextBlock);
+            dedupe.insert(fingerprint, original[i]);
+            chain[i] = original[i];
+        }
+        else
+        {
+            int copy = fat.allocateBlock();
+            if (copy == -1)
+            {
+                // Out of space: keep the untouched prefix of the original chain
+                for (int j = i + 1; j < static_cast<int>(chain.size()); ++j)
+                {
+                    if (chain[j] != original[j])
+                    {
+                        dedupe.release(chain[j]);
+                    }
+                }
+                return entry.getFirstBlock();
+            }
+            fat.setNextBlock(copy, nextBlock);
+            device.writeBlock(copy, content.data() + i * blockSize);
+            dedupe.insert(fingerprint, copy);
+            chain[i] = copy;
+        }
+        nextBlock = chain[i];
+    }
+
+    std::vector<int> freedBlocks;
+    for (size_t i = 0; i < original.size(); ++i)
+    {
+        if (chain[i] != original[i] && dedupe.release(original[i]))
+        {
+            freedBlocks.push_back(original[i]);
+        }
+    }
+    discardLater(freedBlocks);
+    return chain.front();
+}
+
+bool FileSystem::readDirectoryPage(int block, std::vector<DirectoryEntry> &page) const
+{
+    page.resize(static_cast<size_t>(fat.getBlockSize()) / sizeof(DirectoryEntry));
+    return device.readBlock(block, reinterpret_cast<char *>(page.data()));
+}
+
+bool FileSystem::writeDirectoryPage(int block, const std::vector<DirectoryEntry> &page)
+{
+    return device.writeBlock(block, reinterpret_cast<const char *>(page.data()));
+}
+
+// Returns the entries stored in a directory chain, skipping its own entry and the parent link
+std::vector<DirectoryEntry> FileSystem::readDirectoryChildren(const DirectoryEntry &dir) const
+{
+    std::vector<DirectoryEntry> children;
+    std::vector<DirectoryEntry> page;
+    const size_t firstChildSlot = dir.getFileName() == "/" ? 1 : 2;
+    size_t slot = 0;
+    for (int block = dir.getFirstBlock(); block != -1; block = fat.getNextBlock(block))
+    {
+        if (!readDirectoryPage(block, page))
+        {
+            std::cerr << "Failed to open file system.\n";
+            return children;
+        }
+        for (const DirectoryEntry &dirEntry : page)
+        {
+            if (slot++ >= firstChildSlot && !dirEntry.getFileName().empty() &&
+                (dirEntry.getFirstBlock() != dir.getFirstBlock() || (dirEntry.getAttributes() & 0x08)))
+            {
+                children.push_back(dirEntry);
+            }
+        }
+    }
+    return children;
+}
+
+void FileSystem::listDirectory(const std::string &path) const
+{
+    listDirectory(path, ListOptions());
+}
+
+// The directory chain is read in one submission and every line is formatted into a single buffer
+// that is flushed in large writes
+void FileSystem::listDirectory(const std::string &path, const ListOptions &options) const
+{
+    std::shared_lock<std::shared_mutex> treeLock(treeMutex);
+    const DirectoryEntry *dirEntry = findDirectory(path);
+
+    if (!options.json)
+    {
+        std::cout << "Listing contents of directory: " << path << "\n";
+    }
+    if (!dirEntry)
+    {
+        std::cerr << "Directory not found.\n";
+        return;
+    }
+
+    int firstBlock = dirEntry->getFirstBlock();
+    std::shared_lock<std::shared_mutex> dirLock(directoryLock(firstBlock));
+
+    std::vector<int> blocks = getChain(firstBlock);
+    std::vector<DirectoryEntry> slots(blocks.size() * (static_cast<size_t>(fat.getBlockSize()) / sizeof(DirectoryEntry)));
+    if (!device.readBlocks(blocks, reinterpret_cast<char *>(slots.data()), slots.size() * sizeof(DirectoryEntry)))
+    {
+        std::cerr << "Failed to open file system.\n";
+        return;
+    }
+
+    std::vector<const DirectoryEntry *> entries;
+    for (const DirectoryEntry &slot : slots)
+    {
+        if (!slot.getFileNameView().empty())
+        {
+            entries.push_back(&slot);
+        }
+    }
+
+    switch (options.sort)
+    {
+    case ListSort::Name:
+        std::stable_sort(entries.begin(), entries.end(), [](const DirectoryEntry *a, const DirectoryEntry *b)
+                         { return a->getFileNameView() < b->getFileNameView(); });
+        break;
+    case ListSort::Size:
+        std::stable_sort(entries.begin(), entries.end(), [](const DirectoryEntry *a, const DirectoryEntry *b)
+                         { return a->getSize() < b->getSize(); });
+        break;
+    case ListSort::ModificationTime:
+        std::stable_sort(entries.begin(), entries.end(), [](const DirectoryEntry *a, const DirectoryEntry *b)
+                         { return (static_cast<uint32_t>(a->getDateValue()) << 16 | a->getTimeValue()) <
+                                  (static_cast<uint32_t>(b->getDateValue()) << 16 | b->getTimeValue()); });
+        break;
+    case ListSort::None:
+        break;
+    }
+
+    size_t first = std::min(options.offset, entries.size());
+    size_t last = first + std::min(options.limit, entries.size() - first);
+
+    const size_t flushSize = 64 * 1024;
+    std::string buffer;
+    buffer.reserve(flushSize + 256);
+    if (options.json)
+    {
+        buffer.append("{\"directory\":");
+        appendJsonString(buffer, path);
+        buffer.append(",\"total\":");
+        appendNumber(buffer, entries.size());
+        buffer.append(",\"entries\":[");
+    }
+
+    for (size_t i = first; i < last; ++i)
+    {
+        const DirectoryEntry &entry = *entries[i];
+        if (options.json)
+        {
+            buffer.append(i == first ? "{\"name\":" : ",{\"name\":");
+            appendJsonString(buffer, entry.getFileNameView());
+            buffer.append((entry.getAttributes() & 0x10) ? ",\"type\":\"directory\",\"size\":" : ",\"type\":\"file\",\"size\":");
+            appendNumber(buffer, entry.getSize());
+            buffer.append(",\"firstBlock\":");
+            appendNumber(buffer, entry.getFirstBlock());
+            buffer.append(",\"attributes\":\"");
+            appendAttributes(buffer, entry.getAttributes());
+            buffer.append(entry.getPasswordView().empty() ? "\",\"password\":false,\"modified\":\"" : "\",\"password\":true,\"modified\":\"");
+            appendTimestamp(buffer, entry);
+            buffer.append("\"}");
+        }
+        else
+        {
+            std::string_view password = entry.getPasswordView();
+            buffer.append("    File Name: ");
+            buffer.append(entry.getFileNameView());
+            buffer.append(", Size: ");
+            appendNumber(buffer, entry.getSize());
+            buffer.append(", First Block: ");
+            appendNumber(buffer, entry.getFirstBlock());
+            buffer.append(", Attributes: ");
+            appendAttributes(buffer, entry.getAttributes());
+            buffer.append(", Password: ");
+            buffer.append(password.empty() ? std::string_view("No") : password);
+            buffer.append(", Last Modified: ");
+            appendTimestamp(buffer, entry);
+            buffer.push_back('\n');
+        }
+
+        if (buffer.size() >= flushSize)
+        {
+            std::cout.write(buffer.data(), buffer.size());
+            buffer.clear();
+        }
+    }
+
+    // Cursor for the next page, if any entries remain
+    if (options.json)
+    {
+        buffer.append("],\"next\":");
+        if (last < entries.size())
+        {
+            appendNumber(buffer, last);
+        }
+        else
+        {
+            buffer.append("null");
+        }
+        buffer.append("}\n");
+    }
+    else if (last < entries.size())
+    {
+        buffer.append("Next offset: ");
+        appendNumber(buffer, last);
+        buffer.push_back('\n');
+    }
+    std::cout.write(buffer.data(), buffer.size());
+}
+
+void FileSystem::deleteFile(const std::string &fileName)
+{
+    std::shared_lock<std::shared_mutex> treeLock(treeMutex);
+    DirectoryEntry *parentDir = findDirectory(getParentDirectoryName(fileName));
+    if (!parentDir)
+    {
+        std::cerr << "Parent directory not found.\n";
+        return;
+    }
+    std::unique_lock<std::shared_mutex> dirLock(directoryLock(parentDir->getFirstBlock()));
+    deleteFileUnlocked(fileName);
+}
+
+void FileSystem::deleteFileUnlocked(const std::string &fileName)
+{
+    std::string_view parentName = getParentDirectoryName(fileName);
+    std::string_view shortFileName = getDirectoryName(fileName);
+
+    // Find the parent directory entry
+    DirectoryEntry *parentDir = findDirectory(parentName);
+    if (!parentDir)
+    {
+        std::cerr << "Parent directory not found.\n";
+        return;
+    }
+    // Remove the file entry from the parent directory's block; the first page starts with the
+    // directory's own entry and its parent link, which are never children
+    int parentBlock = parentDir->getFirstBlock();
+    size_t firstChildSlot = parentDir->getFileNameView() == "/" ? 1 : 2;
+    bool fileFound = false;
+    std::vector<DirectoryEntry> page;
+    while (parentBlock != -1)
+    {
+        if (!readDirectoryPage(parentBlock, page))
+        {
+            std::cerr << "Failed to open file system.\n";
+            return;
+        }
+
+        for (size_t i = firstChildSlot; i < page.size(); ++i)
+        {
+            if (page[i].getFileName() == shortFileName)
+            {
+                // Directories go through rmdir or rm -r, which also drop what is below them
+                if (page[i].getAttributes() & 0x10)
+                {
+                    std::cerr << "Is a directory.\n";
+                    return;
+                }
+                // Clear the entry and any inline data after it
+                clearInlineData(page, i);
+                page[i] = DirectoryEntry(); // Value-initialize the DirectoryEntry object
+                writeDirectoryPage(parentBlock, page);
+                fileFound = true;
+                break;
+            }
+        }
+
+        if (fileFound)
+            break;
+
+        firstChildSlot = 0;
+        parentBlock = fat.getNextBlock(parentBlock);
+    }
+
+    if (!fileFound)
+    {
+        std::cerr << "File not found in parent directory.\n";
+        return;
+    }
+
+    // Looked up and erased under one exclusive hold; the rest works on a copy
+    DirectoryEntry removed;
+    {
+        std::unique_lock<std::shared_mutex> entriesLock(entriesMutex);
+        DirectoryEntry *it = findChildEntryUnlocked(parentDir, shortFileName);
+        if (!it)
+        {
+            return;
+        }
+        removed = *it;
+        eraseDirectoryEntryUnlocked(it);
+    }
+    chargeUsage(parentDir->getFirstBlock(), entryUsage(removed), -1);
+
+    // Release the chain; blocks still shared with a clone keep their data and links.
+    // Freeing is a FAT update only: stale bytes stay until the block is reused or discarded.
+    std::vector<int> freedBlocks;
+    for (int block : getChain(removed))
+    {
+        if (dedupe.release(block))
+        {
+            freedBlocks.push_back(block);
+        }
+    }
+    discardLater(freedBlocks);
+}
+
+void FileSystem::readFile(const std::string &fileName, const std::string &outputFile, const std::string &password)
+{
+    std::shared_lock<std::shared_mutex> treeLock(treeMutex);
+    std::string_view shortFileName = getDirectoryName(fileName);
+
+    DirectoryEntry *sourceDir = findDirectory(getParentDirectoryName(fileName));
+    DirectoryEntry *targetDir = findDirectory(getParentDirectoryName(outputFile));
+    if (!sourceDir || !targetDir)
+    {
+        std::cerr << "Parent directory not found.\n";
+        return;
+    }
+    std::unique_lock<std::shared_mutex> targetLock(directoryLock(targetDir->getFirstBlock()), std::defer_lock);
+    std::unique_lock<std::shared_mutex> sourceLock(directoryLock(sourceDir->getFirstBlock()), std::defer_lock);
+    lockDirectoryPair(targetLock, sourceLock);
+
+    DirectoryEntry *entry = findChildEntry(sourceDir, shortFileName);
+    if (!entry)
+    {
+        std::cerr << "File not found.\n";
+        return;
+    }
+
+    if (!(entry->getAttributes() & 0x01)) // Check if the file has read permission
+    {
+        std::cerr << "Read permission denied.\n";
+        return;
+    }
+
+    if (shortFileName.empty())
+    {
+        deleteFileUnlocked(outputFile);
+        writeFileToFileUnlocked(outputFile, fileName);
+    }
+    else
+    {
+        if (strcmp(password.c_str(), entry->getPassword().c_str()) == 0)
+        {
+            if (!entry->getPassword().empty())
+                std::cout << "Password is correct.\n";
+            deleteFileUnlocked(outputFile);
+            writeFileToFileUnlocked(outputFile, fileName);
+        }
+        else
+        {
+            std::cerr << "Password is incorrect.\n";
+        }
+    }
+}
+
+void FileSystem::changeMode(const std::string &fileName, const std::string &permissions)
+{
+    std::shared_lock<std::shared_mutex> treeLock(treeMutex);
+    std::string_view shortFileName = getDirectoryName(fileName);
+
+    DirectoryEntry *parentDir = findDirectory(getParentDirectoryName(fileName));
+    if (!parentDir)
+    {
+        std::cerr << "Parent directory not found.\n";
+        return;
+    }
+    std::unique_lock<std::shared_mutex> dirLock(directoryLock(parentDir->getFirstBlock()));
+
+    DirectoryEntry *it = findChildEntry(parentDir, shortFileName);
+    if (!it)
+    {
+        std::cerr << "File not found.\n";
+        return;
+    }
+    if (it->getAttributes() & 0x10)
+    {
+        std::cerr << "Is a directory.\n";
+        return;
+    }
+
+    char newAttributes = it->getAttributes();
+    if (permissions == "+rw")
+    {
+        newAttributes |= 0x03; // Add read and write permissions
+    }
+    else if (permissions == "+r")
+    {
+        newAttributes |= 0x01; // Add read permission
+    }
+    else if (permissions == "+w")
+    {
+        newAttributes |= 0x02; // Add write permission
+    }
+    else if (permissions == "-rw")
+    {
+        newAttributes &= ~0x03; // Remove read and write permissions
+    }
+    else if (permissions == "-r")
+    {
+        newAttributes &= ~0x01; // Remove read permission
+    }
+    else if (permissions == "-w")
+    {
+        newAttributes &= ~0x02; // Remove write permission
+    }
+    else if (permissions == "+c")
+    {
+        newAttributes |= 0x04; // Store compressed
+    }
+    else if (permissions == "-c")
+    {
+        newAttributes &= ~0x04; // Store uncompressed
+    }
+
+    // Retrieve the content of the file
+    std::string content;
+    readChain(*it, content);
+
+    // Delete the original file
+    deleteFileUnlocked(fileName);
+
+    // Create a new file with the same content and password
+    writeFileWithAttribute(fileName, content, newAttributes);
+    std::cout << "Permissions changed.\n";
+}
+
+std::string FileSystem::getAttributesString(char attributes) const
+{
+    std::string result = "--"; // Initialize with no permissions
+    if (attributes & 0x01)
+        result[0] = 'r'; // Read permission
+    if (attributes & 0x02)
+        result[1] = 'w'; // Write permission
+    if (attributes & 0x04)
+        result += 'c'; // Compressed
+    return result;
+}
+
+void FileSystem::addPassword(const std::string &fileName, const std::string &password)
+{
+    std::shared_lock<std::shared_mutex> treeLock(treeMutex);
+    std::string_view shortFileName = getDirectoryName(fileName);
+
+    DirectoryEntry *parentDir = findDirectory(getParentDirectoryName(fileName));
+    if (!parentDir)
+    {
+        std::cerr << "Parent directory not found.\n";
+        return;
+    }
+    std::unique_lock<std::shared_mutex> dirLock(directoryLock(parentDir->getFirstBlock()));
+
+    DirectoryEntry *it = findChildEntry(parentDir, shortFileName);
+    if (!it)
+    {
+        std::cerr << "File not found.\n";
+        return;
+    }
+    if (it->getAttributes() & 0x10)
+    {
+        std::cerr << "Is a directory.\n";
+        return;
+    }
+
+    // Retrieve the content of the file
+    std::string content;
+    readChain(*it, content);
+    char compressed = it->getAttributes() & 0x04;
+
+    // Delete the original file; it points at the erased entry from here on
+    deleteFileUnlocked(fileName);
+
+    // Create a new file with the same content and password
+    writeFileWithPassword(fileName, content, password, 0x23 | compressed);
+
+    std::cout << "Password added.\n";
+}
+
+void FileSystem::dumpe2fs()
+{
+    std::unique_lock<std::shared_mutex> treeLock(treeMutex);
+    ensureUsage();
+    Usage total;
+    {
+        std::lock_guard<std::mutex> lock(usageMutex);
+        total = directoryUsage[rootDirectoryBlock].total;
+    }
+    int freeBlocks = fat.getFreeBlockCount();
+    int occupiedBlocks = fat.getTotalBlocks() - freeBlocks;
+    int64_t numberOfFiles = total.files;
+    int64_t numberOfDirectories = total.directories + 1;
+
+    // Logical size is what files report; physical size counts each distinct data block once
+    uint64_t logicalBytes = total.bytes;
+    std::set<int> fileBlocks;
+    for (const auto &entry : directoryEntries)
+    {
+        if (!(entry.getAttributes() & 0x10))
+        {
+            std::vector<int> chain = getChain(entry);
+            fileBlocks.insert(chain.begin(), chain.end());
+        }
+    }
+    uint64_t physicalBytes = fileBlocks.size() * static_cast<uint64_t>(fat.getBlockSize());
+
+    std::cout << "Filesystem Summary:\n";
+    std::cout << "Block count: " << fat.getTotalBlocks() << "\n";
+    std::cout << "Block size: " << fat.getBlockSize() << " bytes\n";
+    std::cout << "Free blocks: " << freeBlocks << "\n";
+    std::cout << "Occupied blocks: " << occupiedBlocks << "\n";
+    std::cout << "Shared blocks: " << fat.getSharedBlockCount() << "\n";
+    std::cout << "Deduplication: " << ((features & featureDedupe) ? "on" : "off") << ", indexed blocks: " << dedupe.size() << "\n";
+    std::cout << "Checksums: " << ((features & featureChecksums) ? "on" : "off") << "\n";
+    if (!device.getStripeMembers().empty())
+    {
+        std::cout << "Stripes: " << device.getStripeMembers().size() << " members, " << device.getStripeUnit() << " blocks per unit\n";
+        for (const std::string &member : device.getStripeMembers())
+        {
+            std::cout << "Stripe member: " << member << "\n";
+        }
+    }
+    std::cout << "Number of files: " << numberOfFiles << "\n";
+    std::cout << "File data: logical " << logicalBytes << " bytes, physical " << physicalBytes << " bytes\n";
+    std::cout << "Number of directories: " << numberOfDirectories << "\n";
+    std::cout << "Occupied blocks and file names:\n";
+
+    for (const auto &entry : directoryEntries)
+    {
+        if ((entry.getAttributes() & 0x10) == 0x10)
+        {
+            std::cout << "Directory: " << entry.getFileName() << " at block " << entry.getFirstBlock()
+                          << ", Size: " << entry.getSize()
+                          << ", First Block: " << entry.getFirstBlock()
+                          << ", Attributes: " << getAttributesString(entry.getAttributes())
+                          << ", Password: " << (entry.getPassword().empty() ? "No" : entry.getPassword())
+                          << ", Last Modified: " << entry.getFormattedDate() << " " << entry.getFormattedTime()
+                          << "\n";
+            
+        }
+        else
+        {
+            std::cout << "File: " << entry.getFileName() << " at blocks: "  << entry.getFirstBlock()
+                          << ", Size: " << entry.getSize()
+                          << ", First Block: " << entry.getFirstBlock()
+                          << ", Attributes: " << getAttributesString(entry.getAttributes())
+                          << ", Password: " << (entry.getPassword().empty() ? "No" : entry.getPassword())
+                          << ", Last Modified: " << entry.getFormattedDate() << " " << entry.getFormattedTime()
+                          << "\n";
+            int block = entry.getFirstBlock();
+            while (block != -1)
+            {
+                block = fat.getNextBlock(block);
+            }
+        }
+    }
+}
+
+// Answers from the allocator's free count and the root's usage totals, so it never scans the FAT
+void FileSystem::statfs()
+{
+    std::unique_lock<std::shared_mutex> treeLock(treeMutex);
+    ensureUsage();
+    Usage total;
+    {
+        std::lock_guard<std::mutex> lock(usageMutex);
+        total = directoryUsage[rootDirectoryBlock].total;
+    }
+    int freeBlocks = fat.getFreeBlockCount();
+    std::cout << "Block size: " << fat.getBlockSize() << " bytes\n";
+    std::cout << "Block count: " << fat.getTotalBlocks() << "\n";
+    std::cout << "Free blocks: " << freeBlocks << "\n";
+    std::cout << "Occupied blocks: " << fat.getTotalBlocks() - freeBlocks << "\n";
+    std::cout << "Files: " << total.files << "\n";
+    std::cout << "Directories: " << total.directories + 1 << "\n";
+    std::cout << "File data: " << total.bytes << " bytes in " << total.blocks << " blocks\n";
+}
+
+// Bytes and stored blocks of a file, or of everything below a directory
+void FileSystem::diskUsage(const std::string &path)
+{
+    std::unique_lock<std::shared_mutex> treeLock(treeMutex);
+    ensureUsage();
+    DirectoryEntry *entry = findDirectoryEntry(path);
+    if (!entry)
+    {
+        std::cerr << "File not found.\n";
+        return;
+    }
+    Usage usage = entryUsage(*entry);
+    if (entry->getAttributes() & 0x10)
+    {
+        // The directory itself is not one of its descendants
+        --usage.directories;
+    }
+    std::cout << usage.bytes << " bytes, " << usage.blocks << " blocks, " << usage.files << " files, "
+              << usage.directories << " directories\t" << path << "\n";
+}
+
+// Each directory is a pool task that reads its pages, tests every entry against the name view
+// and submits its subdirectories; a task's matches go to stdout in one write when it finishes
+void FileSystem::find(const std::string &path, const FindOptions &options)
+{
+    std::shared_lock<std::shared_mutex> treeLock(treeMutex);
+    DirectoryEntry *startEntry = findDirectoryEntry(path);
+    if (!startEntry)
+    {
+        std::cerr << "File not found.\n";
+        return;
+    }
+    DirectoryEntry start = *startEntry;
+    uint32_t newerThan = 0;
+    if (!options.newer.empty())
+    {
+        DirectoryEntry *reference = findDirectoryEntry(options.newer);
+        if (!reference)
+        {
+            std::cerr << "Reference file not found.\n";
+            return;
+        }
+        newerThan = modificationStamp(*reference);
+    }
+
+    auto matches = [&](const DirectoryEntry &entry)
+    {
+        char attributes = entry.getAttributes();
+        if ((options.type == 'd' && !(attributes & 0x10)) || (options.type == 'f' && (attributes & 0x10)))
+        {
+            return false;
+        }
+        if (!options.name.empty() && !globMatch(options.name, entry.getFileNameView()))
+        {
+            return false;
+        }
+        if (options.sizeCompare)
+        {
+            uint64_t units = (entry.getSize() + options.sizeUnit - 1) / options.sizeUnit;
+            if ((options.sizeCompare == '+' && units <= options.size) ||
+                (options.sizeCompare == '-' && units >= options.size) ||
+                (options.sizeCompare == '=' && units != options.size))
+            {
+                return false;
+            }
+        }
+        if (!options.newer.empty() && modificationStamp(entry) <= newerThan)
+        {
+            return false;
+        }
+        char permissions = attributes & 0x07;
+        if ((options.permCompare == '=' && permissions != options.permissions) ||
+            (options.permCompare == '-' && (permissions & options.permissions) != options.permissions) ||
+            (options.permCompare == '/' && options.permissions && !(permissions & options.permissions)))
+        {
+            return false;
+        }
+        return true;
+    };
+
+    std::mutex outputMutex;
+    auto flush = [&](std::string &buffer)
+    {
+        if (!buffer.empty())
+        {
+            std::lock_guard<std::mutex> lock(outputMutex);
+            std::cout.write(buffer.data(), buffer.size());
+            buffer.clear();
+        }
+    };
+
+    std::string buffer;
+    if (matches(start))
+    {
+        buffer.append(path).push_back('\n');
+        flush(buffer);
+    }
+    if (!(start.getAttributes() & 0x10))
+    {
+        return;
+    }
+
+    ThreadPool pool;
+    std::function<void(DirectoryEntry, std::string)> visit = [&](DirectoryEntry dir, std::string dirPath)
+    {
+        std::vector<DirectoryEntry> children;
+        {
+            std::shared_lock<std::shared_mutex> dirLock(directoryLock(dir.getFirstBlock()));
+            children = readDirectoryChildren(dir);
+        }
+        if (dirPath.empty() || dirPath.back() != '/')
+        {
+            dirPath.push_back('/');
+        }
+
+        std::string found;
+        for (const DirectoryEntry &child : children)
+        {
+            if (matches(child))
+            {
+                found.append(dirPath).append(child.getFileNameView()).push_back('\n');
+            }
+            if (child.getAttributes() & 0x10)
+            {
+                std::string childPath = dirPath;
+                childPath.append(child.getFileNameView());
+                pool.submit([&visit, child, childPath]
+                            { visit(child, childPath); });
+            }
+        }
+        flush(found);
+    };
+    pool.submit([&visit, start, path]
+                { visit(start, path); });
+    pool.wait();
+}
+
+// A file brings its size and stored blocks; a directory brings its whole subtree and itself
+FileSystem::Usage FileSystem::entryUsage(const DirectoryEntry &entry) const
+{
+    Usage usage;
+    if (entry.getAttributes() & 0x10)
+    {
+        std::lock_guard<std::mutex> lock(usageMutex);
+        auto it = directoryUsage.find(entry.getFirstBlock());
+        if (it != directoryUsage.end())
+        {
+            usage = it->second.total;
+        }
+        ++usage.directories;
+        return usage;
+    }
+    usage.bytes = entry.getSize();
+    usage.blocks = static_cast<int64_t>(getChain(entry).size());
+    usage.files = 1;
+    return usage;
+}
+
+// Adds usage (subtracts it with sign -1) to a directory and every directory above it
+void FileSystem::chargeUsage(int directoryBlock, const Usage &usage, int sign)
+{
+    std::lock_guard<std::mutex> lock(usageMutex);
+    if (!usageValid)
+    {
+        return;
+    }
+    for (auto it = directoryUsage.find(directoryBlock); it != directoryUsage.end(); it = directoryUsage.find(it->second.parent))
+    {
+        it->second.total.bytes += sign * usage.bytes;
+        it->second.total.blocks += sign * usage.blocks;
+        it->second.total.files += sign * usage.files;
+        it->second.total.directories += sign * usage.directories;
+    }
+}
+
+void FileSystem::addDirectoryUsage(int directoryBlock, int parentBlock)
+{
+    std::lock_guard<std::mutex> lock(usageMutex);
+    if (usageValid)
+    {
+        directoryUsage[directoryBlock] = DirectoryUsage{parentBlock, Usage()};
+    }
+}
+
+void FileSystem::removeDirectoryUsage(int directoryBlock)
+{
+    std::lock_guard<std::mutex> lock(usageMutex);
+    directoryUsage.erase(directoryBlock);
+}
+
+// For bulk changes (import, tar-in, dedupe, restore, shrink); the next save or query rebuilds the table
+void FileSystem::invalidateUsage()
+{
+    std::lock_guard<std::mutex> lock(usageMutex);
+    usageValid = false;
+    directoryUsage.clear();
+}
+
+// Rebuilds the table with one walk over the tree; callers hold the tree lock exclusively
+void FileSystem::ensureUsage() const
+{
+    {
+        std::lock_guard<std::mutex> lock(usageMutex);
+        if (usageValid)
+        {
+            return;
+        }
+    }
+    const DirectoryEntry *root = rootEntry;
+    if (!root)
+    {
+        return;
+    }
+
+    std::map<int, DirectoryUsage> rebuilt;
+    rebuilt[root->getFirstBlock()] = DirectoryUsage{-1, Usage()};
+    std::vector<DirectoryEntry> directories(1, *root);
+    for (size_t i = 0; i < directories.size(); ++i)
+    {
+        int block = directories[i].getFirstBlock();
+        for (const DirectoryEntry &child : readDirectoryChildren(directories[i]))
+        {
+            if (!(child.getAttributes() & 0x10))
+            {
+                Usage &own = rebuilt[block].total;
+                own.bytes += child.getSize();
+                own.blocks += static_cast<int64_t>(getChain(child).size());
+                ++own.files;
+            }
+            else if (rebuilt.emplace(child.getFirstBlock(), DirectoryUsage{block, Usage()}).second)
+            {
+                directories.push_back(child);
+            }
+        }
+    }
+    // Children were found after their parents, so folding in reverse adds up every subtree
+    for (size_t i = directories.size(); i-- > 1;)
+    {
+        const DirectoryUsage &child = rebuilt[directories[i].getFirstBlock()];
+        Usage &parent = rebuilt[child.parent].total;
+        parent.bytes += child.total.bytes;
+        parent.blocks += child.total.blocks;
+        parent.files += child.total.files;
+        parent.directories += child.total.directories + 1;
+    }
+
+    std::lock_guard<std::mutex> lock(usageMutex);
+    directoryUsage.swap(rebuilt);
+    rootDirectoryBlock = root->getFirstBlock();
+    usageValid = true;
+}
+
+// [root block][count] then count records of [block][parent][bytes][blocks][files][directories]
+bool FileSystem::loadUsage(std::istream &in, uint32_t length)
+{
+    std::string payload(length, '\0');
+    if (!in.read(&payload[0], length))
+    {
+        return false;
+    }
+    std::istringstream section(payload);
+
+    int32_t root = -1;
+    uint32_t count = 0;
+    section.read(reinterpret_cast<char *>(&root), sizeof(root));
+    section.read(reinterpret_cast<char *>(&count), sizeof(count));
+    const uint64_t recordSize = 2 * sizeof(int32_t) + sizeof(Usage);
+    if (!section || length != sizeof(root) + sizeof(count) + count * recordSize)
+    {
+        return false;
+    }
+
+    std::map<int, DirectoryUsage> loaded;
+    for (uint32_t i = 0; i < count; ++i)
+    {
+        int32_t block = 0;
+        DirectoryUsage usage;
+        int32_t parent = 0;
+        section.read(reinterpret_cast<char *>(&block), sizeof(block));
+        section.read(reinterpret_cast<char *>(&parent), sizeof(parent));
+        section.read(reinterpret_cast<char *>(&usage.total), sizeof(usage.total));
+        usage.parent = parent;
+        loaded[block] = usage;
+    }
+    if (!section || !loaded.count(root))
+    {
+        return false;
+    }
+
+    std::lock_guard<std::mutex> lock(usageMutex);
+    directoryUsage.swap(loaded);
+    rootDirectoryBlock = root;
+    usageValid = true;
+    return true;
+}
+
+bool FileSystem::filesystemExists(const std::string &fileName)
+{
+    std::ifstream file(fileName, std::ios::binary);
+    return file.good();
+}
+
+void FileSystem::loadDirectoryEntries()
+{
+    directoryEntries.clear();
+    std::vector<DirectoryEntry> page;
+    for (int i = 0; i < fat.getTotalBlocks(); ++i)
+    {
+        if (fat.isBlockBusy(i))
+        {
+            if (!readDirectoryPage(i, page))
+            {
+                std::cerr << "Failed to open file system.\n";
+                return;
+            }
+            for (const DirectoryEntry &entry : page)
+            {
+                if (std::strlen(entry.getFileName().c_str()) > 0)
+                {
+                    directoryEntries.push_back(entry);
+                }
+            }
+        }
+    }
+}
+
+void FileSystem::writeDirectoryEntryToPage(int block, const DirectoryEntry &dirEntry)
+{
+    appendDirectoryEntries(block, std::vector<DirectoryEntry>(1, dirEntry));
+}
+
+// Fills the first empty slots of a directory chain, extending the chain when it is full.
+// Every touched directory block is written exactly once.
+void FileSystem::appendDirectoryEntries(int block, const std::vector<DirectoryEntry> &entries, bool freshBlock)
+{
+    std::vector<DirectoryEntry> page(static_cast<size_t>(fat.getBlockSize()) / sizeof(DirectoryEntry));
+    size_t nextEntry = 0;
+    while (nextEntry < entries.size())
+    {
+        if (freshBlock)
+        {
+            std::fill(page.begin(), page.end(), DirectoryEntry());
+        }
+        else if (!readDirectoryPage(block, page))
+        {
+            std::cerr << "Failed to open file system.\n";
+            return;
+        }
+
+        bool pageChanged = false;
+        for (size_t i = 0; i < page.size() && nextEntry < entries.size(); ++i)
+        {
+            if (page[i].getFileName()[0] == '\0')
+            {
+                page[i] = entries[nextEntry++];
+                pageChanged = true;
+            }
+            else
+            {
+                i += inlineSlots(page[i]);
+            }
+        }
+
+        if (pageChanged || freshBlock)
+        {
+            writeDirectoryPage(block, page);
+        }
+
+        if (nextEntry < entries.size())
+        {
+            int nextBlock = fat.getNextBlock(block);
+            freshBlock = nextBlock == -1;
+            if (freshBlock)
+            {
+                nextBlock = fat.allocateBlock();
+                if (nextBlock == -1)
+                {
+                    std::cerr << "No space left in directory block to write new entry.\n";
+                    return;
+                }
+                fat.setNextBlock(block, nextBlock);
+            }
+            block = nextBlock;
+        }
+    }
+}
+
+std::string_view FileSystem::getParentDirectoryName(std::string_view path) const
+{
+    size_t end = path.find_last_not_of('/');
+    size_t slash = end == std::string_view::npos ? end : path.find_last_of('/', end);
+    std::string_view parent = slash == std::string_view::npos ? std::string_view() : path.substr(0, slash);
+    if (parent.find_first_not_of('/') == std::string_view::npos)
+    {
+        return "/"; // No parent directory exists
+    }
+    return parent;
+}
+std::vector<std::string> FileSystem::splitPath(const std::string &path)
+{
+    std::vector<std::string> parts;
+    size_t start = 0;
+    while (start < path.size())
+    {
+        size_t slash = path.find('/', start);
+        if (slash == std::string::npos)
+        {
+            slash = path.size();
+        }
+        if (slash > start)
+        {
+            parts.emplace_back(path, start, slash - start);
+        }
+        start = slash + 1;
+    }
+    return parts;
+}
+// Resolves a path from the root one component at a time; an empty path or "/" is the root
+DirectoryEntry *FileSystem::findDirectoryEntry(std::string_view path) const
+{
+    std::shared_lock<std::shared_mutex> entriesLock(entriesMutex);
+    DirectoryEntry *entry = rootEntry;
+    size_t start = 0;
+    while (entry && start < path.size())
+    {
+        size_t slash = std::min(path.find('/', start), path.size());
+        if (slash > start)
+        {
+            entry = (entry->getAttributes() & 0x10) ? findChildEntryUnlocked(entry, path.substr(start, slash - start)) : nullptr;
+        }
+        start = slash + 1;
+    }
+    return entry;
+}
+
+DirectoryEntry *FileSystem::findDirectoryEntryByBlock(int block)
+{
+    std::shared_lock<std::shared_mutex> entriesLock(entriesMutex);
+    for (auto &entry : directoryEntries)
+    {
+        if (entry.getFirstBlock() == block)
+        {
+            return &entry;
+        }
+    }
+    return nullptr;
+}
+
+DirectoryEntry *FileSystem::findDirectory(std::string_view path) const
+{
+    DirectoryEntry *entry = findDirectoryEntry(path);
+    return entry && (entry->getAttributes() & 0x10) ? entry : nullptr;
+}
+
+DirectoryEntry *FileSystem::findChildEntry(const DirectoryEntry *parent, std::string_view name)
+{
+    std::shared_lock<std::shared_mutex> entriesLock(entriesMutex);
+    return findChildEntryUnlocked(parent, name);
+}
+
+DirectoryEntry *FileSystem::findChildEntryUnlocked(const DirectoryEntry *parent, std::string_view name) const
+{
+    uint64_t key;
+    if (!DirectoryEntry::makeNameKey(name, key))
+    {
+        return nullptr;
+    }
+    auto child = childEntries.find(std::make_pair(parent, key));
+    return child == childEntries.end() ? nullptr : child->second;
+}
+
+DirectoryEntry *FileSystem::addDirectoryEntry(const DirectoryEntry &entry, const DirectoryEntry *parent)
+{
+    std::unique_lock<std::shared_mutex> entriesLock(entriesMutex);
+    auto position = directoryEntries.insert(directoryEntries.end(), entry);
+    childEntries[std::make_pair(parent, entry.getNameKey())] = &*position;
+    entryLinks[&*position] = EntryLink{parent, position};
+    return &*position;
+}
+
+void FileSystem::eraseDirectoryEntryUnlocked(DirectoryEntry *entry)
+{
+    auto link = entryLinks.find(entry);
+    if (link == entryLinks.end())
+    {
+        return;
+    }
+    auto child = childEntries.find(std::make_pair(link->second.parent, entry->getNameKey()));
+    if (child != childEntries.end() && child->second == entry)
+    {
+        childEntries.erase(child);
+    }
+    directoryEntries.erase(link->second.position);
+    entryLinks.erase(link);
+}
+
+// Links every loaded entry under its parent by walking the directory pages from the root. Pages hold
+// a copy of each child's entry: an identical entry is taken first, then one on the same first block.
+void FileSystem::rebuildEntryIndex()
+{
+    std::unique_lock<std::shared_mutex> entriesLock(entriesMutex);
+    childEntries.clear();
+    entryLinks.clear();
+    rootEntry = nullptr;
+    std::unordered_multimap<uint64_t, std::list<DirectoryEntry>::iterator> unlinked;
+    for (auto it = directoryEntries.begin(); it != directoryEntries.end(); ++it)
+    {
+        if (!rootEntry && it->getFileNameView() == "/" && (it->getAttributes() & 0x10))
+        {
+            rootEntry = &*it;
+            entryLinks[rootEntry] = EntryLink{nullptr, it};
+        }
+        else
+        {
+            unlinked.emplace(it->getNameKey(), it);
+        }
+    }
+
+    std::vector<DirectoryEntry *> directories;
+    if (rootEntry)
+    {
+        directories.push_back(rootEntry);
+    }
+    for (size_t i = 0; i < directories.size(); ++i)
+    {
+        for (const DirectoryEntry &child : readDirectoryChildren(*directories[i]))
+        {
+            auto candidates = unlinked.equal_range(child.getNameKey());
+            auto match = candidates.second;
+            for (auto it = candidates.first; it != candidates.second; ++it)
+            {
+                if (std::memcmp(&*it->second, &child, sizeof(DirectoryEntry)) == 0)
+                {
+                    match = it;
+                    break;
+                }
+                if (match == candidates.second ||
+                    (it->second->getFirstBlock() == child.getFirstBlock() && match->second->getFirstBlock() != child.getFirstBlock()))
+                {
+                    match = it;
+                }
+            }
+            if (match == candidates.second)
+            {
+                continue;
+            }
+            DirectoryEntry *entry = &*match->second;
+            childEntries.emplace(std::make_pair(directories[i], entry->getNameKey()), entry);
+            entryLinks[entry] = EntryLink{directories[i], match->second};
+            if (entry->getAttributes() & 0x10)
+            {
+                directories.push_back(entry);
+            }
+            unlinked.erase(match);
+        }
+    }
+}
+
+std::shared_mutex &FileSystem::directoryLock(int block) const
+{
+    std::lock_guard<std::mutex> guard(directoryLocksMutex);
+    std::unique_ptr<std::shared_mutex> &lock = directoryLocks[block];
+    if (!lock)
+    {
+        lock.reset(new std::shared_mutex());
+    }
+    return *lock;
+}
+
+std::string_view FileSystem::getDirectoryName(std::string_view path) const
+{
+    size_t end = path.find_last_not_of('/');
+    if (end == std::string_view::npos)
+    {
+        return std::string_view(); // No directory exists
+    }
+    size_t slash = path.find_last_of('/', end);
+    size_t start = slash == std::string_view::npos ? 0 : slash + 1;
+    return path.substr(start, end + 1 - start);
+}
+void FileSystem::printBlockContents() const
+{
+    std::unique_lock<std::shared_mutex> treeLock(treeMutex);
+    std::cout << "Block Contents:\n";
+    std::vector<char> buffer(static_cast<int>(fat.getBlockSize()));
+    for (int i = 1; i < fat.getTotalBlocks(); ++i)
+    {
+        if (fat.isBlockBusy(i))
+        {
+            std::cout << "Block " << i << ":\n";
+            if (!device.readBlock(i, buffer.data()))
+            {
+                std::cerr << "Failed to open file system.\n";
+                return;
+            }
+
+            // Print the content of the block as is
+            for (char c : buffer)
+            {
+                std::cout << c;
+            }
+            std::cout << "\n";
+        }
+    }
+}
+
+void FileSystem::writeFileToFile(const std::string &fileName, const std::string &targetFile, bool clone)
+{
+    std::shared_lock<std::shared_mutex> treeLock(treeMutex);
+    DirectoryEntry *parentDir = findDirectory(getParentDirectoryName(fileName));
+    DirectoryEntry *sourceDir = findDirectory(getParentDirectoryName(targetFile));
+    if (!parentDir || !sourceDir)
+    {
+        std::cerr << "Parent directory not found.\n";
+        return;
+    }
+    std::unique_lock<std::shared_mutex> parentLock(directoryLock(parentDir->getFirstBlock()), std::defer_lock);
+    std::unique_lock<std::shared_mutex> sourceLock(directoryLock(sourceDir->getFirstBlock()), std::defer_lock);
+    lockDirectoryPair(parentLock, sourceLock);
+    writeFileToFileUnlocked(fileName, targetFile, clone);
+}
+
+void FileSystem::writeFileToFileUnlocked(const std::string &fileName, const std::string &targetFile, bool clone)
+{
+    std::string_view shortFileName = getDirectoryName(fileName);
+    std::string_view targetShortFileName = getDirectoryName(targetFile);
+    DirectoryEntry *parentDir = findDirectory(getParentDirectoryName(fileName));
+    DirectoryEntry *sourceDir = findDirectory(getParentDirectoryName(targetFile));
+    if (!parentDir || !sourceDir)
+    {
+        std::cerr << "Parent directory not found.\n";
+        return;
+    }
+
+    // Find the source file entry
+    DirectoryEntry *sourceIt = findChildEntry(sourceDir, targetShortFileName);
+    if (!sourceIt)
+    {
+        std::cerr << "Source file not found.\n";
+        return;
+    }
+
+    // If the file exists, check write permission
+    if (!(sourceIt->getAttributes() & 0x02)) // Check if the file has write permission
+    {
+        std::cerr << "Write permission denied.\n";
+        return;
+    }
+
+    // Check if the new file already exists
+    if (findChildEntry(parentDir, shortFileName))
+    {
+        std::cerr << "File already exists.\n";
+        return;
+    }
+
+    char attributes = 0x23 | (sourceIt->getAttributes() & 0x04); // Copies keep the source's compression
+    DirectoryEntry newFile(shortFileName, sourceIt->getFirstBlock(), sourceIt->getSize(), attributes); // Set as file
+    newFile.updateModificationTime();
+    int parentBlock = parentDir->getFirstBlock();
+    if (clone && !(sourceIt->getAttributes() & 0x08) && shareChain(getChain(*sourceIt)))
+    {
+        // The source chain is shared: only reference counts change, no data is copied
+        writeDirectoryEntryToPage(parentBlock, newFile);
+    }
+    else
+    {
+        // Read the content from the source file; an inline source has no chain to share, and a
+        // chain with a block at the reference limit is copied instead
+        std::string content;
+        readChain(*sourceIt, content);
+        newFile.setSize(content.size());
+
+        // Create a new file with the content
+        if (!storeFile(parentBlock, newFile, content))
+        {
+            std::cerr << "No space left to allocate new file.\n";
+            return;
+        }
+    }
+    addDirectoryEntry(newFile, parentDir);
+    chargeUsage(parentBlock, entryUsage(newFile));
+}
+
+void FileSystem::saveFileSystem() const
+{
+    std::unique_lock<std::shared_mutex> treeLock(treeMutex);
+    // Under Commit the blocks the metadata will point at reach the disk before any metadata is written
+    if (syncPolicy == SyncPolicy::Commit && !device.syncData())
+    {
+        std::cerr << "Failed to sync file system data; metadata not saved.\n";
+        return;
+    }
+    std::ofstream file(fat.getFileName(), std::ios::binary | std::ios::out | std::ios::in);
+    if (!file.is_open())
+    {
+        std::cerr << "Failed to open file system for saving.\n";
+        return;
+    }
+
+    // Save the block size at the beginning of the file
+    double blockSize = fat.getBlockSize();
+    file.write(reinterpret_cast<const char *>(&blockSize), sizeof(blockSize));
+    file.write(reinterpret_cast<const char *>(&superblockMagic), sizeof(superblockMagic));
+    file.write(reinterpret_cast<const char *>(&superblockVersion), sizeof(superblockVersion));
+    file.write(reinterpret_cast<const char *>(&features), sizeof(features));
+    uint32_t blockCount = fat.getTotalBlocks();
+    file.write(reinterpret_cast<const char *>(&blockCount), sizeof(blockCount));
+    uint32_t crc = CRC32C::compute(&blockSize, sizeof(blockSize));
+    crc = CRC32C::compute(&superblockMagic, sizeof(superblockMagic), crc);
+    crc = CRC32C::compute(&superblockVersion, sizeof(superblockVersion), crc);
+    crc = CRC32C::compute(&features, sizeof(features), crc);
+    crc = CRC32C::compute(&blockCount, sizeof(blockCount), crc);
+
+    // Punch out the blocks freed since the last save that are still free
+    {
+        std::lock_guard<std::mutex> lock(discardMutex);
+        std::vector<int> freeBlocks;
+        for (int block : pendingDiscard)
+        {
+            if (!fat.isBlockBusy(block))
+            {
+                freeBlocks.push_back(block);
+            }
+        }
+        pendingDiscard.clear();
+        if ((features & featureDiscard) && !device.discardBlocks(freeBlocks))
+        {
+            std::cerr << "Discard is not supported for this file system file.\n";
+        }
+    }
+
+    // The metadata is assembled in memory so its checksum can be appended before the end tag
+    std::ostringstream metadata;
+
+    // Save FAT entries
+    for (int i = 0; i < fat.totalBlocks; ++i)
+    {
+        metadata.write(reinterpret_cast<const char *>(&fat.FAT[i]), sizeof(FAT12::FATEntry));
+    }
+
+    // Save directory entries
+    uint32_t entryCount = directoryEntries.size();
+    metadata.write(reinterpret_cast<const char *>(&entryCount), sizeof(entryCount));
+    for (const auto &entry : directoryEntries)
+    {
+        metadata.write(reinterpret_cast<const char *>(&entry), sizeof(entry));
+    }
+
+    // Save optional metadata sections
+    if (dedupe.size() > 0)
+    {
+        std::ostringstream payload;
+        dedupe.save(payload);
+        writeSection(metadata, sectionDedupeIndex, payload.str());
+    }
+    for (const Snapshot &snapshot : snapshots)
+    {
+        std::ostringstream payload;
+        saveSnapshot(payload, snapshot);
+        writeSection(metadata, sectionSnapshot, payload.str());
+    }
+    if (!device.getStripeMembers().empty())
+    {
+        std::ostringstream payload;
+        uint32_t unit = device.getStripeUnit();
+        uint32_t memberCount = device.getStripeMembers().size();
+        payload.write(reinterpret_cast<const char *>(&unit), sizeof(unit));
+        payload.write(reinterpret_cast<const char *>(&memberCount), sizeof(memberCount));
+        for (const std::string &member : device.getStripeMembers())
+        {
+            uint32_t pathLength = member.size();
+            payload.write(reinterpret_cast<const char *>(&pathLength), sizeof(pathLength));
+            payload.write(member.data(), pathLength);
+        }
+        writeSection(metadata, sectionStripes, payload.str());
+    }
+    ensureUsage();
+    if (usageValid)
+    {
+        std::ostringstream payload;
+        std::lock_guard<std::mutex> lock(usageMutex);
+        int32_t root = rootDirectoryBlock;
+        uint32_t count = directoryUsage.size();
+        payload.write(reinterpret_cast<const char *>(&root), sizeof(root));
+        payload.write(reinterpret_cast<const char *>(&count), sizeof(count));
+        for (const auto &directory : directoryUsage)
+        {
+            int32_t block = directory.first;
+            int32_t parent = directory.second.parent;
+            payload.write(reinterpret_cast<const char *>(&block), sizeof(block));
+            payload.write(reinterpret_cast<const char *>(&parent), sizeof(parent));
+            payload.write(reinterpret_cast<const char *>(&directory.second.total), sizeof(directory.second.total));
+        }
+        writeSection(metadata, sectionUsage, payload.str());
+    }
+    if (features & featureChecksums)
+    {
+        const std::vector<uint32_t> &checksums = device.getChecksums();
+        writeSection(metadata, sectionBlockChecksums, std::string(reinterpret_cast<const char *>(checksums.data()), checksums.size() * sizeof(uint32_t)));
+    }
+    std::string bytes = metadata.str();
+    crc = CRC32C::compute(bytes.data(), bytes.size(), crc);
+    writeSection(metadata, sectionMetadataChecksum, std::string(reinterpret_cast<const char *>(&crc), sizeof(crc)));
+    metadata.write(reinterpret_cast<const char *>(&sectionEnd), sizeof(sectionEnd));
+
+    // Seek to the end of the data area
+    std::streamoff metadataOffset = static_cast<std::streamoff>(fat.totalBlocks * blockSize);
+    file.seekp(metadataOffset, std::ios::beg);
+    bytes = metadata.str();
+    file.write(bytes.data(), bytes.size());
+    file.close();
+
+    // Drop anything past the metadata, such as the tail left behind by a shrink
+    std::error_code error;
+    std::filesystem::resize_file(fat.getFileName(), metadataOffset + bytes.size(), error);
+    if (syncPolicy == SyncPolicy::Commit && !device.syncImage())
+    {
+        std::cerr << "Failed to sync file system metadata.\n";
+    }
+}
+
+void FileSystem::loadFileSystem(const std::string &fileName)
+{
+    std::unique_lock<std::shared_mutex> treeLock(treeMutex);
+    std::ifstream file(fileName, std::ios::binary | std::ios::in);
+    if (!file.is_open())
+    {
+        std::cerr << "Failed to open file system for loading.\n";
+        return;
+    }
+
+    // Read the block size from the beginning of the file
+    double blockSize;
+    file.read(reinterpret_cast<char *>(&blockSize), sizeof(blockSize));
+    fat.setBlockSize(blockSize);
+
+    // Images written before the superblock existed have zeros here and carry no sections
+    uint32_t magic = 0;
+    uint32_t version = 0;
+    file.read(reinterpret_cast<char *>(&magic), sizeof(magic));
+    file.read(reinterpret_cast<char *>(&version), sizeof(version));
+    file.read(reinterpret_cast<char *>(&features), sizeof(features));
+    uint32_t crc = CRC32C::compute(&blockSize, sizeof(blockSize));
+    crc = CRC32C::compute(&magic, sizeof(magic), crc);
+    crc = CRC32C::compute(&version, sizeof(version), crc);
+    crc = CRC32C::compute(&features, sizeof(features), crc);
+    if (magic != superblockMagic)
+    {
+        version = 0;
+        features = 0;
+    }
+    uint32_t blockCount = FAT12::defaultTotalBlocks;
+    if (version >= 2)
+    {
+        file.read(reinterpret_cast<char *>(&blockCount), sizeof(blockCount));
+        crc = CRC32C::compute(&blockCount, sizeof(blockCount), crc);
+        if (blockCount < 2 || blockCount > static_cast<uint32_t>(FAT12::maxTotalBlocks))
+        {
+            std::cerr << "Error: Invalid block count in superblock.\n";
+            return;
+        }
+    }
+    fat.setTotalBlocks(blockCount);
+    snapshotHolds.assign(blockCount, 0);
+
+    // Seek to the end of the data area and take the metadata in one read so it can be checksummed
+    file.seekg(fat.totalBlocks * blockSize, std::ios::beg);
+    std::ostringstream buffer;
+    buffer << file.rdbuf();
+    file.close();
+    const std::string bytes = buffer.str();
+    std::istringstream metadata(bytes);
+
+    // Load FAT entries
+    for (int i = 0; i < fat.totalBlocks; ++i)
+    {
+        metadata.read(reinterpret_cast<char *>(&fat.FAT[i]), sizeof(FAT12::FATEntry));
+        if (version == 0)
+        {
+            // These fields were struct padding in older images
+            fat.FAT[i].holeBlocks = 0;
+            fat.FAT[i].shareCount = 0;
+        }
+    }
+    fat.recountFreeBlocks();
+
+    // Load directory entries; they are linked to their parents once the pages can be read
+    directoryEntries.clear();
+    rebuildEntryIndex();
+    invalidateUsage();
+    uint32_t entryCount;
+    metadata.read(reinterpret_cast<char *>(&entryCount), sizeof(entryCount));
+
+    // Inline files and clones take no block of their own, so only the section's length bounds the count
+    std::streamoff entriesOffset = metadata.tellg();
+    if (entriesOffset < 0 || entryCount > (bytes.size() - static_cast<size_t>(entriesOffset)) / sizeof(DirectoryEntry))
+    {
+        std::cerr << "Error: Entry count exceeds expected number.\n";
+        return;
+    }
+
+    for (uint32_t i = 0; i < entryCount; ++i)
+    {
+        DirectoryEntry entry;
+        metadata.read(reinterpret_cast<char *>(&entry), sizeof(entry));
+        directoryEntries.push_back(entry);
+    }
+
+    // Load optional metadata sections, skipping any this build does not know
+    bool checksumsLoaded = false;
+    std::streamoff tagOffset = metadata.tellg();
+    uint32_t tag = sectionEnd;
+    while (version >= 1 && metadata.read(reinterpret_cast<char *>(&tag), sizeof(tag)) && tag != sectionEnd)
+    {
+        uint32_t length = 0;
+        metadata.read(reinterpret_cast<char *>(&length), sizeof(length));
+        if (tag == sectionDedupeIndex)
+        {
+            dedupe.load(metadata, length);
+        }
+        else if (tag == sectionBlockChecksums && length == fat.totalBlocks * sizeof(uint32_t))
+        {
+            std::vector<uint32_t> checksums(fat.totalBlocks);
+            metadata.read(reinterpret_cast<char *>(checksums.data()), length);
+            device.setChecksums(checksums);
+            checksumsLoaded = true;
+        }
+        else if (tag == sectionSnapshot)
+        {
+            if (!loadSnapshot(metadata, length))
+            {
+                std::cerr << "Skipping a damaged snapshot.\n";
+            }
+        }
+        else if (tag == sectionStripes)
+        {
+            uint32_t unit = 0;
+            uint32_t memberCount = 0;
+            metadata.read(reinterpret_cast<char *>(&unit), sizeof(unit));
+            metadata.read(reinterpret_cast<char *>(&memberCount), sizeof(memberCount));
+            std::vector<std::string> members;
+            for (uint32_t i = 0; i < memberCount && metadata; ++i)
+            {
+                uint32_t pathLength = 0;
+                metadata.read(reinterpret_cast<char *>(&pathLength), sizeof(pathLength));
+                if (pathLength > length)
+                {
+                    break;
+                }
+                std::string member(pathLength, '\0');
+                metadata.read(&member[0], pathLength);
+                members.push_back(member);
+            }
+            if (!metadata || members.size() != memberCount)
+            {
+                std::cerr << "Error: Damaged stripe layout.\n";
+                return;
+            }
+            device.setStripes(members, static_cast<int>(unit));
+        }
+        else if (tag == sectionUsage)
+        {
+            // A damaged table is rebuilt from the tree when it is next needed
+            loadUsage(metadata, length);
+        }
+        else if (tag == sectionMetadataChecksum && length == sizeof(uint32_t))
+        {
+            uint32_t stored = 0;
+            metadata.read(reinterpret_cast<char *>(&stored), sizeof(stored));
+            bool valid = stored == CRC32C::compute(bytes.data(), static_cast<size_t>(tagOffset), crc);
+            metadataChecksum = valid ? MetadataChecksum::Valid : MetadataChecksum::Mismatch;
+            if (!valid)
+            {
+                std::cerr << "Metadata checksum mismatch.\n";
+            }
+        }
+        else
+        {
+            metadata.ignore(length);
+        }
+        tagOffset = metadata.tellg();
+    }
+
+    if ((features & featureChecksums) && !checksumsLoaded)
+    {
+        std::cerr << "Block checksum table is missing; checksums are off.\n";
+        features &= ~featureChecksums;
+    }
+    rebuildEntryIndex();
+}
+
+void FileSystem::writeFileWithPassword(const std::string &fileName, const std::string &content, std::string password, char attributes)
+{
+    std::string_view parentName = getParentDirectoryName(fileName);
+    std::string_view shortFileName = getDirectoryName(fileName);
+
+    DirectoryEntry *parentDir = findDirectory(parentName);
+    if (!parentDir)
+    {
+        std::cerr << "Parent directory not found.\n";
+        return;
+    }
+
+    // Check if the file already exists
+    if (fileExistinDirectoryEntry(parentDir, shortFileName))
+    {
+        std::cerr << "File already exists.\n";
+        return;
+    }
+
+    DirectoryEntry newFile(shortFileName, 0, content.size(), attributes); // Set as file
+    newFile.setPassword(password);
+    newFile.updateModificationTime();
+    if (!storeFile(parentDir->getFirstBlock(), newFile, content))
+    {
+        std::cerr << "No space left to allocate new file.\n";
+        return;
+    }
+    addDirectoryEntry(newFile, parentDir);
+    chargeUsage(parentDir->getFirstBlock(), entryUsage(newFile));
+}
+
+void FileSystem::printBits(unsigned char byte)
+{
+    std::bitset<8> bits(byte);
+    std::cout << bits << std::endl;
+}
+
+void FileSystem::writeFileWithAttribute(const std::string &fileName, const std::string &content, char attributeNew)
+{
+    std::string_view parentName = getParentDirectoryName(fileName);
+    std::string_view shortFileName = getDirectoryName(fileName);
+
+    DirectoryEntry *parentDir = findDirectory(parentName);
+    if (!parentDir)
+    {
+        std::cerr << "Parent directory not found.\n";
+        return;
+    }
+
+    // Check if the file already exists
+    if (fileExistinDirectoryEntry(parentDir, shortFileName))
+    {
+        std::cerr << "File already exists.\n";
+        return;
+    }
+
+    DirectoryEntry newFile(shortFileName, 0, content.size(), attributeNew); // Set as file
+    newFile.updateModificationTime();
+    if (!storeFile(parentDir->getFirstBlock(), newFile, content))
+    {
+        std::cerr << "No space left to allocate new file.\n";
+        return;
+    }
+    addDirectoryEntry(newFile, parentDir);
+    chargeUsage(parentDir->getFirstBlock(), entryUsage(newFile));
+}
+
+void FileSystem::importDirectory(const std::string &hostDir, const std::string &imageDir)
+{
+    namespace fs = std::filesystem;
+    std::unique_lock<std::shared_mutex> treeLock(treeMutex);
+    invalidateUsage();
+
+    DirectoryEntry *targetDir = findDirectory(imageDir);
+    if (!targetDir)
+    {
+        std::cerr << "Image directory not found.\n";
+        return;
+    }
+
+    std::error_code error;
+    if (!fs::is_directory(hostDir, error))
+    {
+        std::cerr << "Host directory not found.\n";
+        return;
+    }
+
+    struct ImportedFile
+    {
+        fs::path hostPath;
+        uint32_t size;
+        std::vector<int> blocks;
+    };
+
+    // Walk the host tree once: create directories and pre-size every file chain
+    std::map<fs::path, DirectoryEntry *> directories;
+    std::map<int, std::vector<DirectoryEntry>> pendingEntries;
+    std::set<int> freshDirectoryBlocks;
+    std::set<std::pair<int, std::string>> usedNames;
+    std::vector<ImportedFile> files;
+    fs::path hostRoot = fs::path(hostDir).lexically_normal();
+    if (!hostRoot.has_filename())
+    {
+        hostRoot = hostRoot.parent_path();
+    }
+    directories[hostRoot] = targetDir;
+
+    const int blockSize = static_cast<int>(fat.getBlockSize());
+    for (fs::recursive_directory_iterator it(hostRoot, error), end; !error && it != end; it.increment(error))
+    {
+        auto parentIt = directories.find(it->path().parent_path());
+        if (parentIt == directories.end())
+        {
+            it.disable_recursion_pending();
+            continue;
+        }
+
+        const DirectoryEntry &parent = *parentIt->second;
+        int parentBlock = parent.getFirstBlock();
+        DirectoryEntry probe(it->path().filename().string(), 0, 0, 0);
+        std::string storedName = probe.getFileName();
+        bool nameTaken = !usedNames.insert(std::make_pair(parentBlock, storedName)).second ||
+                         (parentBlock == targetDir->getFirstBlock() && fileExistinDirectoryEntry(targetDir, storedName));
+        if (nameTaken)
+        {
+            std::cerr << "Skipping " << it->path().string() << ": name " << storedName << " already exists.\n";
+            it.disable_recursion_pending();
+            continue;
+        }
+
+        if (it->is_directory(error))
+        {
+            int block = fat.allocateBlock();
+            if (block == -1)
+            {
+                std::cerr << "No space left to allocate new directory.\n";
+                it.disable_recursion_pending();
+                continue;
+            }
+
+            DirectoryEntry newDir(storedName, block, 0, 0x13); // Set as directory
+            newDir.updateModificationTime();
+            directories[it->path()] = addDirectoryEntry(newDir, &parent);
+
+            freshDirectoryBlocks.insert(block);
+            std::vector<DirectoryEntry> &page = pendingEntries[block];
+            page.insert(page.begin(), {newDir, parent});
+            pendingEntries[parentBlock].push_back(newDir);
+        }
+        else if (it->is_regular_file(error))
+        {
+            uintmax_t size = it->file_size(error);
+            if (error || size > UINT32_MAX)
+            {
+                std::cerr << "Skipping " << it->path().string() << ": unsupported size.\n";
+                continue;
+            }
+
+            int blockCount = std::max<int>(1, static_cast<int>((size + blockSize - 1) / blockSize));
+            std::vector<int> blocks = fat.allocateChain(blockCount);
+            if (blocks.empty())
+            {
+                std::cerr << "No space left to allocate new file " << it->path().string() << ".\n";
+                continue;
+            }
+
+            DirectoryEntry newFile(storedName, blocks.front(), static_cast<uint32_t>(size), 0x23); // Set as file
+            newFile.updateModificationTime();
+            addDirectoryEntry(newFile, &parent);
+            pendingEntries[parentBlock].push_back(newFile);
+            files.push_back(ImportedFile{it->path(), static_cast<uint32_t>(size), blocks});
+        }
+    }
+
+    // Host reads run on the pool while this thread writes finished buffers into the image
+    const size_t maxBytesInFlight = 64 * 1024 * 1024;
+    std::mutex queueMutex;
+    std::condition_variable bufferReady;
+    std::condition_variable bufferSpace;
+    std::deque<std::pair<size_t, std::string>> readBuffers;
+    size_t bytesInFlight = 0;
+
+    ThreadPool pool;
+    for (size_t i = 0; i < files.size(); ++i)
+    {
+        pool.submit([&, i]
+                    {
+            std::string content(files[i].size, '\0');
+            std::ifstream hostFile(files[i].hostPath, std::ios::binary);
+            if (hostFile.is_open())
+            {
+                hostFile.read(&content[0], content.size());
+            }
+            else
+            {
+                std::cerr << "Failed to read " << files[i].hostPath.string() << ".\n";
+            }
+
+            std::unique_lock<std::mutex> lock(queueMutex);
+            bufferSpace.wait(lock, [&]
+                             { return bytesInFlight == 0 || bytesInFlight + content.size() <= maxBytesInFlight; });
+            bytesInFlight += content.size();
+            readBuffers.emplace_back(i, std::move(content));
+            bufferReady.notify_one(); });
+    }
+
+    for (size_t written = 0; written < files.size(); ++written)
+    {
+        std::pair<size_t, std::string> buffer;
+        {
+            std::unique_lock<std::mutex> lock(queueMutex);
+            bufferReady.wait(lock, [&]
+                             { return !readBuffers.empty(); });
+            buffer = std::move(readBuffers.front());
+            readBuffers.pop_front();
+        }
+
+        if (!device.writeBlocks(files[buffer.first].blocks, buffer.second.data(), buffer.second.size()))
+        {
+            std::cerr << "Failed to write " << files[buffer.first].hostPath.string() << ".\n";
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(queueMutex);
+            bytesInFlight -= buffer.second.size();
+        }
+        bufferSpace.notify_all();
+    }
+    pool.wait();
+
+    // Each directory block receives its new entries in a single write; new directory pages start empty
+    for (const auto &page : pendingEntries)
+    {
+        appendDirectoryEntries(page.first, page.second, freshDirectoryBlocks.count(page.first) > 0);
+    }
+
+    std::cout << "Imported " << files.size() << " files and " << directories.size() - 1 << " directories.\n";
+}
+
+void FileSystem::exportDirectory(const std::string &imageDir, const std::string &hostDir, bool honourPermissions, const std::string &password)
+{
+    namespace fs = std::filesystem;
+    std::shared_lock<std::shared_mutex> treeLock(treeMutex);
+
+    DirectoryEntry *sourceDir = findDirectory(imageDir);
+    if (!sourceDir)
+    {
+        std::cerr << "Image directory not found.\n";
+        return;
+    }
+
+    // Resolve the whole subtree once, keeping every visited directory read-locked until the copy ends
+    std::vector<std::shared_lock<std::shared_mutex>> dirLocks;
+    std::vector<std::pair<DirectoryEntry, fs::path>> pendingDirs(1, std::make_pair(*sourceDir, fs::path(hostDir)));
+    std::vector<std::pair<DirectoryEntry, fs::path>> files;
+    std::set<int> visitedBlocks;
+    std::error_code error;
+    while (!pendingDirs.empty())
+    {
+        std::pair<DirectoryEntry, fs::path> dir = pendingDirs.back();
+        pendingDirs.pop_back();
+        if (!visitedBlocks.insert(dir.first.getFirstBlock()).second)
+        {
+            continue;
+        }
+
+        fs::create_directories(dir.second, error);
+        if (error)
+        {
+            std::cerr << "Failed to create host directory " << dir.second.string() << ".\n";
+            continue;
+        }
+
+        dirLocks.emplace_back(directoryLock(dir.first.getFirstBlock()));
+        for (const DirectoryEntry &child : readDirectoryChildren(dir.first))
+        {
+            fs::path childPath = dir.second / child.getFileName();
+            if (child.getAttributes() & 0x10)
+            {
+                pendingDirs.emplace_back(child, childPath);
+            }
+            else if (honourPermissions && !(child.getAttributes() & 0x01))
+            {
+                std::cerr << "Skipping " << childPath.string() << ": read permission denied.\n";
+            }
+            else if (honourPermissions && child.getPassword() != password)
+            {
+                std::cerr << "Skipping " << childPath.string() << ": password is incorrect.\n";
+            }
+            else
+            {
+                files.emplace_back(child, childPath);
+            }
+        }
+    }
+
+    // Chain reads and host writes fan out across the pool, one whole-file write per file
+    std::atomic<size_t> exportedFiles(0);
+    ThreadPool pool;
+    for (const auto &file : files)
+    {
+        pool.submit([&]
+                    {
+            std::string content;
+            readChain(file.first, content);
+
+            std::ofstream hostFile(file.second, std::ios::binary | std::ios::out | std::ios::trunc);
+            hostFile.write(content.data(), content.size());
+            if (!hostFile)
+            {
+                std::cerr << "Failed to write " << file.second.string() << ".\n";
+                return;
+            }
+            ++exportedFiles; });
+    }
+    pool.wait();
+
+    std::cout << "Exported " << exportedFiles << " files.\n";
+}
+
+// Writes a file's content to the stream a buffer at a time. Runs of stored blocks are read straight
+// into the buffer and holes are zero filled; compressed and inline files are read whole first.
+bool FileSystem::streamChain(const DirectoryEntry &entry, std::ostream &out, std::vector<char> &buffer) const
+{
+    if (entry.getAttributes() & 0x0C)
+    {
+        std::string content;
+        readChain(entry, content);
+        out.write(content.data(), content.size());
+        return content.size() == entry.getSize();
+    }
+
+    const size_t blockSize = static_cast<size_t>(fat.getBlockSize());
+    std::vector<int> logical;
+    for (int block : getChain(entry.getFirstBlock()))
+    {
+        logical.push_back(block);
+        logical.insert(logical.end(), fat.getHoleBlocks(block), -1);
+    }
+
+    // Chunks go out while the next ones are read ahead
+    ReadAhead reader(device, logical, entry.getSize(), blockSize);
+    for (size_t offset = 0; offset < entry.getSize(); offset += buffer.size())
+    {
+        size_t bytes = std::min(buffer.size(), entry.getSize() - offset);
+        if (!reader.read(offset, bytes, buffer.data()))
+        {
+            return false;
+        }
+        out.write(buffer.data(), bytes);
+    }
+    return true;
+}
+
+// Searches a file a buffer at a time. The last pattern length - 1 bytes of each buffer are carried
+// to the front of the next, so matches across buffer and block boundaries are found exactly once.
+bool FileSystem::searchChain(const DirectoryEntry &entry, std::string_view pattern, std::vector<char> &buffer,
+                             const std::function<void(uint64_t)> &found) const
+{
+    std::vector<size_t> matches;
+    if (entry.getAttributes() & 0x0C)
+    {
+        std::string content;
+        readChain(entry, content);
+        PatternSearch::findAll(content.data(), content.size(), pattern, matches);
+        for (size_t match : matches)
+        {
+            found(match);
+        }
+        return content.size() == entry.getSize();
+    }
+
+    const size_t blockSize = static_cast<size_t>(fat.getBlockSize());
+    std::vector<int> logical;
+    for (int block : getChain(entry.getFirstBlock()))
+    {
+        logical.push_back(block);
+        logical.insert(logical.end(), fat.getHoleBlocks(block), -1);
+    }
+
+    const size_t carry = pattern.size() - 1;
+    const size_t chunk = buffer.size() - carry;
+    size_t kept = 0;
+    ReadAhead reader(device, logical, entry.getSize(), blockSize);
+    for (size_t offset = 0; offset < entry.getSize(); offset += chunk)
+    {
+        size_t bytes = std::min(chunk, entry.getSize() - offset);
+        if (!reader.read(offset, bytes, buffer.data() + kept))
+        {
+            return false;
+        }
+        matches.clear();
+        PatternSearch::findAll(buffer.data(), kept + bytes, pattern, matches);
+        for (size_t match : matches)
+        {
+            found(offset - kept + match);
+        }
+        size_t keep = std::min(carry, kept + bytes);
+        std::memmove(buffer.data(), buffer.data() + kept + bytes - keep, keep);
+        kept = keep;
+    }
+    return true;
+}
+
+// Files under the path are searched in parallel; each one's "path:offset" lines are written
+// together, in offset order, as soon as it is done
+void FileSystem::grep(const std::string &pattern, const std::string &path)
+{
+    if (pattern.empty())
+    {
+        std::cerr << "Pattern is empty.\n";
+        return;
+    }
+    std::shared_lock<std::shared_mutex> treeLock(treeMutex);
+    DirectoryEntry *start = findDirectoryEntry(path);
+    if (!start)
+    {
+        std::cerr << "File not found.\n";
+        return;
+    }
+
+    std::vector<std::shared_lock<std::shared_mutex>> dirLocks;
+    std::vector<std::pair<DirectoryEntry, std::string>> pendingDirs;
+    std::vector<std::pair<DirectoryEntry, std::string>> files;
+    if (start->getAttributes() & 0x10)
+    {
+        pendingDirs.emplace_back(*start, path.empty() || path.back() == '/' ? path : path + "/");
+    }
+    else
+    {
+        files.emplace_back(*start, path);
+    }
+    std::set<int> visitedBlocks;
+    while (!pendingDirs.empty())
+    {
+        std::pair<DirectoryEntry, std::string> dir = pendingDirs.back();
+        pendingDirs.pop_back();
+        if (!visitedBlocks.insert(dir.first.getFirstBlock()).second)
+        {
+            continue;
+        }
+        dirLocks.emplace_back(directoryLock(dir.first.getFirstBlock()));
+        for (const DirectoryEntry &child : readDirectoryChildren(dir.first))
+        {
+            std::string childPath = dir.second + child.getFileName();
+            if (child.getAttributes() & 0x10)
+            {
+                pendingDirs.emplace_back(child, childPath + "/");
+            }
+            else
+            {
+                files.emplace_back(child, childPath);
+            }
+        }
+    }
+
+    std::mutex outputMutex;
+    ThreadPool pool;
+    for (const auto &file : files)
+    {
+        if (!(file.first.getAttributes() & 0x01))
+        {
+            std::cerr << "Skipping " << file.second << ": read permission denied.\n";
+            continue;
+        }
+        if (!file.first.getPassword().empty())
+        {
+            std::cerr << "Skipping " << file.second << ": file is password protected.\n";
+            continue;
+        }
+        pool.submit([&]
+                    {
+            const size_t blockSize = static_cast<size_t>(fat.getBlockSize());
+            std::vector<char> buffer(std::max(blockSize, searchChunkBytes / blockSize * blockSize) + pattern.size() - 1);
+            std::string lines;
+            bool complete = searchChain(file.first, pattern, buffer, [&](uint64_t offset)
+                                        {
+                lines.append(file.second).push_back(':');
+                appendNumber(lines, offset);
+                lines.push_back('\n'); });
+            std::lock_guard<std::mutex> lock(outputMutex);
+            std::cout.write(lines.data(), lines.size());
+            if (!complete)
+            {
+                std::cerr << "Failed to read " << file.second << ".\n";
+            } });
+    }
+    pool.wait();
+}
+
+// Streams a ustar archive of the subtree in one depth-first pass; paths are relative to imageDir
+void FileSystem::tarOut(const std::string &imageDir, std::ostream &out)
+{
+    std::shared_lock<std::shared_mutex> treeLock(treeMutex);
+
+    DirectoryEntry *sourceDir = findDirectory(imageDir);
+    if (!sourceDir)
+    {
+        std::cerr << "Image directory not found.\n";
+        return;
+    }
+
+    const size_t blockSize = static_cast<size_t>(fat.getBlockSize());
+    std::vector<char> buffer(std::max(blockSize, tarChunkBytes / blockSize * blockSize));
+    const std::vector<char> padding(TarHeader::recordSize, '\0');
+    char record[TarHeader::recordSize];
+
+    std::vector<std::shared_lock<std::shared_mutex>> dirLocks;
+    std::vector<std::pair<DirectoryEntry, std::string>> pendingDirs(1, std::make_pair(*sourceDir, std::string()));
+    std::set<int> visitedBlocks;
+    while (!pendingDirs.empty() && out)
+    {
+        std::pair<DirectoryEntry, std::string> dir = pendingDirs.back();
+        pendingDirs.pop_back();
+        if (!visitedBlocks.insert(dir.first.getFirstBlock()).second)
+        {
+            continue;
+        }
+        dirLocks.emplace_back(directoryLock(dir.first.getFirstBlock()));
+
+        TarHeader header;
+        header.modificationTime = entryTime(dir.first);
+        if (!dir.second.empty())
+        {
+            header.path = dir.second + "/";
+            header.type = TarHeader::directory;
+            header.mode = 0755;
+            if (!header.encode(record))
+            {
+                std::cerr << "Skipping " << dir.second << ": path is too long.\n";
+                continue;
+            }
+            out.write(record, sizeof(record));
+        }
+
+        for (const DirectoryEntry &child : readDirectoryChildren(dir.first))
+        {
+            std::string path = dir.second.empty() ? child.getFileName() : dir.second + "/" + child.getFileName();
+            if (child.getAttributes() & 0x10)
+            {
+                pendingDirs.emplace_back(child, path);
+                continue;
+            }
+
+            header.path = path;
+            header.type = TarHeader::regularFile;
+            header.size = child.getSize();
+            header.mode = ((child.getAttributes() & 0x01) ? 0444 : 0) | ((child.getAttributes() & 0x02) ? 0200 : 0);
+            header.modificationTime = entryTime(child);
+            if (!header.encode(record))
+            {
+                std::cerr << "Skipping " << path << ": path is too long.\n";
+                continue;
+            }
+            out.write(record, sizeof(record));
+            if (!streamChain(child, out, buffer))
+            {
+                // The header already promised the size, so the archive cannot be continued
+                std::cerr << "Failed to read " << path << ".\n";
+                return;
+            }
+            out.write(padding.data(), TarHeader::paddedSize(header.size) - header.size);
+        }
+    }
+
+    // End of archive: two zero records
+    out.write(padding.data(), padding.size());
+    out.write(padding.data(), padding.size());
+    out.flush();
+    if (!out)
+    {
+        std::cerr << "Failed to write archive.\n";
+    }
+}
+
+// Reads a ustar archive in one pass into imageDir. Each file's chain is allocated from the header and
+// its data written straight from the input buffer; directory pages are written once at the end.
+void FileSystem::tarIn(const std::string &imageDir, std::istream &in)
+{
+    std::unique_lock<std::shared_mutex> treeLock(treeMutex);
+    invalidateUsage();
+
+    DirectoryEntry *targetDir = findDirectory(imageDir);
+    if (!targetDir)
+    {
+        std::cerr << "Image directory not found.\n";
+        return;
+    }
+
+    const size_t blockSize = static_cast<size_t>(fat.getBlockSize());
+    std::vector<char> buffer(std::max(blockSize, tarChunkBytes / blockSize * blockSize));
+    char record[TarHeader::recordSize];
+
+    // Archive directory path -> image directory; skipped directories take their contents with them
+    std::map<std::string, DirectoryEntry *> directories;
+    std::set<std::string> skippedDirs;
+    std::map<int, std::vector<DirectoryEntry>> pendingEntries;
+    std::set<int> freshDirectoryBlocks;
+    std::set<std::pair<int, std::string>> usedNames;
+    directories[""] = targetDir;
+    size_t importedFiles = 0;
+
+    // Reserves a name in the parent, which may be a new directory or one already in the image
+    auto claimName = [&](DirectoryEntry *parent, const std::string &name, std::string &storedName)
+    {
+        storedName = DirectoryEntry(name, 0, 0, 0).getFileName();
+        int parentBlock = parent->getFirstBlock();
+        if (!usedNames.insert(std::make_pair(parentBlock, storedName)).second ||
+            (!freshDirectoryBlocks.count(parentBlock) && fileExistinDirectoryEntry(parent, storedName)))
+        {
+            std::cerr << "Skipping " << name << ": name " << storedName << " already exists.\n";
+            return false;
+        }
+        return true;
+    };
+    auto makeDirectory = [&](const std::string &path, const std::string &name, DirectoryEntry *parent)
+    {
+        std::string storedName;
+        int block = claimName(parent, name, storedName) ? fat.allocateBlock() : -2;
+        if (block < 0)
+        {
+            if (block == -1)
+            {
+                std::cerr << "No space left to allocate new directory.\n";
+            }
+            skippedDirs.insert(path);
+            return false;
+        }
+        DirectoryEntry newDir(storedName, block, 0, 0x13); // Set as directory
+        newDir.updateModificationTime();
+        freshDirectoryBlocks.insert(block);
+        std::vector<DirectoryEntry> &page = pendingEntries[block];
+        page.insert(page.begin(), {newDir, *parent});
+        pendingEntries[parent->getFirstBlock()].push_back(newDir);
+        directories[path] = addDirectoryEntry(newDir, parent);
+        return true;
+    };
+
+    bool ended = false;
+    while (in.read(record, sizeof(record)))
+    {
+        if (TarHeader::isZeroRecord(record))
+        {
+            ended = true;
+            break;
+        }
+        TarHeader header;
+        if (!header.decode(record))
+        {
+            std::cerr << "Invalid tar header.\n";
+            break;
+        }
+
+        std::vector<std::string> parts;
+        for (const std::string &part : splitPath(header.path))
+        {
+            if (part != ".")
+            {
+                parts.push_back(part);
+            }
+        }
+        bool supported = header.type == TarHeader::regularFile || header.type == TarHeader::directory;
+        if (!supported && header.type != 'x' && header.type != 'g')
+        {
+            std::cerr << "Skipping " << header.path << ": unsupported entry type.\n";
+        }
+
+        // Resolve the parent, creating directories the archive did not list
+        std::string parentPath;
+        bool parentFound = supported && !parts.empty();
+        for (size_t i = 0; parentFound && i + 1 < parts.size(); ++i)
+        {
+            std::string path = parentPath.empty() ? parts[i] : parentPath + "/" + parts[i];
+            if (skippedDirs.count(path) || (!directories.count(path) && !makeDirectory(path, parts[i], directories[parentPath])))
+            {
+                parentFound = false;
+            }
+            parentPath = path;
+        }
+
+        std::string path = parentPath.empty() ? (parts.empty() ? "" : parts.back()) : parentPath + "/" + parts.back();
+        std::vector<int> blocks;
+        std::string storedName;
+        if (parentFound && header.type == TarHeader::directory)
+        {
+            if (!directories.count(path) && !skippedDirs.count(path))
+            {
+                makeDirectory(path, parts.back(), directories[parentPath]);
+            }
+        }
+        else if (parentFound && header.size > UINT32_MAX)
+        {
+            std::cerr << "Skipping " << header.path << ": unsupported size.\n";
+        }
+        else if (parentFound && claimName(directories[parentPath], parts.back(), storedName))
+        {
+            blocks = fat.allocateChain(std::max<int>(1, static_cast<int>((header.size + blockSize - 1) / blockSize)));
+            if (blocks.empty())
+            {
+                std::cerr << "No space left to allocate new file " << header.path << ".\n";
+            }
+        }
+
+        // Copy the data into the chain, or step over it
+        uint64_t dataSize = header.type == TarHeader::directory ? 0 : header.size;
+        uint64_t remaining = dataSize;
+        size_t written = 0;
+        if (!blocks.empty() && remaining == 0)
+        {
+            device.writeBlocks(blocks, buffer.data(), 0);
+        }
+        while (remaining > 0 && in)
+        {
+            size_t bytes = static_cast<size_t>(std::min<uint64_t>(remaining, buffer.size()));
+            in.read(buffer.data(), bytes);
+            if (!blocks.empty() && in)
+            {
+                std::vector<int> chunk(blocks.begin() + written / blockSize, blocks.begin() + (written + bytes + blockSize - 1) / blockSize);
+                if (!device.writeBlocks(chunk, buffer.data(), bytes))
+                {
+                    std::cerr << "Failed to write " << header.path << ".\n";
+                }
+            }
+            written += bytes;
+            remaining -= bytes;
+        }
+        in.ignore(TarHeader::paddedSize(dataSize) - dataSize);
+        if (!in)
+        {
+            // Truncated in the middle of this file: its chain goes back
+            for (int block : blocks)
+            {
+                fat.freeBlock(block);
+            }
+            break;
+        }
+
+        if (!blocks.empty())
+        {
+            int attributes = 0x20 | ((header.mode & 0444) ? 0x01 : 0) | ((header.mode & 0222) ? 0x02 : 0);
+            DirectoryEntry newFile(storedName, blocks.front(), static_cast<uint32_t>(header.size), static_cast<char>(attributes));
+            newFile.updateModificationTime();
+            addDirectoryEntry(newFile, directories[parentPath]);
+            pendingEntries[directories[parentPath]->getFirstBlock()].push_back(newFile);
+            ++importedFiles;
+        }
+    }
+    if (!ended)
+    {
+        std::cerr << "Unexpected end of archive.\n";
+    }
+
+    // Each directory block receives its new entries in a single write; new directory pages start empty
+    for (const auto &page : pendingEntries)
+    {
+        appendDirectoryEntries(page.first, page.second, freshDirectoryBlocks.count(page.first) > 0);
+    }
+
+    std::cout << "Imported " << importedFiles << " files and " << freshDirectoryBlocks.size() << " directories.\n";
+}
+
+// Offline pass: shares identical blocks across every file in the image and turns dedupe mode on
+void FileSystem::deduplicate()
+{
+    std::unique_lock<std::shared_mutex> treeLock(treeMutex);
+    invalidateUsage();
+    DirectoryEntry *root = findDirectory("/");
+    if (!root)
+    {
+        std::cerr << "Root directory not found.\n";
+        return;
+    }
+
+    int freeBlocksBefore = 0;
+    for (int i = 0; i < fat.getTotalBlocks(); ++i)
+    {
+        freeBlocksBefore += fat.isBlockBusy(i) ? 0 : 1;
+    }
+
+    int processedFiles = 0;
+    std::vector<DirectoryEntry> pendingDirs(1, *root);
+    std::set<int> visitedBlocks;
+    std::vector<DirectoryEntry> page;
+    while (!pendingDirs.empty())
+    {
+        DirectoryEntry dir = pendingDirs.back();
+        pendingDirs.pop_back();
+        if (!visitedBlocks.insert(dir.getFirstBlock()).second)
+        {
+            continue;
+        }
+
+        const size_t firstChildSlot = dir.getFileName() == "/" ? 1 : 2;
+        size_t slot = 0;
+        for (int block : getChain(dir.getFirstBlock()))
+        {
+            if (!readDirectoryPage(block, page))
+            {
+                std::cerr << "Failed to open file system.\n";
+                return;
+            }
+
+            bool pageChanged = false;
+            for (DirectoryEntry &child : page)
+            {
+                if (slot++ < firstChildSlot || child.getFileName().empty() || child.getFirstBlock() == dir.getFirstBlock())
+                {
+                    continue;
+                }
+                if (child.getAttributes() & 0x10)
+                {
+                    pendingDirs.push_back(child);
+                    continue;
+                }
+
+                int oldFirstBlock = child.getFirstBlock();
+                int newFirstBlock = deduplicateChain(child);
+                ++processedFiles;
+                if (newFirstBlock == oldFirstBlock)
+                {
+                    continue;
+                }
+
+                for (auto &entry : directoryEntries)
+                {
+                    if (entry.getFirstBlock() == oldFirstBlock && entry.getFileName() == child.getFileName())
+                    {
+                        entry.setFirstBlock(newFirstBlock);
+                        break;
+                    }
+                }
+                child.setFirstBlock(newFirstBlock);
+                pageChanged = true;
+            }
+
+            if (pageChanged)
+            {
+                writeDirectoryPage(block, page);
+            }
         }
     }
+
+    features |= featureDedupe;
+
+    int freeBlocksAfter = 0;
+    for (int i = 0; i < fat.getTotalBlocks(); ++i)
+    {
+        freeBlocksAfter += fat.isBlockBusy(i) ? 0 : 1;
+    }
+    std::cout << "Deduplicated " << processedFiles << " files, freed " << freeBlocksAfter - freeBlocksBefore << " blocks.\n";
 }
 
-void FileSystem::changeMode(const std::string &fileName, const std::string &permissions)
+void FileSystem::setDedupe(bool enabled)
+{
+    std::unique_lock<std::shared_mutex> treeLock(treeMutex);
+    if (enabled)
+    {
+        features |= featureDedupe;
+    }
+    else
+    {
+        features &= ~featureDedupe;
+    }
+}
+
+// Queues freed blocks for the next save; nothing is recorded unless discard is on
+void FileSystem::discardLater(const std::vector<int> &blocks)
+{
+    if (features & featureDiscard)
+    {
+        std::lock_guard<std::mutex> lock(discardMutex);
+        pendingDiscard.insert(pendingDiscard.end(), blocks.begin(), blocks.end());
+    }
+}
+
+void FileSystem::setDiscard(bool enabled)
+{
+    std::unique_lock<std::shared_mutex> treeLock(treeMutex);
+    if (enabled)
+    {
+        features |= featureDiscard;
+    }
+    else
+    {
+        features &= ~featureDiscard;
+    }
+}
+
+// Punches every free block out of the image, including ones freed while discard was off
+void FileSystem::trim()
+{
+    std::unique_lock<std::shared_mutex> treeLock(treeMutex);
+    std::vector<int> freeBlocks;
+    for (int i = 0; i < fat.getTotalBlocks(); ++i)
+    {
+        if (!fat.isBlockBusy(i))
+        {
+            freeBlocks.push_back(i);
+        }
+    }
+    if (!device.discardBlocks(freeBlocks))
+    {
+        std::cerr << "Discard is not supported for this file system file.\n";
+        return;
+    }
+    std::cout << "Discarded " << freeBlocks.size() << " free blocks.\n";
+}
+
+// Reads every block except the superblock and returns its current CRC32C
+std::vector<uint32_t> FileSystem::buildChecksumTable() const
+{
+    const size_t blockSize = static_cast<size_t>(fat.getBlockSize());
+    std::vector<int> blocks;
+    for (int i = 1; i < fat.getTotalBlocks(); ++i)
+    {
+        blocks.push_back(i);
+    }
+    std::vector<char> data(blocks.size() * blockSize);
+    if (!device.readBlocks(blocks, data.data(), data.size()))
+    {
+        return std::vector<uint32_t>();
+    }
+
+    std::vector<uint32_t> checksums(fat.getTotalBlocks(), 0);
+    for (size_t i = 0; i < blocks.size(); ++i)
+    {
+        checksums[blocks[i]] = device.checksumBlock(data.data() + i * blockSize);
+    }
+    return checksums;
+}
+
+void FileSystem::setChecksums(bool enabled)
+{
+    std::unique_lock<std::shared_mutex> treeLock(treeMutex);
+    if (!enabled)
+    {
+        features &= ~featureChecksums;
+        device.setChecksums(std::vector<uint32_t>());
+        return;
+    }
+    if (features & featureChecksums)
+    {
+        return;
+    }
+
+    // Whatever the blocks hold now becomes the reference
+    std::vector<uint32_t> checksums = buildChecksumTable();
+    if (checksums.empty())
+    {
+        std::cerr << "Failed to open file system.\n";
+        return;
+    }
+    device.setChecksums(checksums);
+    features |= featureChecksums;
+}
+
+void FileSystem::setVerifyReads(bool enabled)
+{
+    std::unique_lock<std::shared_mutex> treeLock(treeMutex);
+    device.setVerifyReads(enabled);
+}
+
+void FileSystem::setSyncPolicy(SyncPolicy policy, unsigned int intervalMs)
+{
+    std::unique_lock<std::shared_mutex> treeLock(treeMutex);
+    stopFlusher();
+    syncPolicy = policy;
+    syncIntervalMs = std::max(1u, intervalMs);
+    if (policy == SyncPolicy::Periodic)
+    {
+        flusherStop = false;
+        flusher = std::thread(&FileSystem::runFlusher, this);
+    }
+}
+
+// Syncs every interval and once more on the way out, so stopping the flusher leaves nothing unsynced.
+// The data and metadata of one interval are not ordered against each other.
+void FileSystem::runFlusher()
+{
+    std::unique_lock<std::mutex> lock(flusherMutex);
+    bool stopping = false;
+    while (!stopping)
+    {
+        stopping = flusherWake.wait_for(lock, std::chrono::milliseconds(syncIntervalMs), [this]
+                                        { return flusherStop; });
+        lock.unlock();
+        if (!device.syncData() || !device.syncImage())
+        {
+            std::cerr << "Failed to sync file system.\n";
+        }
+        lock.lock();
+    }
+}
+
+void FileSystem::stopFlusher()
+{
+    if (!flusher.joinable())
+    {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(flusherMutex);
+        flusherStop = true;
+    }
+    flusherWake.notify_one();
+    flusher.join();
+}
+
+// Verifies every busy block against the checksum table, a batch per pool task
+void FileSystem::scrub()
+{
+    std::unique_lock<std::shared_mutex> treeLock(treeMutex);
+    if (!(features & featureChecksums))
+    {
+        std::cerr << "Checksums are off for this file system.\n";
+        return;
+    }
+
+    std::vector<int> blocks;
+    for (int i = 1; i < fat.getTotalBlocks(); ++i)
+    {
+        if (fat.isBlockBusy(i))
+        {
+            blocks.push_back(i);
+        }
+    }
+
+    std::mutex resultMutex;
+    std::vector<int> badBlocks;
+    std::atomic<bool> failed(false);
+    {
+        ThreadPool pool;
+        for (size_t start = 0; start < blocks.size(); start += scrubBatchBlocks)
+        {
+            std::vector<int> batch(blocks.begin() + start, blocks.begin() + std::min(blocks.size(), start + scrubBatchBlocks));
+            pool.submit([this, batch, &resultMutex, &badBlocks, &failed]()
+                        {
+                            std::vector<int> bad;
+                            if (!device.verifyBlocks(batch, bad))
+                            {
+                                failed = true;
+                            }
+                            std::lock_guard<std::mutex> lock(resultMutex);
+                            badBlocks.insert(badBlocks.end(), bad.begin(), bad.end());
+                        });
+        }
+        pool.wait();
+    }
+    if (failed)
+    {
+        std::cerr << "Failed to open file system.\n";
+        return;
+    }
+
+    std::sort(badBlocks.begin(), badBlocks.end());
+    for (int block : badBlocks)
+    {
+        std::cout << "Checksum mismatch in block " << block;
+        for (const auto &entry : directoryEntries)
+        {
+            std::vector<int> chain = getChain(entry);
+            if (std::find(chain.begin(), chain.end(), block) != chain.end())
+            {
+                std::cout << " (" << entry.getFileName() << ")";
+            }
+        }
+        std::cout << "\n";
+    }
+    std::cout << "Scrubbed " << blocks.size() << " blocks, " << badBlocks.size() << " checksum errors.\n";
+    std::cout << "Metadata checksum: "
+              << (metadataChecksum == MetadataChecksum::Valid ? "ok" : metadataChecksum == MetadataChecksum::Mismatch ? "mismatch" : "absent") << "\n";
+}
+
+// Grows or shrinks the data area in place. The metadata after it is written at the new end on the
+// next save; a shrink first moves every busy block out of the part being cut off.
+void FileSystem::resize(int blocks)
 {
-    std::string shortFileName = getDirectoryName(fileName);
+    std::unique_lock<std::shared_mutex> treeLock(treeMutex);
+    const int oldBlocks = fat.getTotalBlocks();
+    if (blocks < 2 || blocks > FAT12::maxTotalBlocks)
+    {
+        std::cerr << "Block count must be between 2 and " << FAT12::maxTotalBlocks << ".\n";
+        return;
+    }
+    if (blocks == oldBlocks)
+    {
+        std::cout << "File system already has " << blocks << " blocks.\n";
+        return;
+    }
+
+    const size_t blockSize = static_cast<size_t>(fat.getBlockSize());
+    std::vector<char> zeros(blockSize, 0);
+    std::vector<uint32_t> checksums = device.getChecksums();
+    if (blocks > oldBlocks)
+    {
+        fat.setTotalBlocks(blocks);
+        snapshotHolds.resize(blocks, 0);
+        for (Snapshot &snapshot : snapshots)
+        {
+            snapshot.fat.resize(blocks, FAT12::FATEntry{false, 0, 0, -1});
+        }
+        if (!checksums.empty())
+        {
+            checksums.resize(blocks, device.checksumBlock(zeros.data()));
+            device.setChecksums(checksums);
+        }
+
+        // The old metadata now lies in free blocks; clear it so they read back as zeros
+        std::error_code error;
+        uintmax_t fileSize = std::filesystem::file_size(fat.getFileName(), error);
+        std::vector<int> staleBlocks;
+        for (int block = oldBlocks; block < blocks && !error && static_cast<uintmax_t>(block) * blockSize < fileSize; ++block)
+        {
+            staleBlocks.push_back(block);
+        }
+        if (!device.discardBlocks(staleBlocks))
+        {
+            std::vector<char> fill(staleBlocks.size() * blockSize, 0);
+            if (!device.writeBlocks(staleBlocks, fill.data(), fill.size()))
+            {
+                std::cerr << "Failed to write filesystem file.\n";
+            }
+        }
+        std::cout << "Grew file system from " << oldBlocks << " to " << blocks << " blocks.\n";
+        return;
+    }
 
-    auto it = directoryEntries.begin();
+    if (!snapshots.empty())
+    {
+        std::cerr << "Delete all snapshots before shrinking.\n";
+        return;
+    }
+    if (!migrateTail(blocks))
+    {
+        return;
+    }
+    fat.setTotalBlocks(blocks);
+    snapshotHolds.resize(blocks);
+    if (!checksums.empty())
+    {
+        checksums = device.getChecksums();
+        checksums.resize(blocks);
+        device.setChecksums(checksums);
+    }
+    {
+        std::lock_guard<std::mutex> lock(discardMutex);
+        pendingDiscard.erase(std::remove_if(pendingDiscard.begin(), pendingDiscard.end(),
+                                            [blocks](int block)
+                                            { return block >= blocks; }),
+                             pendingDiscard.end());
+    }
+}
 
-    for (; it != directoryEntries.end(); ++it)
+// Copies every busy block at or past the new end into a free block below it, then repoints FAT
+// links, directory entries and directory page slots. Nothing changes if the copy fails.
+bool FileSystem::migrateTail(int blocks)
+{
+    // Directory blocks move, and usage is keyed by them
+    invalidateUsage();
+    const int oldBlocks = fat.getTotalBlocks();
+    const size_t blockSize = static_cast<size_t>(fat.getBlockSize());
+    std::vector<int> tail;
+    for (int block = blocks; block < oldBlocks; ++block)
+    {
+        if (fat.isBlockBusy(block))
+        {
+            tail.push_back(block);
+        }
+    }
+    std::vector<int> targets;
+    for (int block = 1; block < blocks && targets.size() < tail.size(); ++block)
     {
-        if (it->getFileName() == shortFileName)
+        if (!fat.isBlockBusy(block))
         {
-            break;
+            targets.push_back(block);
         }
     }
+    if (targets.size() < tail.size())
+    {
+        std::cerr << "Not enough free blocks to shrink: " << tail.size() << " blocks in use past block " << blocks
+                  << ", " << targets.size() << " free below it.\n";
+        return false;
+    }
 
-    if (it == directoryEntries.end())
+    std::vector<char> buffer;
+    for (size_t start = 0; start < tail.size(); start += resizeBatchBlocks)
     {
-        std::cerr << "File not found.\n";
-        return;
+        size_t end = std::min(tail.size(), start + resizeBatchBlocks);
+        std::vector<int> from(tail.begin() + start, tail.begin() + end);
+        std::vector<int> to(targets.begin() + start, targets.begin() + end);
+        buffer.resize(from.size() * blockSize);
+        if (!device.readBlocks(from, buffer.data(), buffer.size()) || !device.writeBlocks(to, buffer.data(), buffer.size()))
+        {
+            std::cerr << "Failed to move blocks out of the tail.\n";
+            return false;
+        }
     }
 
-    char newAttributes = it->getAttributes();
-    if (permissions == "+rw")
+    std::vector<int> remap(oldBlocks);
+    for (int block = 0; block < oldBlocks; ++block)
     {
-        newAttributes |= 0x03; // Add read and write permissions
+        remap[block] = block;
     }
-    else if (permissions == "+r")
+    for (size_t i = 0; i < tail.size(); ++i)
     {
-        newAttributes |= 0x01; // Add read permission
+        fat.relocateBlock(tail[i], targets[i]);
+        remap[tail[i]] = targets[i];
     }
-    else if (permissions == "+w")
+    for (int block = 0; block < blocks; ++block)
     {
-        newAttributes |= 0x02; // Add write permission
+        int next = fat.getNextBlock(block);
+        if (fat.isBlockBusy(block) && next >= blocks && next < oldBlocks)
+        {
+            fat.setNextBlock(block, remap[next]);
+        }
     }
-    else if (permissions == "-rw")
+
+    // Directory chains are walked after relinking, so their pages are read from where they now live
+    auto moved = [&](DirectoryEntry &entry)
     {
-        newAttributes &= ~0x03; // Remove read and write permissions
+        int first = entry.getFirstBlock();
+        if (first >= blocks && first < oldBlocks)
+        {
+            entry.setFirstBlock(remap[first]);
+            return true;
+        }
+        return false;
+    };
+    for (DirectoryEntry &entry : directoryEntries)
+    {
+        moved(entry);
     }
-    else if (permissions == "-r")
+    std::vector<DirectoryEntry> page;
+    for (const DirectoryEntry &entry : directoryEntries)
     {
-        newAttributes &= ~0x01; // Remove read permission
+        if (!(entry.getAttributes() & 0x10))
+        {
+            continue;
+        }
+        for (int block : getChain(entry.getFirstBlock()))
+        {
+            if (!readDirectoryPage(block, page))
+            {
+                std::cerr << "Failed to read filesystem file.\n";
+                continue;
+            }
+            // Inline data slots are skipped: their bytes are file content, not links
+            bool changed = false;
+            for (size_t i = 0; i < page.size(); i += 1 + inlineSlots(page[i]))
+            {
+                changed |= moved(page[i]);
+            }
+            if (changed && !writeDirectoryPage(block, page))
+            {
+                std::cerr << "Failed to write filesystem file.\n";
+            }
+        }
     }
-    else if (permissions == "-w")
+
+    // Fingerprints include the links that were just replaced
+    if (!tail.empty())
     {
-        newAttributes &= ~0x02; // Remove write permission
+        dedupe.clear();
     }
+    std::cout << "Shrank file system from " << oldBlocks << " to " << blocks << " blocks, moved " << tail.size() << " blocks.\n";
+    return true;
+}
 
-    // Retrieve the content of the file
-    int block = it->getFirstBlock();
-    std::string content;
-    while (block != -1)
+// Moves the data blocks into member files, unitBlocks at a time in turn, so one chain's I/O is spread
+// over all of them. The image file keeps the superblock and metadata. Members are created or emptied.
+void FileSystem::stripe(const std::vector<std::string> &members, int unitBlocks)
+{
+    std::unique_lock<std::shared_mutex> treeLock(treeMutex);
+    if (members.empty() || unitBlocks < 1)
     {
-        std::ifstream file(fat.getFileName(), std::ios::binary);
-        if (!file.is_open())
+        std::cerr << "A striped volume needs at least one member and a stripe unit of one block or more.\n";
+        return;
+    }
+    std::vector<std::string> paths;
+    std::error_code error;
+    for (const std::string &member : members)
+    {
+        std::string path = std::filesystem::absolute(member, error).string();
+        if (error || std::filesystem::equivalent(path, fat.getFileName(), error) ||
+            std::find(paths.begin(), paths.end(), path) != paths.end())
         {
-            std::cerr << "Failed to open filesystem file.\n";
+            std::cerr << "Invalid stripe member " << member << ".\n";
             return;
         }
-
-        file.seekg(block * static_cast<int>(fat.getBlockSize()), std::ios::beg);
-        std::vector<char> buffer(static_cast<int>(fat.getBlockSize()));
-        file.read(buffer.data(), buffer.size());
-        content.append(buffer.data(), file.gcount());
-        block = fat.getNextBlock(block);
+        paths.push_back(path);
     }
 
-    // Determine the actual size by ignoring trailing null characters
-    std::string trimmedContent;
-    for (char c : content)
+    // Busy blocks are read through the old layout and written through the new one
+    const size_t blockSize = static_cast<size_t>(fat.getBlockSize());
+    std::vector<int> blocks;
+    for (int block = 1; block < fat.getTotalBlocks(); ++block)
     {
-        if (c == '\0')
+        if (fat.isBlockBusy(block))
         {
-            break;
+            blocks.push_back(block);
         }
-        trimmedContent += c;
     }
+    std::vector<char> data(blocks.size() * blockSize);
+    if (!blocks.empty() && !device.readBlocks(blocks, data.data(), data.size()))
+    {
+        std::cerr << "Failed to read filesystem file.\n";
+        return;
+    }
+    for (const std::string &path : paths)
+    {
+        std::ofstream member(path, std::ios::binary | std::ios::out | std::ios::trunc);
+        if (!member.is_open())
+        {
+            std::cerr << "Failed to create stripe member " << path << ".\n";
+            return;
+        }
+    }
+    device.setStripes(paths, unitBlocks);
+    if (!blocks.empty() && !device.writeBlocks(blocks, data.data(), data.size()))
+    {
+        std::cerr << "Failed to write filesystem file.\n";
+        return;
+    }
+    std::cout << "Striped " << blocks.size() << " blocks over " << paths.size() << " files, "
+              << unitBlocks << " blocks per unit.\n";
+}
 
-    // Delete the original file
-    deleteFile(fileName);
-
-    // Create a new file with the same content and password
-    writeFileWithAttribute(fileName, trimmedContent, newAttributes);
-    std::cout << "Permissions changed.\n";
+void FileSystem::appendFile(const std::string &fileName, const std::string &content)
+{
+    updateFile(fileName, content, 0, std::string::npos, true);
 }
 
-std::string FileSystem::getAttributesString(char attributes) const
+void FileSystem::writeFileAt(const std::string &fileName, size_t offset, const std::string &content)
 {
-    std::string result = "--"; // Initialize with no permissions
-    if (attributes & 0x01)
-        result[0] = 'r'; // Read permission
-    if (attributes & 0x02)
-        result[1] = 'w'; // Write permission
-    return result;
+    updateFile(fileName, content, offset, std::string::npos, false);
 }
 
-void FileSystem::addPassword(const std::string &fileName, const std::string &password)
+void FileSystem::truncateFile(const std::string &fileName, size_t size)
 {
-    std::string shortFileName = getDirectoryName(fileName);
+    updateFile(fileName, std::string(), 0, size, false);
+}
 
-    auto it = directoryEntries.begin();
+// Writes data at offset (at the end when appending) and sets the size; npos keeps the larger of the
+// current size and the end of the write. The entry is updated in place in memory and on its page.
+void FileSystem::updateFile(const std::string &fileName, const std::string &data, size_t offset, size_t newSize, bool append)
+{
+    std::shared_lock<std::shared_mutex> treeLock(treeMutex);
+    std::string_view shortFileName = getDirectoryName(fileName);
 
-    for (; it != directoryEntries.end(); ++it)
+    DirectoryEntry *parentDir = findDirectory(getParentDirectoryName(fileName));
+    if (!parentDir)
     {
-        if (it->getFileName() == shortFileName)
-        {
-            break;
-        }
+        std::cerr << "Parent directory not found.\n";
+        return;
     }
+    std::unique_lock<std::shared_mutex> dirLock(directoryLock(parentDir->getFirstBlock()));
 
-    if (it == directoryEntries.end())
+    DirectoryEntry *entry = findChildEntry(parentDir, shortFileName);
+    if (!entry || (entry->getAttributes() & 0x10))
     {
         std::cerr << "File not found.\n";
         return;
     }
+    if (!(entry->getAttributes() & 0x02)) // Check if the file has write permission
+    {
+        std::cerr << "Write permission denied.\n";
+        return;
+    }
 
-    // Retrieve the content of the file
-    int block = it->getFirstBlock();
-    std::string content;
-    while (block != -1)
+    if (append)
+    {
+        offset = entry->getSize();
+    }
+    if (newSize == std::string::npos)
+    {
+        newSize = data.empty() ? entry->getSize() : std::max<size_t>(entry->getSize(), offset + data.size());
+    }
+    if (offset > UINT32_MAX || newSize > UINT32_MAX || data.size() > UINT32_MAX - offset)
+    {
+        std::cerr << "File size limit exceeded.\n";
+        return;
+    }
+
+    DirectoryEntry updated = *entry;
+    Usage before = entryUsage(updated);
+    if (updated.getAttributes() & 0x08)
     {
-        std::ifstream file(fat.getFileName(), std::ios::binary);
-        if (!file.is_open())
+        // Inline files are edited in memory and stay on their page while the slots after them have
+        // room; otherwise the content moves to a chain
+        std::string content;
+        if (!readInline(updated, content))
         {
-            std::cerr << "Failed to open filesystem file.\n";
+            std::cerr << "Failed to read filesystem file.\n";
             return;
         }
-
-        file.seekg(block * static_cast<int>(fat.getBlockSize()), std::ios::beg);
-        std::vector<char> buffer(static_cast<int>(fat.getBlockSize()));
-        file.read(buffer.data(), buffer.size());
-        content.append(buffer.data(), file.gcount());
-        block = fat.getNextBlock(block);
+        content.resize(std::max(content.size(), offset + data.size()), '\0');
+        content.replace(offset, data.size(), data);
+        content.resize(newSize, '\0');
+        updated.setSize(static_cast<uint32_t>(newSize));
+        updated.updateModificationTime();
+        if (newSize > inlineMaxBytes || !updateDirectoryEntryInPage(parentDir->getFirstBlock(), shortFileName, updated, &content))
+        {
+            int block = writeChain(content);
+            if (block == -1)
+            {
+                std::cerr << "No space left to extend file.\n";
+                return;
+            }
+            updated.setFirstBlock(block);
+            updated.setAttributes(updated.getAttributes() & ~0x08);
+            updateDirectoryEntryInPage(parentDir->getFirstBlock(), shortFileName, updated);
+        }
     }
-
-    // Determine the actual size by ignoring trailing null characters
-    std::string trimmedContent;
-    for (char c : content)
+    else
     {
-        if (c == '\0')
+        if (!modifyChain(updated, data, offset, newSize))
         {
-            break;
+            std::cerr << "No space left to extend file.\n";
+            return;
         }
-        trimmedContent += c;
+        updated.setSize(static_cast<uint32_t>(newSize));
+        updated.updateModificationTime();
+        updateDirectoryEntryInPage(parentDir->getFirstBlock(), shortFileName, updated);
+    }
+    {
+        // Lookups in every directory read this entry's name key under the shared lock
+        std::unique_lock<std::shared_mutex> entriesLock(entriesMutex);
+        *entry = updated;
     }
 
-    // Delete the original file
-    deleteFile(fileName);
-
-    // Create a new file with the same content and password
-    writeFileWithPassword(fileName, trimmedContent, password);
-
-    std::cout << "Password added.\n";
+    Usage change = entryUsage(updated);
+    change.bytes -= before.bytes;
+    change.blocks -= before.blocks;
+    change.files = 0;
+    chargeUsage(parentDir->getFirstBlock(), change);
 }
 
-void FileSystem::dumpe2fs()
+// Changes a file's chain for a write and/or resize, touching only the blocks involved: untouched
+// blocks keep their data and links, partial edge blocks are read-modify-written, and blocks shared
+// with clones or deduplicated files are copied before they change. Compressed files are rewritten.
+bool FileSystem::modifyChain(DirectoryEntry &entry, const std::string &data, size_t offset, size_t newSize)
 {
-    int freeBlocks = 0;
-    int occupiedBlocks = 0;
-    int numberOfFiles = 0;
-    int numberOfDirectories = 0;
+    const size_t blockSize = static_cast<size_t>(fat.getBlockSize());
+    std::vector<int> chain = getChain(entry.getFirstBlock());
 
-    for (int i = 0; i < fat.getTotalBlocks(); ++i)
+    if (entry.getAttributes() & 0x04)
     {
-        if (!fat.isBlockBusy(i))
+        std::string content;
+        readChain(entry, content);
+        content.resize(std::max(content.size(), offset + data.size()), '\0');
+        content.replace(offset, data.size(), data);
+        content.resize(newSize, '\0');
+        int block = writeChain(content, true);
+        if (block == -1)
         {
-            ++freeBlocks;
+            return false;
         }
-        else
+        std::vector<int> freedBlocks;
+        for (int oldBlock : chain)
         {
-            ++occupiedBlocks;
+            if (dedupe.release(oldBlock))
+            {
+                freedBlocks.push_back(oldBlock);
+            }
         }
+        discardLater(freedBlocks);
+        entry.setFirstBlock(block);
+        return true;
     }
 
-    for (const auto &entry : directoryEntries)
+    // Logical block index -> block, -1 for holes. Sharing between live files is inherited along a
+    // chain, so every block from the first such block onwards keeps its links. Blocks held only by
+    // snapshots may be relinked, since each snapshot has its own FAT copy, but never overwritten.
+    std::vector<int> original;
+    size_t sharedFrom = std::string::npos;
+    for (int block : chain)
     {
-        if ((entry.getAttributes() & 0x10))
+        if (sharedFrom == std::string::npos && liveRefCount(block) > 1)
         {
-            ++numberOfDirectories;
-        }
-        else
-        {
-            ++numberOfFiles;
+            sharedFrom = original.size();
         }
+        original.push_back(block);
+        original.insert(original.end(), fat.getHoleBlocks(block), -1);
     }
 
-    std::cout << "Filesystem Summary:\n";
-    std::cout << "Block count: " << fat.getTotalBlocks() << "\n";
-    std::cout << "Block size: " << fat.getBlockSize() << " bytes\n";
-    std::cout << "Free blocks: " << freeBlocks << "\n";
-    std::cout << "Occupied blocks: " << occupiedBlocks << "\n";
-    std::cout << "Number of files: " << numberOfFiles << "\n";
-    std::cout << "Number of directories: " << numberOfDirectories << "\n";
-    std::cout << "Occupied blocks and file names:\n";
+    size_t blockCount = std::max<size_t>(1, (newSize + blockSize - 1) / blockSize);
+    std::vector<int> mapping = original;
+    mapping.resize(blockCount, -1);
+    original.resize(std::max(original.size(), blockCount), -1);
 
-    for (const auto &entry : directoryEntries)
+    // Blocks whose bytes change: the ones under the write, plus the new last block when shrinking
+    // so that bytes past the end stay zero
+    std::vector<bool> dirty(blockCount, false);
+    if (!data.empty())
     {
-        if ((entry.getAttributes() & 0x10) == 0x10)
-        {
-            std::cout << "Directory: " << entry.getFileName() << " at block " << entry.getFirstBlock()
-                          << ", Size: " << entry.getSize()
-                          << ", First Block: " << entry.getFirstBlock()
-                          << ", Attributes: " << getAttributesString(entry.getAttributes())
-                          << ", Password: " << (entry.getPassword().empty() ? "No" : entry.getPassword())
-                          << ", Last Modified: " << entry.getFormattedDate() << " " << entry.getFormattedTime()
-                          << "\n";
-            
-        }
-        else
+        for (size_t i = offset / blockSize; i <= (offset + data.size() - 1) / blockSize && i < blockCount; ++i)
         {
-            std::cout << "File: " << entry.getFileName() << " at blocks: "  << entry.getFirstBlock()
-                          << ", Size: " << entry.getSize()
-                          << ", First Block: " << entry.getFirstBlock()
-                          << ", Attributes: " << getAttributesString(entry.getAttributes())
-                          << ", Password: " << (entry.getPassword().empty() ? "No" : entry.getPassword())
-                          << ", Last Modified: " << entry.getFormattedDate() << " " << entry.getFormattedTime()
-                          << "\n";
-            int block = entry.getFirstBlock();
-            while (block != -1)
-            {
-                block = fat.getNextBlock(block);
-            }
+            dirty[i] = true;
         }
     }
-}
-
-bool FileSystem::filesystemExists(const std::string &fileName)
-{
-    std::ifstream file(fileName, std::ios::binary);
-    return file.good();
-}
+    size_t lastBlock = newSize == 0 ? 0 : (newSize - 1) / blockSize;
+    if (newSize < entry.getSize() && newSize - lastBlock * blockSize < blockSize && mapping[lastBlock] != -1)
+    {
+        dirty[lastBlock] = true;
+    }
 
-void FileSystem::loadDirectoryEntries()
-{
-    std::ifstream file(fat.getFileName(), std::ios::binary);
-    if (!file.is_open())
+    // Holes longer than a FAT entry can count get a stored zero block
+    size_t holeRun = 0;
+    for (size_t i = 0; i < blockCount; ++i)
     {
-        std::cerr << "Failed to open file system.\n";
-        return;
+        holeRun = (mapping[i] == -1 && !dirty[i]) ? holeRun + 1 : 0;
+        if (holeRun > static_cast<size_t>(FAT12::maxHoleBlocks))
+        {
+            dirty[i] = true;
+            holeRun = 0;
+        }
     }
 
-    directoryEntries.clear();
-    for (int i = 0; i < fat.getTotalBlocks(); ++i)
+    // Walk backwards deciding which blocks are rewritten in place, newly allocated or copied,
+    // and what each block's next link and hole count must become
+    std::vector<int> allocated;
+    std::vector<bool> fresh(blockCount, false);
+    std::vector<std::pair<int, std::pair<int, int>>> links;
+    int nextBlock = -1;
+    int holeBlocks = 0;
+    for (size_t i = blockCount; i-- > 0;)
     {
-        if (fat.isBlockBusy(i))
+        if (mapping[i] == -1 && !dirty[i])
+        {
+            ++holeBlocks;
+            continue;
+        }
+
+        bool shared = mapping[i] != -1 && i >= sharedFrom;
+        bool frozen = mapping[i] != -1 && dirty[i] && fat.getRefCount(mapping[i]) > 1;
+        bool linkChanged = mapping[i] == -1 || fat.getNextBlock(mapping[i]) != nextBlock || fat.getHoleBlocks(mapping[i]) != holeBlocks;
+        if (mapping[i] == -1 || frozen || (shared && (dirty[i] || linkChanged)))
         {
-            file.seekg(i * fat.getBlockSize(), std::ios::beg);
-            while (file.tellg() < (i + 1) * fat.getBlockSize())
+            int block = fat.allocateBlock();
+            if (block == -1)
             {
-                DirectoryEntry entry;
-                file.read(reinterpret_cast<char *>(&entry), sizeof(entry));
-                if (std::strlen(entry.getFileName().c_str()) > 0)
+                for (int allocatedBlock : allocated)
                 {
-                    directoryEntries.push_back(entry);
+                    fat.freeBlock(allocatedBlock);
                 }
+                return false;
             }
+            allocated.push_back(block);
+            fresh[i] = true;
+            dirty[i] = true;
+            mapping[i] = block;
+            linkChanged = true;
         }
+        if (linkChanged)
+        {
+            links.push_back(std::make_pair(mapping[i], std::make_pair(nextBlock, holeBlocks)));
+        }
+        if ((dirty[i] || linkChanged) && !fresh[i])
+        {
+            // The block changes in place, so its fingerprint no longer describes it
+            dedupe.forget(mapping[i]);
+        }
+        nextBlock = mapping[i];
+        holeBlocks = 0;
     }
 
-    file.close();
-}
-
-void FileSystem::writeDirectoryEntryToPage(int block, const DirectoryEntry &dirEntry)
-{
-    std::fstream file(fat.getFileName(), std::ios::in | std::ios::out | std::ios::binary);
-    if (!file.is_open())
-    {
-        std::cerr << "Failed to open file system.\n";
-        return;
-    }
-
-    file.seekp(block * fat.getBlockSize(), std::ios::beg);
-
-    // Iterate over the block and find the first empty entry
-    bool entryWritten = false;
-    for (size_t i = 0; i < fat.getBlockSize() / sizeof(DirectoryEntry); ++i)
+    // Read the old contents only where some bytes of a dirty block survive
+    std::vector<size_t> dirtyIndexes;
+    std::vector<int> oldBlocks;
+    std::vector<size_t> oldIndexes;
+    for (size_t i = 0; i < blockCount; ++i)
     {
-        DirectoryEntry tempEntry;
-        file.read(reinterpret_cast<char *>(&tempEntry), sizeof(DirectoryEntry));
-        if (tempEntry.getFileName()[0] == '\0')
+        if (!dirty[i])
         {
-            file.seekp(block * fat.getBlockSize() + i * sizeof(DirectoryEntry), std::ios::beg);
-            file.write(reinterpret_cast<const char *>(&dirEntry), sizeof(DirectoryEntry));
-            entryWritten = true;
-            break;
+            continue;
+        }
+        size_t blockStart = i * blockSize;
+        size_t keepEnd = std::min(blockStart + blockSize, newSize);
+        bool covered = !data.empty() && offset <= blockStart && offset + data.size() >= keepEnd;
+        if (original[i] != -1 && keepEnd > blockStart && !covered)
+        {
+            oldIndexes.push_back(dirtyIndexes.size());
+            oldBlocks.push_back(original[i]);
         }
+        dirtyIndexes.push_back(i);
     }
 
-    if (!entryWritten)
+    std::string staging(dirtyIndexes.size() * blockSize, '\0');
+    if (!oldBlocks.empty())
     {
-        std::cerr << "No space left in directory block to write new entry.\n";
+        std::string oldData(oldBlocks.size() * blockSize, '\0');
+        if (!device.readBlocks(oldBlocks, &oldData[0], oldData.size()))
+        {
+            std::cerr << "Failed to read filesystem file.\n";
+        }
+        for (size_t i = 0; i < oldIndexes.size(); ++i)
+        {
+            staging.replace(oldIndexes[i] * blockSize, blockSize, oldData, i * blockSize, blockSize);
+        }
     }
 
-    file.close();
-}
-
-std::string FileSystem::getParentDirectoryName(const std::string &path)
-{
-    std::vector<std::string> parts;
-    std::stringstream ss(path);
-    std::string item;
-
-    while (std::getline(ss, item, '/'))
+    std::vector<int> targets;
+    for (size_t i = 0; i < dirtyIndexes.size(); ++i)
     {
-        if (!item.empty())
+        size_t blockStart = dirtyIndexes[i] * blockSize;
+        char *blockData = &staging[i * blockSize];
+        if (!data.empty() && offset < blockStart + blockSize && offset + data.size() > blockStart)
+        {
+            size_t from = std::max(offset, blockStart);
+            size_t to = std::min(offset + data.size(), blockStart + blockSize);
+            std::memcpy(blockData + (from - blockStart), data.data() + (from - offset), to - from);
+        }
+        if (newSize < blockStart + blockSize)
         {
-            parts.push_back(item);
+            size_t keep = newSize > blockStart ? newSize - blockStart : 0;
+            std::memset(blockData + keep, 0, blockSize - keep);
         }
+        targets.push_back(mapping[dirtyIndexes[i]]);
     }
-
-    if (parts.size() < 2)
+    if (!device.writeBlocks(targets, staging.data(), staging.size()))
     {
-        return "/"; // No parent directory exists
+        std::cerr << "Failed to write filesystem file.\n";
     }
 
-    return parts[parts.size() - 2];
-}
-std::vector<std::string> FileSystem::splitPath(const std::string &path)
-{
-    std::vector<std::string> parts;
-    std::stringstream ss(path);
-    std::string item;
-
-    while (std::getline(ss, item, '/'))
+    // Data is in place; now relink and drop the references this file no longer holds
+    for (const auto &link : links)
+    {
+        fat.setNextBlock(link.first, link.second.first);
+        fat.setHoleBlocks(link.first, link.second.second);
+    }
+    std::vector<int> freedBlocks;
+    for (size_t i = 0; i < original.size(); ++i)
     {
-        if (!item.empty())
+        if (original[i] != -1 && (i >= blockCount || mapping[i] != original[i]) && dedupe.release(original[i]))
         {
-            parts.push_back(item);
+            freedBlocks.push_back(original[i]);
         }
     }
-    return parts;
+    discardLater(freedBlocks);
+
+    entry.setFirstBlock(mapping[0]);
+    return true;
 }
-DirectoryEntry *FileSystem::findDirectoryEntry(const std::string &path)
+
+// Rewrites one entry of a directory in place; only the page holding it is written. An inline entry
+// brings its data, which must fit in the slots after it; otherwise nothing is written.
+bool FileSystem::updateDirectoryEntryInPage(int dirBlock, std::string_view name, const DirectoryEntry &entry, const std::string *inlineData)
 {
-    for (auto &entry : directoryEntries)
+    uint64_t key;
+    if (!DirectoryEntry::makeNameKey(name, key))
     {
-        if (entry.getFileName() == path)
+        std::cerr << "File not found in parent directory.\n";
+        return false;
+    }
+    std::vector<DirectoryEntry> page;
+    for (int block : getChain(dirBlock))
+    {
+        if (!readDirectoryPage(block, page))
         {
-            return &entry;
+            std::cerr << "Failed to open file system.\n";
+            return false;
+        }
+        for (size_t i = 0; i < page.size(); ++i)
+        {
+            if (page[i].getNameKey() != key || (page[i].getFirstBlock() == dirBlock && !(page[i].getAttributes() & 0x08)))
+            {
+                i += inlineSlots(page[i]);
+                continue;
+            }
+            clearInlineData(page, i);
+            page[i] = entry;
+            if (entry.getAttributes() & 0x08)
+            {
+                if (!inlineData || !slotsFree(page, i + 1, inlineDataSlots(inlineData->size())))
+                {
+                    return false;
+                }
+                storeInlineData(page, i, *inlineData);
+            }
+            return writeDirectoryPage(block, page);
         }
     }
-    return nullptr;
+    std::cerr << "File not found in parent directory.\n";
+    return false;
 }
 
-DirectoryEntry *FileSystem::findDirectoryEntryByBlock(int block)
+// Removes a file or a whole subtree. The subtree is walked once; only the parent's page holding the
+// removed entry is written, and every chain is released in the FAT without touching its blocks.
+void FileSystem::removeTree(const std::string &path)
 {
-    for (auto &entry : directoryEntries)
+    std::unique_lock<std::shared_mutex> treeLock(treeMutex);
+    std::string_view name = getDirectoryName(path);
+
+    DirectoryEntry *parentDir = findDirectory(getParentDirectoryName(path));
+    DirectoryEntry *target = parentDir ? findChildEntry(parentDir, name) : nullptr;
+    if (!parentDir || !target)
     {
-        if (entry.getFirstBlock() == block)
-        {
-            return &entry;
-        }
+        std::cerr << "File not found.\n";
+        return;
+    }
+    if (!(parentDir->getAttributes() & 0x02))
+    {
+        std::cerr << "Write permission denied.\n";
+        return;
     }
-    return nullptr;
-}
-
-std::string FileSystem::getDirectoryName(const std::string &path)
-{
-    std::vector<std::string> parts;
-    std::stringstream ss(path);
-    std::string item;
 
-    while (std::getline(ss, item, '/'))
+    Usage removedUsage = entryUsage(*target);
+    std::vector<DirectoryEntry> removed(1, *target);
+    std::set<int> visitedDirs;
+    for (size_t i = 0; i < removed.size(); ++i)
     {
-        if (!item.empty())
+        if ((removed[i].getAttributes() & 0x10) && visitedDirs.insert(removed[i].getFirstBlock()).second)
         {
-            parts.push_back(item);
+            std::vector<DirectoryEntry> children = readDirectoryChildren(removed[i]);
+            removed.insert(removed.end(), children.begin(), children.end());
         }
     }
 
-    if (parts.empty())
+    if (!updateDirectoryEntryInPage(parentDir->getFirstBlock(), name, DirectoryEntry()))
     {
-        return ""; // No directory exists
+        return;
     }
-
-    return parts.back();
-}
-void FileSystem::printBlockContents() const
-{
-    std::ifstream file(fat.getFileName(), std::ios::binary);
-    if (!file.is_open())
+    chargeUsage(parentDir->getFirstBlock(), removedUsage, -1);
+    for (int block : visitedDirs)
     {
-        std::cerr << "Failed to open file system.\n";
-        return;
+        removeDirectoryUsage(block);
     }
 
-    std::cout << "Block Contents:\n";
-    for (int i = 1; i < fat.getTotalBlocks(); ++i)
+    std::vector<int> freedBlocks;
+    for (const DirectoryEntry &entry : removed)
     {
-        if (fat.isBlockBusy(i))
+        for (int block : getChain(entry))
         {
-            std::cout << "Block " << i << ":\n";
-            file.seekg(i * static_cast<int>(fat.getBlockSize()), std::ios::beg);
-            std::vector<char> buffer(static_cast<int>(fat.getBlockSize()));
-            file.read(buffer.data(), buffer.size());
-
-            // Print the content of the block as is
-            for (char c : buffer)
+            if (dedupe.release(block))
             {
-                std::cout << c;
+                freedBlocks.push_back(block);
             }
-            std::cout << "\n";
         }
     }
+    discardLater(freedBlocks);
 
-    file.close();
+    // The same subtree once more through the entry links, children before the directory holding them
+    std::unique_lock<std::shared_mutex> entriesLock(entriesMutex);
+    std::vector<DirectoryEntry *> erased(1, target);
+    for (size_t i = 0; i < erased.size(); ++i)
+    {
+        for (auto child = childEntries.lower_bound(std::make_pair(erased[i], uint64_t(0)));
+             child != childEntries.end() && child->first.first == erased[i]; ++child)
+        {
+            erased.push_back(child->second);
+        }
+    }
+    for (auto entry = erased.rbegin(); entry != erased.rend(); ++entry)
+    {
+        eraseDirectoryEntryUnlocked(*entry);
+    }
+    std::cout << "Removed " << removed.size() << " entries.\n";
 }
 
-void FileSystem::writeFileToFile(const std::string &fileName, const std::string &targetFile)
+// Copies a file or a whole subtree. All blocks for the copy are allocated in one call, so the copy
+// either fits completely or nothing changes. Stored chains are copied block for block (keeping
+// compression and holes) and the new directory pages go out in the same submission; in dedupe mode
+// file data is shared instead of copied.
+void FileSystem::copyTree(const std::string &source, const std::string &target)
 {
-    std::string parentName = getParentDirectoryName(fileName);
-    std::string shortFileName = getDirectoryName(fileName);
-    std::string targetShortFileName = getDirectoryName(targetFile);
-
-    // Find the source file entry
-    auto sourceIt = std::find_if(directoryEntries.begin(), directoryEntries.end(),
-                                 [&](const DirectoryEntry &entry)
-                                 { return entry.getFileName() == targetShortFileName; });
-
-    if (sourceIt == directoryEntries.end())
+    std::unique_lock<std::shared_mutex> treeLock(treeMutex);
+    const size_t blockSize = static_cast<size_t>(fat.getBlockSize());
+    const size_t entriesPerPage = blockSize / sizeof(DirectoryEntry);
+    std::string_view sourceName = getDirectoryName(source);
+    std::string_view targetName = getDirectoryName(target);
+
+    DirectoryEntry *sourceEntry = sourceName.empty() ? nullptr : findDirectoryEntry(source);
+    DirectoryEntry *parentDir = findDirectory(getParentDirectoryName(target));
+    if (!sourceEntry)
     {
         std::cerr << "Source file not found.\n";
         return;
     }
-
-    // If the file exists, check write permission
-    if (!(sourceIt->getAttributes() & 0x02)) // Check if the file has write permission
+    if (!parentDir)
+    {
+        std::cerr << "Parent directory not found.\n";
+        return;
+    }
+    if (!(parentDir->getAttributes() & 0x02))
     {
         std::cerr << "Write permission denied.\n";
         return;
     }
+    if (targetName.empty() || findChildEntry(parentDir, targetName))
+    {
+        std::cerr << "File already exists.\n";
+        return;
+    }
 
-    // Read the content from the source file
-    int sourceBlock = sourceIt->getFirstBlock();
-    std::string content;
-    while (sourceBlock != -1)
+    // Plan every copy: its source, the new entry, its parent in the plan and the blocks it needs
+    struct CopyNode
     {
-        std::ifstream file(fat.getFileName(), std::ios::binary);
-        if (!file.is_open())
+        DirectoryEntry source;
+        DirectoryEntry copy;
+        size_t parent;
+        std::vector<int> sourceChain;
+        std::vector<size_t> children;
+        size_t firstNewBlock;
+        size_t blockCount;
+        // Slot in the parent's new pages, and the data of an inline file
+        size_t pageSlot;
+        std::string inlineData;
+    };
+    const bool shareData = features & featureDedupe;
+    std::vector<CopyNode> nodes(1);
+    nodes[0].source = *sourceEntry;
+    nodes[0].parent = 0;
+    std::set<int> visitedDirs;
+    std::map<int, int> plannedShares;
+    size_t totalBlocks = 0;
+    for (size_t i = 0; i < nodes.size(); ++i)
+    {
+        nodes[i].copy = nodes[i].source;
+        nodes[i].sourceChain = getChain(nodes[i].source);
+        if ((nodes[i].source.getAttributes() & 0x08) && !readInline(nodes[i].source, nodes[i].inlineData))
         {
-            std::cerr << "Failed to open filesystem file.\n";
+            std::cerr << "Failed to read filesystem file.\n";
             return;
         }
-
-        file.seekg(sourceBlock * static_cast<int>(fat.getBlockSize()), std::ios::beg);
-        std::vector<char> buffer(static_cast<int>(fat.getBlockSize()));
-        file.read(buffer.data(), buffer.size());
-        content.append(buffer.data(), file.gcount());
-        sourceBlock = fat.getNextBlock(sourceBlock);
-    }
-
-    // Determine the actual size by ignoring trailing null characters
-    std::string trimmedContent;
-    for (char c : content)
-    {
-        if (c == '\0')
+        if (nodes[i].source.getAttributes() & 0x10)
         {
-            break;
+            std::vector<DirectoryEntry> children;
+            if (visitedDirs.insert(nodes[i].source.getFirstBlock()).second)
+            {
+                children = readDirectoryChildren(nodes[i].source);
+            }
+            // An inline file's entry and data slots stay on one page
+            size_t slot = 2;
+            for (const DirectoryEntry &child : children)
+            {
+                size_t span = 1 + inlineSlots(child);
+                if (slot % entriesPerPage + span > entriesPerPage)
+                {
+                    slot += entriesPerPage - slot % entriesPerPage;
+                }
+                nodes[i].children.push_back(nodes.size());
+                CopyNode node;
+                node.source = child;
+                node.parent = i;
+                node.pageSlot = slot;
+                nodes.push_back(node);
+                slot += span;
+            }
+            nodes[i].blockCount = (slot + entriesPerPage - 1) / entriesPerPage;
+        }
+        else
+        {
+            // A file whose chain has a block at the reference limit is copied even in dedupe mode
+            bool share = shareData;
+            for (size_t j = 0; share && j < nodes[i].sourceChain.size(); ++j)
+            {
+                int block = nodes[i].sourceChain[j];
+                share = fat.getRefCount(block) + plannedShares[block] <= UINT16_MAX;
+            }
+            for (size_t j = 0; share && j < nodes[i].sourceChain.size(); ++j)
+            {
+                ++plannedShares[nodes[i].sourceChain[j]];
+            }
+            nodes[i].blockCount = share ? 0 : nodes[i].sourceChain.size();
         }
-        trimmedContent += c;
+        nodes[i].firstNewBlock = totalBlocks;
+        totalBlocks += nodes[i].blockCount;
     }
 
-    size_t fileSize = trimmedContent.size();
-
-    // Check if the new file already exists
-    auto targetIt = std::find_if(directoryEntries.begin(), directoryEntries.end(),
-                                 [&](const DirectoryEntry &entry)
-                                 { return entry.getFileName() == shortFileName; });
-
-    if (targetIt != directoryEntries.end())
+    std::vector<int> blocks = fat.allocateChain(static_cast<int>(totalBlocks));
+    if (blocks.empty() && totalBlocks > 0)
     {
-        std::cerr << "File already exists.\n";
+        std::cerr << "No space left to copy " << source << ".\n";
         return;
     }
 
-    // Create a new file with the content
-    int block = fat.allocateBlock();
-    if (block == -1)
+    // Split the allocation into per-entry chains
+    nodes[0].copy.setFileName(targetName);
+    std::vector<int> sourceBlocks;
+    std::vector<int> copiedBlocks;
+    for (CopyNode &node : nodes)
     {
-        std::cerr << "No space left to allocate new file.\n";
-        return;
+        bool isDirectory = node.source.getAttributes() & 0x10;
+        for (size_t j = 0; j < node.blockCount; ++j)
+        {
+            int block = blocks[node.firstNewBlock + j];
+            fat.setNextBlock(block, j + 1 < node.blockCount ? blocks[node.firstNewBlock + j + 1] : -1);
+            if (!isDirectory)
+            {
+                fat.setHoleBlocks(block, fat.getHoleBlocks(node.sourceChain[j]));
+                sourceBlocks.push_back(node.sourceChain[j]);
+                copiedBlocks.push_back(block);
+            }
+        }
+        if (node.blockCount > 0)
+        {
+            node.copy.setFirstBlock(blocks[node.firstNewBlock]);
+        }
+        else if ((node.source.getAttributes() & 0x08) && &node != &nodes[0])
+        {
+            const CopyNode &parent = nodes[node.parent];
+            node.copy.setFirstBlock(blocks[parent.firstNewBlock + node.pageSlot / entriesPerPage]);
+        }
+        else
+        {
+            // Cannot fail: the counts were checked while planning, under the exclusive tree lock
+            shareChain(node.sourceChain);
+        }
+        node.copy.updateModificationTime();
     }
 
-    DirectoryEntry newFile(shortFileName, block, fileSize, 0x23); // Set as file
-    newFile.updateModificationTime();
-    directoryEntries.push_back(newFile);
-
-    // Write the new file entry to the parent directory's block
-    writeDirectoryEntryToPage(findDirectoryEntry(parentName)->getFirstBlock(), newFile);
-
-    // Write the content to the allocated blocks
-    size_t contentIndex = 0;
-    int currentBlock = block;
-    while (contentIndex < fileSize)
+    // File data followed by every new directory page, written in one submission
+    std::string buffer(sourceBlocks.size() * blockSize, '\0');
+    if (!sourceBlocks.empty() && !device.readBlocks(sourceBlocks, &buffer[0], buffer.size()))
+    {
+        std::cerr << "Failed to read filesystem file.\n";
+    }
+    for (const CopyNode &node : nodes)
     {
-        std::ofstream file(fat.getFileName(), std::ios::binary | std::ios::in | std::ios::out);
-        if (!file.is_open())
+        if (!(node.source.getAttributes() & 0x10))
         {
-            std::cerr << "Failed to open filesystem file.\n";
-            return;
+            continue;
         }
-
-        file.seekp(currentBlock * fat.getBlockSize(), std::ios::beg);
-        size_t bytesToWrite = std::min(static_cast<size_t>(fat.getBlockSize()), fileSize - contentIndex);
-        file.write(trimmedContent.data() + contentIndex, bytesToWrite);
-        contentIndex += bytesToWrite;
-        file.close();
-
-        if (contentIndex < fileSize)
+        std::vector<DirectoryEntry> pages(node.blockCount * entriesPerPage);
+        pages[0] = node.copy;
+        pages[1] = &node == &nodes[0] ? *parentDir : nodes[node.parent].copy;
+        for (size_t child : node.children)
         {
-            int nextBlock = fat.allocateBlock();
-            if (nextBlock == -1)
-            {
-                std::cerr << "No space left to allocate new block.\n";
-                return;
-            }
-
-            fat.setNextBlock(currentBlock, nextBlock);
-            currentBlock = nextBlock;
+            pages[nodes[child].pageSlot] = nodes[child].copy;
+            storeInlineData(pages, nodes[child].pageSlot, nodes[child].inlineData);
         }
-        else
+        buffer.append(reinterpret_cast<const char *>(pages.data()), node.blockCount * blockSize);
+        for (size_t j = 0; j < node.blockCount; ++j)
         {
-            fat.setNextBlock(currentBlock, -1);
+            copiedBlocks.push_back(blocks[node.firstNewBlock + j]);
         }
     }
+    if (!device.writeBlocks(copiedBlocks, buffer.data(), buffer.size()))
+    {
+        std::cerr << "Failed to write filesystem file.\n";
+    }
 
-    // Update the file size in the directory entry
-    newFile.setSize(fileSize);
-    newFile.updateModificationTime();
-}
-
-void FileSystem::saveFileSystem() const
-{
-    std::ofstream file(fat.getFileName(), std::ios::binary | std::ios::out | std::ios::in);
-    if (!file.is_open())
+    if (!(nodes[0].source.getAttributes() & 0x08))
     {
-        std::cerr << "Failed to open file system for saving.\n";
+        appendDirectoryEntries(parentDir->getFirstBlock(), {nodes[0].copy});
+    }
+    else if (!storeFile(parentDir->getFirstBlock(), nodes[0].copy, nodes[0].inlineData))
+    {
+        std::cerr << "No space left to copy " << source << ".\n";
         return;
     }
+    size_t copiedDirectories = 0;
+    std::vector<DirectoryEntry *> copies;
+    for (const CopyNode &node : nodes)
+    {
+        copies.push_back(addDirectoryEntry(node.copy, &node == &nodes[0] ? parentDir : copies[node.parent]));
+        copiedDirectories += (node.source.getAttributes() & 0x10) ? 1 : 0;
 
-    // Save the block size at the beginning of the file
-    double blockSize = fat.getBlockSize();
-    file.write(reinterpret_cast<const char *>(&blockSize), sizeof(blockSize));
+        // Parents come before their children in the plan, so each one is known when charged
+        int parentBlock = &node == &nodes[0] ? parentDir->getFirstBlock() : nodes[node.parent].copy.getFirstBlock();
+        if (node.source.getAttributes() & 0x10)
+        {
+            addDirectoryUsage(node.copy.getFirstBlock(), parentBlock);
+        }
+        chargeUsage(parentBlock, entryUsage(node.copy));
+    }
+    std::cout << "Copied " << nodes.size() - copiedDirectories << " files and " << copiedDirectories << " directories.\n";
+}
 
-    // Seek to the end of 4096 blocks
-    file.seekp(fat.totalBlocks * blockSize, std::ios::beg);
+// References held by live files and directories, leaving out the ones held by snapshots
+int FileSystem::liveRefCount(int block) const
+{
+    return fat.getRefCount(block) - snapshotHolds[block];
+}
 
-    // Save FAT entries
-    for (int i = 0; i < fat.totalBlocks; ++i)
+std::vector<FileSystem::Snapshot>::iterator FileSystem::findSnapshot(const std::string &name)
+{
+    return std::find_if(snapshots.begin(), snapshots.end(),
+                        [&](const Snapshot &snapshot)
+                        { return snapshot.name == name; });
+}
+
+// Copies only metadata: the FAT, the directory list and the directory pages. Data blocks are kept by
+// taking a reference on every busy block.
+void FileSystem::createSnapshot(const std::string &name)
+{
+    std::unique_lock<std::shared_mutex> treeLock(treeMutex);
+    if (name.empty())
     {
-        file.write(reinterpret_cast<const char *>(&fat.FAT[i]), sizeof(FAT12::FATEntry));
+        std::cerr << "Snapshot name is empty.\n";
+        return;
     }
-
-    // Save directory entries
-    uint32_t entryCount = directoryEntries.size();
-    file.write(reinterpret_cast<const char *>(&entryCount), sizeof(entryCount));
-    for (const auto &entry : directoryEntries)
+    if (findSnapshot(name) != snapshots.end())
     {
-        file.write(reinterpret_cast<const char *>(&entry), sizeof(entry));
+        std::cerr << "Snapshot " << name << " already exists.\n";
+        return;
     }
-    file.close();
-}
 
-void FileSystem::loadFileSystem(const std::string &fileName)
-{
-    std::ifstream file(fileName, std::ios::binary | std::ios::in);
-    if (!file.is_open())
+    Snapshot snapshot;
+    snapshot.name = name;
+    snapshot.createdAt = static_cast<int64_t>(std::time(nullptr));
+    snapshot.fat.assign(fat.FAT.begin(), fat.FAT.end());
+    snapshot.entries.assign(directoryEntries.begin(), directoryEntries.end());
+    for (const DirectoryEntry &entry : directoryEntries)
     {
-        std::cerr << "Failed to open file system for loading.\n";
+        if (entry.getAttributes() & 0x10)
+        {
+            std::vector<int> chain = getChain(entry.getFirstBlock());
+            snapshot.pageBlocks.insert(snapshot.pageBlocks.end(), chain.begin(), chain.end());
+        }
+    }
+    snapshot.pages.resize(snapshot.pageBlocks.size() * static_cast<size_t>(fat.getBlockSize()));
+    if (!snapshot.pageBlocks.empty() && !device.readBlocks(snapshot.pageBlocks, &snapshot.pages[0], snapshot.pages.size()))
+    {
+        std::cerr << "Failed to read filesystem file.\n";
         return;
     }
 
-    // Read the block size from the beginning of the file
-    double blockSize;
-    file.read(reinterpret_cast<char *>(&blockSize), sizeof(blockSize));
-    fat.setBlockSize(blockSize);
-
-    // Seek to the end of 4096 blocks
-    file.seekg(fat.totalBlocks * blockSize, std::ios::beg);
-
-    // Load FAT entries
-    for (int i = 0; i < fat.totalBlocks; ++i)
+    std::vector<int> heldBlocks;
+    for (int block = 1; block < fat.totalBlocks; ++block)
     {
-        file.read(reinterpret_cast<char *>(&fat.FAT[i]), sizeof(FAT12::FATEntry));
+        if (snapshot.fat[block].isBusy)
+        {
+            heldBlocks.push_back(block);
+        }
     }
-
-    // Load directory entries
-    directoryEntries.clear();
-    uint32_t entryCount;
-    file.read(reinterpret_cast<char *>(&entryCount), sizeof(entryCount));
-
-    if (entryCount > fat.totalBlocks)
+    bool holdsFit = std::all_of(heldBlocks.begin(), heldBlocks.end(), [&](int block)
+                                { return snapshotHolds[block] < UINT16_MAX; });
+    if (!holdsFit || !shareChain(heldBlocks))
     {
-        std::cerr << "Error: Entry count exceeds expected number.\n";
+        std::cerr << "Cannot create snapshot " << name << ": a block has too many references.\n";
         return;
     }
-
-    for (uint32_t i = 0; i < entryCount; ++i)
+    for (int block : heldBlocks)
     {
-        DirectoryEntry entry;
-        file.read(reinterpret_cast<char *>(&entry), sizeof(entry));
-        directoryEntries.push_back(entry);
+        ++snapshotHolds[block];
     }
-
-    file.close();
+    snapshots.push_back(std::move(snapshot));
+    std::cout << "Created snapshot " << name << " holding " << heldBlocks.size() << " blocks.\n";
 }
 
-void FileSystem::writeFileWithPassword(const std::string &fileName, const std::string &content, std::string password)
+void FileSystem::listSnapshots() const
 {
-    std::string parentName = getParentDirectoryName(fileName);
-    std::string shortFileName = getDirectoryName(fileName);
-
-    auto it = std::find_if(directoryEntries.begin(), directoryEntries.end(),
-                           [&](const DirectoryEntry &entry)
-                           { return entry.getFileName() == parentName && ((entry.getAttributes() & 0x10) || (entry.getAttributes() & 0x11) || (entry.getAttributes() & 0x12) || (entry.getAttributes() & 0x13)); });
-
-    if (it == directoryEntries.end())
+    std::shared_lock<std::shared_mutex> treeLock(treeMutex);
+    if (snapshots.empty())
     {
-        std::cerr << "Parent directory not found.\n";
+        std::cout << "No snapshots.\n";
         return;
     }
-
-    DirectoryEntry *parentDir = &(*it);
-
-    // Check if the file already exists
-    if (fileExistinDirectoryEntry(parentDir, shortFileName))
+    for (const Snapshot &snapshot : snapshots)
     {
-        std::cerr << "File already exists.\n";
-        return;
+        int files = 0;
+        int directories = 0;
+        for (const DirectoryEntry &entry : snapshot.entries)
+        {
+            ++((entry.getAttributes() & 0x10) ? directories : files);
+        }
+        // Blocks nothing else references: what deleting the snapshot gives back
+        int exclusiveBlocks = 0;
+        for (int block = 1; block < fat.totalBlocks; ++block)
+        {
+            if (snapshot.fat[block].isBusy && fat.getRefCount(block) == 1)
+            {
+                ++exclusiveBlocks;
+            }
+        }
+        std::time_t createdAt = static_cast<std::time_t>(snapshot.createdAt);
+        std::cout << "Snapshot: " << snapshot.name
+                  << ", Created: " << std::put_time(std::localtime(&createdAt), "%Y-%m-%d %H:%M:%S")
+                  << ", Files: " << files
+                  << ", Directories: " << directories
+                  << ", Exclusive blocks: " << exclusiveBlocks << "\n";
     }
+}
 
-    int block = fat.allocateBlock();
-    if (block == -1)
+void FileSystem::deleteSnapshot(const std::string &name)
+{
+    std::unique_lock<std::shared_mutex> treeLock(treeMutex);
+    auto snapshot = findSnapshot(name);
+    if (snapshot == snapshots.end())
     {
-        std::cerr << "No space left to allocate new file.\n";
+        std::cerr << "Snapshot not found.\n";
         return;
     }
 
-    DirectoryEntry newFile(shortFileName, block, content.size(), 0x23); // Set as file
-    newFile.setPassword(password);
-    newFile.updateModificationTime();
-    directoryEntries.push_back(newFile);
+    std::vector<int> freedBlocks;
+    for (int block = 1; block < fat.totalBlocks; ++block)
+    {
+        if (snapshot->fat[block].isBusy)
+        {
+            --snapshotHolds[block];
+            if (dedupe.release(block))
+            {
+                freedBlocks.push_back(block);
+            }
+        }
+    }
+    discardLater(freedBlocks);
+    snapshots.erase(snapshot);
+    std::cout << "Deleted snapshot " << name << ", freed " << freedBlocks.size() << " blocks.\n";
+}
 
-    // Write the new file entry to the parent directory's block
-    writeDirectoryEntryToPage(parentDir->getFirstBlock(), newFile);
+// Rolls the live tree back to a snapshot, which is kept. The live tree's references are dropped,
+// the snapshot's links are put back and its directory pages rewritten.
+void FileSystem::restoreSnapshot(const std::string &name)
+{
+    std::unique_lock<std::shared_mutex> treeLock(treeMutex);
+    invalidateUsage();
+    auto snapshot = findSnapshot(name);
+    if (snapshot == snapshots.end())
+    {
+        std::cerr << "Snapshot not found.\n";
+        return;
+    }
 
-    // Write the content to the allocated blocks
-    std::string::size_type contentIndex = 0;
-    int currentBlock = block;
-    while (contentIndex < content.size())
+    // Once the live references are dropped a block is owned by the snapshots' holds alone; refuse the
+    // restore before changing anything if the restored references would not fit on top of them
+    std::vector<int> restoredRefs(fat.totalBlocks, 0);
+    for (const DirectoryEntry &entry : snapshot->entries)
+    {
+        int length = 0;
+        for (int block = (entry.getAttributes() & 0x08) ? -1 : entry.getFirstBlock(); block >= 0 && block < fat.totalBlocks && length < fat.totalBlocks; block = snapshot->fat[block].nextBlock, ++length)
+        {
+            ++restoredRefs[block];
+        }
+    }
+    for (int block = 1; block < fat.totalBlocks; ++block)
     {
-        std::ofstream file(fat.getFileName(), std::ios::binary | std::ios::in | std::ios::out);
-        if (!file.is_open())
+        if (snapshotHolds[block] + restoredRefs[block] > UINT16_MAX + 1)
         {
-            std::cerr << "Failed to open filesystem file.\n";
+            std::cerr << "Cannot restore snapshot " << name << ": block " << block << " would have too many references.\n";
             return;
         }
+    }
 
-        file.seekp(currentBlock * fat.getBlockSize(), std::ios::beg);
-        std::string::size_type bytesToWrite = std::min(static_cast<std::string::size_type>(fat.getBlockSize()), content.size() - contentIndex);
-        file.write(content.c_str() + contentIndex, bytesToWrite);
-        contentIndex += bytesToWrite;
-        file.close();
-
-        if (contentIndex < content.size())
+    std::vector<int> freedBlocks;
+    for (int block = 1; block < fat.totalBlocks; ++block)
+    {
+        for (int references = liveRefCount(block); references > 0; --references)
         {
-            int nextBlock = fat.allocateBlock();
-            if (nextBlock == -1)
+            if (fat.releaseBlock(block))
             {
-                std::cerr << "No space left to allocate new block.\n";
-                return;
+                freedBlocks.push_back(block);
             }
-
-            fat.setNextBlock(currentBlock, nextBlock);
-            currentBlock = nextBlock;
         }
-        else
+    }
+    for (int block = 1; block < fat.totalBlocks; ++block)
+    {
+        if (snapshot->fat[block].isBusy)
         {
-            fat.setNextBlock(currentBlock, -1);
+            fat.setNextBlock(block, snapshot->fat[block].nextBlock);
+            fat.setHoleBlocks(block, snapshot->fat[block].holeBlocks);
         }
     }
+
+    // Every restored file and directory takes a reference on its chain again
+    {
+        std::unique_lock<std::shared_mutex> entriesLock(entriesMutex);
+        directoryEntries.assign(snapshot->entries.begin(), snapshot->entries.end());
+    }
+    for (const DirectoryEntry &entry : snapshot->entries)
+    {
+        // Fits: checked before the live references were dropped
+        shareChain(getChain(entry));
+    }
+    if (!snapshot->pageBlocks.empty() && !device.writeBlocks(snapshot->pageBlocks, snapshot->pages.data(), snapshot->pages.size()))
+    {
+        std::cerr << "Failed to write filesystem file.\n";
+    }
+    rebuildEntryIndex();
+
+    // Fingerprints include the links that were just replaced
+    dedupe.clear();
+    discardLater(freedBlocks);
+    std::cout << "Restored snapshot " << name << ", freed " << freedBlocks.size() << " blocks.\n";
 }
 
-void FileSystem::printBits(unsigned char byte)
+// Name, creation time, FAT, directory entries, then the directory page blocks and their bytes
+void FileSystem::saveSnapshot(std::ostream &out, const Snapshot &snapshot) const
 {
-    std::bitset<8> bits(byte);
-    std::cout << bits << std::endl;
+    uint32_t nameLength = snapshot.name.size();
+    uint32_t entryCount = snapshot.entries.size();
+    uint32_t pageCount = snapshot.pageBlocks.size();
+    out.write(reinterpret_cast<const char *>(&nameLength), sizeof(nameLength));
+    out.write(snapshot.name.data(), nameLength);
+    out.write(reinterpret_cast<const char *>(&snapshot.createdAt), sizeof(snapshot.createdAt));
+    out.write(reinterpret_cast<const char *>(snapshot.fat.data()), snapshot.fat.size() * sizeof(FAT12::FATEntry));
+    out.write(reinterpret_cast<const char *>(&entryCount), sizeof(entryCount));
+    out.write(reinterpret_cast<const char *>(snapshot.entries.data()), entryCount * sizeof(DirectoryEntry));
+    out.write(reinterpret_cast<const char *>(&pageCount), sizeof(pageCount));
+    out.write(reinterpret_cast<const char *>(snapshot.pageBlocks.data()), pageCount * sizeof(int));
+    out.write(snapshot.pages.data(), snapshot.pages.size());
 }
 
-void FileSystem::writeFileWithAttribute(const std::string &fileName, const std::string &content, char attributeNew)
+bool FileSystem::loadSnapshot(std::istream &in, uint32_t length)
 {
-    std::string parentName = getParentDirectoryName(fileName);
-    std::string shortFileName = getDirectoryName(fileName);
-
-    auto it = std::find_if(directoryEntries.begin(), directoryEntries.end(),
-                           [&](const DirectoryEntry &entry)
-                           { return entry.getFileName() == parentName && (entry.getAttributes() & 0x10); });
-
-    if (it == directoryEntries.end())
+    std::string payload(length, '\0');
+    if (!in.read(&payload[0], length))
     {
-        std::cerr << "Parent directory not found.\n";
-        return;
+        return false;
     }
-
-    DirectoryEntry *parentDir = &(*it);
-
-    // Check if the file already exists
-    if (fileExistinDirectoryEntry(parentDir, shortFileName))
+    std::istringstream section(payload);
+
+    Snapshot snapshot;
+    uint32_t nameLength = 0;
+    uint32_t entryCount = 0;
+    uint32_t pageCount = 0;
+    section.read(reinterpret_cast<char *>(&nameLength), sizeof(nameLength));
+    if (nameLength > length)
     {
-        std::cerr << "File already exists.\n";
-        return;
+        return false;
     }
-
-    int block = fat.allocateBlock();
-    if (block == -1)
+    snapshot.name.resize(nameLength);
+    section.read(&snapshot.name[0], nameLength);
+    section.read(reinterpret_cast<char *>(&snapshot.createdAt), sizeof(snapshot.createdAt));
+    snapshot.fat.resize(fat.totalBlocks);
+    section.read(reinterpret_cast<char *>(snapshot.fat.data()), snapshot.fat.size() * sizeof(FAT12::FATEntry));
+    section.read(reinterpret_cast<char *>(&entryCount), sizeof(entryCount));
+    std::streamoff entriesOffset = section.tellg();
+    if (entriesOffset < 0 || entryCount > (payload.size() - static_cast<size_t>(entriesOffset)) / sizeof(DirectoryEntry))
     {
-        std::cerr << "No space left to allocate new file.\n";
-        return;
+        return false;
     }
-
-    DirectoryEntry newFile(shortFileName, block, content.size(), attributeNew); // Set as file
-    newFile.updateModificationTime();
-    directoryEntries.push_back(newFile);
-
-    // Write the new file entry to the parent directory's block
-    writeDirectoryEntryToPage(parentDir->getFirstBlock(), newFile);
-
-    // Write the content to the allocated blocks
-    std::string::size_type contentIndex = 0;
-    int currentBlock = block;
-    while (contentIndex < content.size())
+    snapshot.entries.resize(entryCount);
+    section.read(reinterpret_cast<char *>(snapshot.entries.data()), entryCount * sizeof(DirectoryEntry));
+    section.read(reinterpret_cast<char *>(&pageCount), sizeof(pageCount));
+    if (pageCount > static_cast<uint32_t>(fat.totalBlocks))
     {
-        std::ofstream file(fat.getFileName(), std::ios::binary | std::ios::in | std::ios::out);
-        if (!file.is_open())
-        {
-            std::cerr << "Failed to open filesystem file.\n";
-            return;
-        }
-
-        file.seekp(currentBlock * fat.getBlockSize(), std::ios::beg);
-        std::string::size_type bytesToWrite = std::min(static_cast<std::string::size_type>(fat.getBlockSize()), content.size() - contentIndex);
-        file.write(content.c_str() + contentIndex, bytesToWrite);
-        contentIndex += bytesToWrite;
-        file.close();
-
-        if (contentIndex < content.size())
-        {
-            int nextBlock = fat.allocateBlock();
-            if (nextBlock == -1)
-            {
-                std::cerr << "No space left to allocate new block.\n";
-                return;
-            }
+        return false;
+    }
+    snapshot.pageBlocks.resize(pageCount);
+    section.read(reinterpret_cast<char *>(snapshot.pageBlocks.data()), pageCount * sizeof(int));
+    snapshot.pages.resize(pageCount * static_cast<size_t>(fat.getBlockSize()));
+    section.read(&snapshot.pages[0], snapshot.pages.size());
+    if (!section)
+    {
+        return false;
+    }
 
-            fat.setNextBlock(currentBlock, nextBlock);
-            currentBlock = nextBlock;
-        }
-        else
+    for (int block = 1; block < fat.totalBlocks; ++block)
+    {
+        if (snapshot.fat[block].isBusy)
         {
-            fat.setNextBlock(currentBlock, -1);
+            ++snapshotHolds[block];
         }
     }
-}
\ No newline at end of file
+    snapshots.push_back(std::move(snapshot));
+    return true;
+}
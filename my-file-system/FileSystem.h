@@ -2,14 +2,71 @@
 #define FILESYSTEM_H
 
 #include "FAT12.h"
+#include "BlockDevice.h"
+#include "DedupeIndex.h"
 #include "DirectoryEntry.h"
+#include <condition_variable>
+#include <cstdint>
+#include <ctime>
+#include <functional>
+#include <iostream>
 #include <string>
+#include <string_view>
 #include <vector>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <thread>
+#include <unordered_map>
 
 class FileSystem
 {
 public:
-    FileSystem(double blockSizeKB, const std::string &fileName);
+    enum class ListSort
+    {
+        None,
+        Name,
+        Size,
+        ModificationTime
+    };
+
+    // Listing options: output format, ordering and an offset/limit window over the sorted entries
+    struct ListOptions
+    {
+        bool json = false;
+        ListSort sort = ListSort::None;
+        size_t offset = 0;
+        size_t limit = SIZE_MAX;
+    };
+
+    // find tests, all of which must hold. Size is compared in whole units, rounded up; a compare
+    // of '+' means more than, '-' less than and '=' exactly. Permission letters are r, w and c:
+    // '=' needs exactly those, '-' at least all of them and '/' any of them.
+    struct FindOptions
+    {
+        std::string name;
+        char type = 0;
+        char sizeCompare = 0;
+        uint64_t size = 0;
+        uint64_t sizeUnit = 512;
+        std::string newer;
+        char permCompare = 0;
+        char permissions = 0;
+    };
+
+    // When written blocks and metadata reach the disk. None leaves it to the page cache, Commit syncs
+    // the data and then the metadata on every save, and Periodic syncs both from a background thread.
+    enum class SyncPolicy
+    {
+        None,
+        Commit,
+        Periodic
+    };
+
+    FileSystem(double blockSizeKB, const std::string &fileName, unsigned int ioQueueDepth = 32);
+    ~FileSystem();
 
     bool filesystemExists(const std::string &fileName) const;
     void listDirectory() const;
@@ -18,23 +75,176 @@ public:
     void removeDirectory(const std::string &dirName);
     void writeFile(const std::string &fileName, const std::string &content);
     void listDirectory(const std::string &path) const;
+    void listDirectory(const std::string &path, const ListOptions &options) const;
     void readFile(const std::string &fileName, std::string &content);
     void readFile(const std::string &fileName, const std::string &outputFile, const std::string &password = "");
     void deleteFile(const std::string &fileName);
     void changeMode(const std::string &fileName, const std::string &permissions);
     void addPassword(const std::string &fileName, const std::string &password);
     void dumpe2fs();
+    void statfs();
+    void diskUsage(const std::string &path);
+    void find(const std::string &path, const FindOptions &options);
+    void grep(const std::string &pattern, const std::string &path);
     void printDirectoryPages();
     void printBlockContents() const;
     void saveFileSystem() const;
     void loadFileSystem(const std::string &fileName);
-    void writeFileToFile(const std::string &fileName, const std::string &linuxFileName);
+    void writeFileToFile(const std::string &fileName, const std::string &linuxFileName, bool clone = false);
+    void importDirectory(const std::string &hostDir, const std::string &imageDir);
+    void exportDirectory(const std::string &imageDir, const std::string &hostDir, bool honourPermissions = false, const std::string &password = "");
+    void tarOut(const std::string &imageDir, std::ostream &out);
+    void tarIn(const std::string &imageDir, std::istream &in);
+    void deduplicate();
+    void setDedupe(bool enabled);
+    void setDiscard(bool enabled);
+    void appendFile(const std::string &fileName, const std::string &content);
+    void writeFileAt(const std::string &fileName, size_t offset, const std::string &content);
+    void truncateFile(const std::string &fileName, size_t size);
+    void removeTree(const std::string &path);
+    void copyTree(const std::string &source, const std::string &target);
+    void trim();
+    void setChecksums(bool enabled);
+    void setVerifyReads(bool enabled);
+    void setSyncPolicy(SyncPolicy policy, unsigned int intervalMs = 1000);
+    void scrub();
+    void resize(int blocks);
+    void stripe(const std::vector<std::string> &members, int unitBlocks);
+    void createSnapshot(const std::string &name);
+    void listSnapshots() const;
+    void deleteSnapshot(const std::string &name);
+    void restoreSnapshot(const std::string &name);
 
 private:
+    // A frozen copy of the FAT, the directory list and every directory page. The snapshot holds one
+    // reference on each block that was busy, so data blocks are copied on write by the live tree;
+    // directory pages are rewritten in place, which is why their bytes are kept here.
+    struct Snapshot
+    {
+        std::string name;
+        int64_t createdAt;
+        std::vector<FAT12::FATEntry> fat;
+        std::vector<DirectoryEntry> entries;
+        std::vector<int> pageBlocks;
+        std::string pages;
+    };
+
+    // Totals over a directory's whole subtree; blocks are the stored data blocks of its files
+    struct Usage
+    {
+        int64_t bytes = 0;
+        int64_t blocks = 0;
+        int64_t files = 0;
+        int64_t directories = 0;
+    };
+
+    struct DirectoryUsage
+    {
+        int parent;
+        Usage total;
+    };
+
+    enum class MetadataChecksum
+    {
+        Absent,
+        Valid,
+        Mismatch
+    };
+
     FAT12 fat;
-    std::vector<DirectoryEntry> directoryEntries;
+    mutable BlockDevice device;
+    DedupeIndex dedupe;
+    uint32_t features;
+    MetadataChecksum metadataChecksum;
+    std::vector<Snapshot> snapshots;
+    // Number of snapshots holding each block
+    std::vector<uint16_t> snapshotHolds;
+    // Blocks freed since the last save, punched out of the image at save when discard is on
+    mutable std::vector<int> pendingDiscard;
+    mutable std::mutex discardMutex;
+    // std::list keeps DirectoryEntry pointers valid across insertions and erasures
+    std::list<DirectoryEntry> directoryEntries;
+    // Each entry is linked under its parent directory, so a path resolves one component at a time and
+    // equal names in different directories never meet. Guarded by entriesMutex along with the list.
+    struct EntryLink
+    {
+        const DirectoryEntry *parent;
+        std::list<DirectoryEntry>::iterator position;
+    };
+    std::map<std::pair<const DirectoryEntry *, uint64_t>, DirectoryEntry *> childEntries;
+    std::unordered_map<const DirectoryEntry *, EntryLink> entryLinks;
+    DirectoryEntry *rootEntry;
+    // Keyed by each directory's first block and saved with the metadata. Creates, resizes and deletes
+    // charge their change to the parent and every directory above it, so statfs and du answer without
+    // walking the tree; bulk operations drop the table and the next save or query rebuilds it.
+    mutable std::map<int, DirectoryUsage> directoryUsage;
+    mutable int rootDirectoryBlock;
+    mutable bool usageValid;
+    mutable std::mutex usageMutex;
+    SyncPolicy syncPolicy;
+    unsigned int syncIntervalMs;
+    std::thread flusher;
+    std::mutex flusherMutex;
+    std::condition_variable flusherWake;
+    bool flusherStop;
+
+    // Lock order: treeMutex -> directory lock -> entriesMutex -> FAT allocator. An operation that needs two
+    // directories takes both through lockDirectoryPair, which uses std::lock rather than a fixed order
+    mutable std::shared_mutex treeMutex;
+    mutable std::shared_mutex entriesMutex;
+    mutable std::mutex directoryLocksMutex;
+    mutable std::map<int, std::unique_ptr<std::shared_mutex>> directoryLocks;
+
+    std::shared_mutex &directoryLock(int block) const;
+    DirectoryEntry *findDirectory(std::string_view path) const;
+    DirectoryEntry *addDirectoryEntry(const DirectoryEntry &entry, const DirectoryEntry *parent);
+    DirectoryEntry *findChildEntry(const DirectoryEntry *parent, std::string_view name);
+    // Callers hold entriesMutex: shared to look up, exclusive to erase
+    DirectoryEntry *findChildEntryUnlocked(const DirectoryEntry *parent, std::string_view name) const;
+    void eraseDirectoryEntryUnlocked(DirectoryEntry *entry);
+    void rebuildEntryIndex();
+    void deleteFileUnlocked(const std::string &fileName);
+    void writeFileToFileUnlocked(const std::string &fileName, const std::string &targetFile, bool clone = false);
+    void readChain(const DirectoryEntry &entry, std::string &content) const;
+    bool readChainData(const std::vector<int> &blocks, std::string &data, size_t length) const;
+    bool streamChain(const DirectoryEntry &entry, std::ostream &out, std::vector<char> &buffer) const;
+    bool searchChain(const DirectoryEntry &entry, std::string_view pattern, std::vector<char> &buffer,
+                     const std::function<void(uint64_t)> &found) const;
+    void discardLater(const std::vector<int> &blocks);
+    void updateFile(const std::string &fileName, const std::string &data, size_t offset, size_t newSize, bool append);
+    bool modifyChain(DirectoryEntry &entry, const std::string &data, size_t offset, size_t newSize);
+    bool updateDirectoryEntryInPage(int dirBlock, std::string_view name, const DirectoryEntry &entry, const std::string *inlineData = nullptr);
+    std::vector<int> getChain(int firstBlock) const;
+    std::vector<int> getChain(const DirectoryEntry &entry) const;
+    bool shareChain(const std::vector<int> &chain);
+    // Files of up to inlineMaxBytes (attribute 0x08) keep their data in the slots after their entry on
+    // the parent's page, and their first block is that page
+    bool storeFile(int directoryBlock, DirectoryEntry &entry, const std::string &content);
+    bool writeInlineEntry(int directoryBlock, DirectoryEntry &entry, const std::string &content);
+    bool readInline(const DirectoryEntry &entry, std::string &content) const;
+    int writeChain(const std::string &content, bool compressed = false);
+    int writeDedupedChain(const std::string &content);
+    int deduplicateChain(const DirectoryEntry &entry);
+    bool readDirectoryPage(int block, std::vector<DirectoryEntry> &page) const;
+    bool writeDirectoryPage(int block, const std::vector<DirectoryEntry> &page);
+    std::vector<DirectoryEntry> readDirectoryChildren(const DirectoryEntry &dir) const;
+    std::vector<uint32_t> buildChecksumTable() const;
+    bool migrateTail(int blocks);
+    Usage entryUsage(const DirectoryEntry &entry) const;
+    void chargeUsage(int directoryBlock, const Usage &usage, int sign = 1);
+    void addDirectoryUsage(int directoryBlock, int parentBlock);
+    void removeDirectoryUsage(int directoryBlock);
+    void invalidateUsage();
+    void ensureUsage() const;
+    bool loadUsage(std::istream &in, uint32_t length);
+    int liveRefCount(int block) const;
+    std::vector<Snapshot>::iterator findSnapshot(const std::string &name);
+    bool loadSnapshot(std::istream &in, uint32_t length);
+    void saveSnapshot(std::ostream &out, const Snapshot &snapshot) const;
+    void runFlusher();
+    void stopFlusher();
 
-    void writeFileWithPassword(const std::string &fileName, const std::string &content, std::string password);
+    void writeFileWithPassword(const std::string &fileName, const std::string &content, std::string password, char attributes = 0x23);
     void initializeFileSystem();
     std::string getAttributesString(char attributes) const;
     void saveDirectoryEntries();
@@ -42,14 +252,17 @@ private:
     void writeFileWithAttribute(const std::string &fileName, const std::string &content, char Attribute);
     void loadDirectoryEntries();
     void writeDirectoryEntryToPage(int block, const DirectoryEntry &dirEntry);
+    void appendDirectoryEntries(int block, const std::vector<DirectoryEntry> &entries, bool freshBlock = false);
     void saveDirectoryEntry(const DirectoryEntry &entry);
     void addDirectoryEntryToParent(const DirectoryEntry &entry, int parentBlock);
     std::vector<std::string> splitPath(const std::string &path);
-    DirectoryEntry *findDirectoryEntry(const std::string &path);
+    DirectoryEntry *findDirectoryEntry(std::string_view path) const;
     DirectoryEntry *findDirectoryEntryByBlock(int block);
-    bool fileExistinDirectoryEntry(DirectoryEntry *parent, const std::string &path);
-    std::string getParentDirectoryName(const std::string &path);
-    std::string getDirectoryName(const std::string &path);
+    bool fileExistinDirectoryEntry(DirectoryEntry *parent, std::string_view name);
+    // Both return views into path, so resolving a path never copies its components; the parent is
+    // returned as a path, "/" for entries at the root
+    std::string_view getParentDirectoryName(std::string_view path) const;
+    std::string_view getDirectoryName(std::string_view path) const;
     bool filesystemExists(const std::string &fileName);
 };
 
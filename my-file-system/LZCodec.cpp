@@ -0,0 +1,252 @@
+#include "LZCodec.h"
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+namespace
+{
+    const size_t headerSize = 2 * sizeof(uint32_t);
+    const size_t minMatch = 4;
+    const size_t maxOffset = 65535;
+    const int hashBits = 12;
+
+    uint32_t read32(const unsigned char *data)
+    {
+        uint32_t value;
+        std::memcpy(&value, data, sizeof(value));
+        return value;
+    }
+
+    uint32_t hash(uint32_t value)
+    {
+        return (value * 2654435761U) >> (32 - hashBits);
+    }
+
+    void appendLength(std::string &output, size_t length)
+    {
+        while (length >= 255)
+        {
+            output.push_back(static_cast<char>(255));
+            length -= 255;
+        }
+        output.push_back(static_cast<char>(length));
+    }
+
+    bool readLength(const unsigned char *&input, const unsigned char *end, size_t &length)
+    {
+        unsigned char byte = 255;
+        while (byte == 255)
+        {
+            if (input == end)
+            {
+                return false;
+            }
+            byte = *input++;
+            length += byte;
+        }
+        return true;
+    }
+
+    // A sequence is a token (literal count, match length - 4), literals, then a 2-byte offset and
+    // the match extension; the last sequence of a chunk has literals only
+    void appendSequence(std::string &output, const unsigned char *literals, size_t literalLength, size_t offset, size_t matchLength)
+    {
+        size_t matchCode = matchLength >= minMatch ? matchLength - minMatch : 0;
+        unsigned char token = static_cast<unsigned char>((std::min<size_t>(literalLength, 15) << 4) | std::min<size_t>(matchCode, 15));
+        output.push_back(static_cast<char>(token));
+        if (literalLength >= 15)
+        {
+            appendLength(output, literalLength - 15);
+        }
+        output.append(reinterpret_cast<const char *>(literals), literalLength);
+        if (matchLength == 0)
+        {
+            return;
+        }
+        output.push_back(static_cast<char>(offset & 0xFF));
+        output.push_back(static_cast<char>(offset >> 8));
+        if (matchCode >= 15)
+        {
+            appendLength(output, matchCode - 15);
+        }
+    }
+}
+
+const size_t LZCodec::chunkSize;
+
+void LZCodec::compress(const std::string &input, std::string &output)
+{
+    output.clear();
+    output.reserve(input.size() / 2 + headerSize);
+    const unsigned char *data = reinterpret_cast<const unsigned char *>(input.data());
+    for (size_t offset = 0; offset < input.size(); offset += chunkSize)
+    {
+        uint32_t rawLength = static_cast<uint32_t>(std::min(chunkSize, input.size() - offset));
+        size_t headerOffset = output.size();
+        output.append(headerSize, '\0');
+
+        uint32_t storedLength = static_cast<uint32_t>(compressChunk(data + offset, rawLength, output));
+        if (storedLength >= rawLength)
+        {
+            // Incompressible chunk: keep it raw
+            output.resize(headerOffset + headerSize);
+            output.append(input, offset, rawLength);
+            storedLength = rawLength;
+        }
+        std::memcpy(&output[headerOffset], &rawLength, sizeof(rawLength));
+        std::memcpy(&output[headerOffset + sizeof(rawLength)], &storedLength, sizeof(storedLength));
+    }
+}
+
+size_t LZCodec::compressChunk(const unsigned char *input, size_t length, std::string &output)
+{
+    size_t start = output.size();
+    std::vector<int32_t> table(1 << hashBits, -1);
+    size_t anchor = 0;
+    size_t position = 0;
+    size_t misses = 0;
+
+    while (position + minMatch <= length)
+    {
+        uint32_t sequence = read32(input + position);
+        uint32_t slot = hash(sequence);
+        int32_t candidate = table[slot];
+        table[slot] = static_cast<int32_t>(position);
+
+        if (candidate < 0 || position - candidate > maxOffset || read32(input + candidate) != sequence)
+        {
+            // Skip faster through data that keeps missing
+            position += 1 + (misses++ >> 6);
+            continue;
+        }
+
+        size_t matchLength = minMatch;
+        while (position + matchLength < length && input[candidate + matchLength] == input[position + matchLength])
+        {
+            ++matchLength;
+        }
+        appendSequence(output, input + anchor, position - anchor, position - candidate, matchLength);
+        position += matchLength;
+        anchor = position;
+        misses = 0;
+
+        // Stop early once the chunk is clearly not going to shrink
+        if (output.size() - start >= length)
+        {
+            return output.size() - start;
+        }
+    }
+
+    appendSequence(output, input + anchor, length - anchor, 0, 0);
+    return output.size() - start;
+}
+
+bool LZCodec::decompress(const char *data, size_t length, size_t rawLength, std::string &output)
+{
+    output.clear();
+    output.reserve(rawLength);
+    const unsigned char *input = reinterpret_cast<const unsigned char *>(data);
+    size_t offset = 0;
+    while (output.size() < rawLength)
+    {
+        uint32_t chunkRawLength;
+        uint32_t storedLength;
+        if (length - offset < headerSize)
+        {
+            return false;
+        }
+        std::memcpy(&chunkRawLength, input + offset, sizeof(chunkRawLength));
+        std::memcpy(&storedLength, input + offset + sizeof(chunkRawLength), sizeof(storedLength));
+        offset += headerSize;
+        if (chunkRawLength == 0 || chunkRawLength > rawLength - output.size() || storedLength > length - offset)
+        {
+            return false;
+        }
+
+        if (storedLength == chunkRawLength)
+        {
+            output.append(data + offset, storedLength);
+        }
+        else if (!decompressChunk(input + offset, storedLength, chunkRawLength, output))
+        {
+            return false;
+        }
+        offset += storedLength;
+    }
+    return true;
+}
+
+bool LZCodec::decompressChunk(const unsigned char *input, size_t length, size_t rawLength, std::string &output)
+{
+    const unsigned char *end = input + length;
+    size_t chunkStart = output.size();
+    size_t chunkEnd = chunkStart + rawLength;
+    output.resize(chunkEnd);
+    size_t position = chunkStart;
+
+    while (input < end)
+    {
+        unsigned char token = *input++;
+        size_t literalLength = token >> 4;
+        if (literalLength == 15 && !readLength(input, end, literalLength))
+        {
+            return false;
+        }
+        if (literalLength > static_cast<size_t>(end - input) || literalLength > chunkEnd - position)
+        {
+            return false;
+        }
+        std::memcpy(&output[position], input, literalLength);
+        input += literalLength;
+        position += literalLength;
+        if (input == end)
+        {
+            break;
+        }
+
+        if (end - input < 2)
+        {
+            return false;
+        }
+        size_t offset = input[0] | (static_cast<size_t>(input[1]) << 8);
+        input += 2;
+        size_t matchLength = token & 0x0F;
+        if (matchLength == 15 && !readLength(input, end, matchLength))
+        {
+            return false;
+        }
+        matchLength += minMatch;
+        if (offset == 0 || offset > position - chunkStart || matchLength > chunkEnd - position)
+        {
+            return false;
+        }
+        // Byte by byte so overlapping matches repeat the pattern
+        for (size_t i = 0; i < matchLength; ++i, ++position)
+        {
+            output[position] = output[position - offset];
+        }
+    }
+    return position == chunkEnd;
+}
+
+// Walks the chunk headers to find how many stored bytes encode rawLength bytes of content
+size_t LZCodec::encodedLength(const char *data, size_t length, size_t rawLength)
+{
+    size_t offset = 0;
+    size_t decoded = 0;
+    while (decoded < rawLength && length - offset >= headerSize)
+    {
+        uint32_t chunkRawLength;
+        uint32_t storedLength;
+        std::memcpy(&chunkRawLength, data + offset, sizeof(chunkRawLength));
+        std::memcpy(&storedLength, data + offset + sizeof(chunkRawLength), sizeof(storedLength));
+        if (chunkRawLength == 0 || storedLength > length - offset - headerSize)
+        {
+            break;
+        }
+        offset += headerSize + storedLength;
+        decoded += chunkRawLength;
+    }
+    return offset;
+}
@@ -0,0 +1,24 @@
+#ifndef LZCODEC_H
+#define LZCODEC_H
+
+#include <cstddef>
+#include <string>
+
+// Byte-oriented LZ77 codec in the LZ4 style. Input is split into chunks that each carry a
+// [raw length][stored length] header and decode on their own; a chunk that does not shrink is
+// stored raw (stored length equals raw length).
+class LZCodec
+{
+public:
+    static const size_t chunkSize = 16 * 1024;
+
+    static void compress(const std::string &input, std::string &output);
+    static bool decompress(const char *data, size_t length, size_t rawLength, std::string &output);
+    static size_t encodedLength(const char *data, size_t length, size_t rawLength);
+
+private:
+    static size_t compressChunk(const unsigned char *input, size_t length, std::string &output);
+    static bool decompressChunk(const unsigned char *input, size_t length, size_t rawLength, std::string &output);
+};
+
+#endif // LZCODEC_H
@@ -0,0 +1,128 @@
+#include "PatternSearch.h"
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define PATTERNSEARCH_X86 1
+#endif
+
+namespace
+{
+    // Every search reports matches starting at or after from, so the vector loops can hand their
+    // leftover tail to the scalar one
+    void scalarSearch(const unsigned char *data, size_t length, const unsigned char *pattern, size_t patternLength,
+                      size_t from, std::vector<size_t> &matches)
+    {
+        const unsigned char *end = data + length - patternLength + 1;
+        for (const unsigned char *p = data + from; p < end; ++p)
+        {
+            p = static_cast<const unsigned char *>(std::memchr(p, pattern[0], end - p));
+            if (!p)
+            {
+                return;
+            }
+            if (std::memcmp(p + 1, pattern + 1, patternLength - 1) == 0)
+            {
+                matches.push_back(p - data);
+            }
+        }
+    }
+
+#ifdef PATTERNSEARCH_X86
+    void confirm(const unsigned char *data, size_t position, unsigned int mask, const unsigned char *pattern,
+                 size_t patternLength, std::vector<size_t> &matches)
+    {
+        while (mask != 0)
+        {
+            size_t candidate = position + __builtin_ctz(mask);
+            if (std::memcmp(data + candidate + 1, pattern + 1, patternLength - 1) == 0)
+            {
+                matches.push_back(candidate);
+            }
+            mask &= mask - 1;
+        }
+    }
+
+    __attribute__((target("sse2"))) void sse2Search(const unsigned char *data, size_t length, const unsigned char *pattern,
+                                                    size_t patternLength, std::vector<size_t> &matches)
+    {
+        const __m128i first = _mm_set1_epi8(static_cast<char>(pattern[0]));
+        const __m128i last = _mm_set1_epi8(static_cast<char>(pattern[patternLength - 1]));
+        size_t position = 0;
+        for (; position + patternLength - 1 + 16 <= length; position += 16)
+        {
+            __m128i head = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + position));
+            __m128i tail = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + position + patternLength - 1));
+            __m128i both = _mm_and_si128(_mm_cmpeq_epi8(head, first), _mm_cmpeq_epi8(tail, last));
+            confirm(data, position, static_cast<unsigned int>(_mm_movemask_epi8(both)), pattern, patternLength, matches);
+        }
+        scalarSearch(data, length, pattern, patternLength, position, matches);
+    }
+
+    __attribute__((target("avx2"))) void avx2Search(const unsigned char *data, size_t length, const unsigned char *pattern,
+                                                    size_t patternLength, std::vector<size_t> &matches)
+    {
+        const __m256i first = _mm256_set1_epi8(static_cast<char>(pattern[0]));
+        const __m256i last = _mm256_set1_epi8(static_cast<char>(pattern[patternLength - 1]));
+        size_t position = 0;
+        for (; position + patternLength - 1 + 32 <= length; position += 32)
+        {
+            __m256i head = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(data + position));
+            __m256i tail = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(data + position + patternLength - 1));
+            __m256i both = _mm256_and_si256(_mm256_cmpeq_epi8(head, first), _mm256_cmpeq_epi8(tail, last));
+            confirm(data, position, static_cast<unsigned int>(_mm256_movemask_epi8(both)), pattern, patternLength, matches);
+        }
+        scalarSearch(data, length, pattern, patternLength, position, matches);
+    }
+
+    bool hasAvx2()
+    {
+        static const bool available = __builtin_cpu_supports("avx2");
+        return available;
+    }
+
+    bool hasSse2()
+    {
+        static const bool available = __builtin_cpu_supports("sse2");
+        return available;
+    }
+#endif
+}
+
+const char *PatternSearch::implementation()
+{
+#ifdef PATTERNSEARCH_X86
+    if (hasAvx2())
+    {
+        return "avx2";
+    }
+    if (hasSse2())
+    {
+        return "sse2";
+    }
+#endif
+    return "scalar";
+}
+
+void PatternSearch::findAll(const char *data, size_t length, std::string_view pattern, std::vector<size_t> &matches)
+{
+    if (pattern.empty() || pattern.size() > length)
+    {
+        return;
+    }
+    const unsigned char *bytes = reinterpret_cast<const unsigned char *>(data);
+    const unsigned char *patternBytes = reinterpret_cast<const unsigned char *>(pattern.data());
+#ifdef PATTERNSEARCH_X86
+    if (hasAvx2())
+    {
+        avx2Search(bytes, length, patternBytes, pattern.size(), matches);
+        return;
+    }
+    if (hasSse2())
+    {
+        sse2Search(bytes, length, patternBytes, pattern.size(), matches);
+        return;
+    }
+#endif
+    scalarSearch(bytes, length, patternBytes, pattern.size(), 0, matches);
+}
@@ -0,0 +1,19 @@
+#ifndef PATTERNSEARCH_H
+#define PATTERNSEARCH_H
+
+#include <cstddef>
+#include <string_view>
+#include <vector>
+
+// Substring search over a byte buffer. Candidate positions come from comparing the pattern's first
+// and last bytes against 32 (AVX2) or 16 (SSE2) positions at once; each candidate is confirmed with
+// memcmp. Falls back to memchr plus memcmp on other CPUs.
+class PatternSearch
+{
+public:
+    // Appends the start offset of every occurrence, overlapping ones included, in increasing order
+    static void findAll(const char *data, size_t length, std::string_view pattern, std::vector<size_t> &matches);
+    static const char *implementation();
+};
+
+#endif // PATTERNSEARCH_H
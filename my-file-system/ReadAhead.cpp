@@ -0,0 +1,118 @@
+#include "ReadAhead.h"
+#include <algorithm>
+#include <cstring>
+
+const size_t ReadAhead::minWindow;
+const size_t ReadAhead::maxWindow;
+
+ReadAhead::ReadAhead(BlockDevice &device, const std::vector<int> &logical, size_t size, size_t blockSize)
+    : device(device), logical(logical), size(size), blockSize(blockSize), window(minWindow), nextOffset(0), advisedEnd(0)
+{
+}
+
+ReadAhead::~ReadAhead()
+{
+    if (pool)
+    {
+        pool->wait();
+    }
+}
+
+size_t ReadAhead::getWindow() const
+{
+    return window;
+}
+
+bool ReadAhead::read(size_t offset, size_t length, char *out)
+{
+    offset = std::min(offset, size);
+    length = std::min(length, size - offset);
+    if (offset == nextOffset)
+    {
+        window = std::min(window * 2, maxWindow);
+    }
+    else
+    {
+        window = minWindow;
+        advisedEnd = offset;
+    }
+    nextOffset = offset + length;
+
+    // Hint the window past this read before reading, so the kernel works on both at once
+    size_t from = std::max(advisedEnd, nextOffset);
+    size_t to = std::min(size, nextOffset + window);
+    if (from < to)
+    {
+        advise(from, to - from);
+        advisedEnd = to;
+    }
+    return fetch(offset, length, out);
+}
+
+// Reads count bytes of the file from offset from; holes read as zeros
+bool ReadAhead::fetch(size_t from, size_t count, char *out)
+{
+    size_t skip = from % blockSize;
+    if (skip != 0)
+    {
+        std::vector<char> staging(skip + count);
+        if (!fetch(from - skip, staging.size(), staging.data()))
+        {
+            return false;
+        }
+        std::memcpy(out, staging.data() + skip, count);
+        return true;
+    }
+
+    auto isHole = [&](size_t index)
+    {
+        return index >= logical.size() || logical[index] == -1;
+    };
+    size_t first = from / blockSize;
+    size_t blocks = (count + blockSize - 1) / blockSize;
+    for (size_t i = 0; i < blocks;)
+    {
+        bool hole = isHole(first + i);
+        size_t end = i + 1;
+        while (end < blocks && isHole(first + end) == hole)
+        {
+            ++end;
+        }
+        size_t begin = i * blockSize;
+        size_t stop = std::min(end * blockSize, count);
+        if (hole)
+        {
+            std::memset(out + begin, 0, stop - begin);
+        }
+        else if (!device.readBlocks(std::vector<int>(logical.begin() + first + i, logical.begin() + first + end), out + begin, stop - begin))
+        {
+            return false;
+        }
+        i = end;
+    }
+    return true;
+}
+
+// Queues a posix_fadvise for the stored blocks of a byte range
+void ReadAhead::advise(size_t from, size_t count)
+{
+    std::vector<int> blocks;
+    size_t end = std::min(logical.size(), (from + count + blockSize - 1) / blockSize);
+    for (size_t i = from / blockSize; i < end; ++i)
+    {
+        if (logical[i] != -1)
+        {
+            blocks.push_back(logical[i]);
+        }
+    }
+    if (blocks.empty())
+    {
+        return;
+    }
+    if (!pool)
+    {
+        pool.reset(new ThreadPool(1));
+    }
+    pool->submit([this, blocks]()
+                 { device.adviseBlocks(blocks); });
+}
@@ -0,0 +1,42 @@
+#ifndef READAHEAD_H
+#define READAHEAD_H
+
+#include "BlockDevice.h"
+#include "ThreadPool.h"
+#include <cstddef>
+#include <memory>
+#include <vector>
+
+// Serves reads of one file straight into the caller's buffer and keeps a window of the chain
+// ahead of them on its way into the page cache, hinted with posix_fadvise from a background
+// thread. The window doubles while reads stay sequential and drops back to the minimum on a seek.
+class ReadAhead
+{
+public:
+    static const size_t minWindow = 128 * 1024;
+    static const size_t maxWindow = 8 * 1024 * 1024;
+
+    // logical maps each block of the file to its disk block, with -1 for holes
+    ReadAhead(BlockDevice &device, const std::vector<int> &logical, size_t size, size_t blockSize);
+    ~ReadAhead();
+
+    bool read(size_t offset, size_t length, char *out);
+    size_t getWindow() const;
+
+private:
+    bool fetch(size_t from, size_t count, char *out);
+    void advise(size_t from, size_t count);
+
+    BlockDevice &device;
+    const std::vector<int> &logical;
+    size_t size;
+    size_t blockSize;
+    size_t window;
+    size_t nextOffset;
+    // End of the range already hinted, so sequential reads only hint what the window added
+    size_t advisedEnd;
+    // Started by the first hint, so reads that cover the whole file never spawn a thread
+    std::unique_ptr<ThreadPool> pool;
+};
+
+#endif // READAHEAD_H
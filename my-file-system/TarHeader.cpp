@@ -0,0 +1,144 @@
+#include "TarHeader.h"
+#include <cstring>
+
+namespace
+{
+    // Field offsets and widths from the ustar layout
+    const size_t nameOffset = 0, nameLength = 100;
+    const size_t modeOffset = 100, modeLength = 8;
+    const size_t uidOffset = 108, gidOffset = 116, idLength = 8;
+    const size_t sizeOffset = 124, sizeLength = 12;
+    const size_t timeOffset = 136, timeLength = 12;
+    const size_t checksumOffset = 148, checksumLength = 8;
+    const size_t typeOffset = 156;
+    const size_t magicOffset = 257;
+    const size_t versionOffset = 263;
+    const size_t prefixOffset = 345, prefixLength = 155;
+
+    // Octal digits, zero padded and NUL terminated
+    bool writeOctal(char *field, size_t width, uint64_t value)
+    {
+        field[width - 1] = '\0';
+        for (size_t i = width - 1; i-- > 0;)
+        {
+            field[i] = static_cast<char>('0' + (value & 7));
+            value >>= 3;
+        }
+        return value == 0;
+    }
+
+    uint64_t readOctal(const char *field, size_t width)
+    {
+        uint64_t value = 0;
+        size_t i = 0;
+        while (i < width && field[i] == ' ')
+        {
+            ++i;
+        }
+        for (; i < width && field[i] >= '0' && field[i] <= '7'; ++i)
+        {
+            value = (value << 3) | static_cast<uint64_t>(field[i] - '0');
+        }
+        return value;
+    }
+
+    // Sum of all bytes with the checksum field counted as spaces
+    uint32_t checksum(const char *record)
+    {
+        uint32_t sum = 0;
+        for (size_t i = 0; i < TarHeader::recordSize; ++i)
+        {
+            bool inField = i >= checksumOffset && i < checksumOffset + checksumLength;
+            sum += inField ? ' ' : static_cast<unsigned char>(record[i]);
+        }
+        return sum;
+    }
+
+    std::string readString(const char *field, size_t width)
+    {
+        return std::string(field, strnlen(field, width));
+    }
+}
+
+const size_t TarHeader::recordSize;
+const char TarHeader::regularFile;
+const char TarHeader::directory;
+
+TarHeader::TarHeader() : size(0), mode(0644), modificationTime(0), type(regularFile)
+{
+}
+
+// Fills a 512-byte record; returns false when the path cannot be split into prefix and name
+bool TarHeader::encode(char *record) const
+{
+    std::memset(record, 0, recordSize);
+    std::string name = path;
+    std::string prefix;
+    if (name.size() > nameLength)
+    {
+        size_t split = path.find('/', path.size() - nameLength - 1);
+        if (split == std::string::npos || split > prefixLength)
+        {
+            return false;
+        }
+        prefix = path.substr(0, split);
+        name = path.substr(split + 1);
+    }
+    std::memcpy(record + nameOffset, name.data(), name.size());
+    std::memcpy(record + prefixOffset, prefix.data(), prefix.size());
+
+    writeOctal(record + modeOffset, modeLength, mode & 07777);
+    writeOctal(record + uidOffset, idLength, 0);
+    writeOctal(record + gidOffset, idLength, 0);
+    if (!writeOctal(record + sizeOffset, sizeLength, size) ||
+        !writeOctal(record + timeOffset, timeLength, modificationTime < 0 ? 0 : static_cast<uint64_t>(modificationTime)))
+    {
+        return false;
+    }
+    record[typeOffset] = type;
+    std::memcpy(record + magicOffset, "ustar", 6);
+    std::memcpy(record + versionOffset, "00", 2);
+
+    // Six octal digits, a NUL and a space, as most tars write it
+    writeOctal(record + checksumOffset, 7, checksum(record));
+    record[checksumOffset + 7] = ' ';
+    return true;
+}
+
+bool TarHeader::decode(const char *record)
+{
+    if (readOctal(record + checksumOffset, checksumLength) != checksum(record))
+    {
+        return false;
+    }
+    std::string name = readString(record + nameOffset, nameLength);
+    std::string prefix;
+    if (std::memcmp(record + magicOffset, "ustar", 5) == 0)
+    {
+        prefix = readString(record + prefixOffset, prefixLength);
+    }
+    path = prefix.empty() ? name : prefix + "/" + name;
+    mode = static_cast<uint32_t>(readOctal(record + modeOffset, modeLength));
+    size = readOctal(record + sizeOffset, sizeLength);
+    modificationTime = static_cast<int64_t>(readOctal(record + timeOffset, timeLength));
+    type = record[typeOffset] == '\0' ? regularFile : record[typeOffset];
+    return true;
+}
+
+bool TarHeader::isZeroRecord(const char *record)
+{
+    for (size_t i = 0; i < recordSize; ++i)
+    {
+        if (record[i] != '\0')
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Data is padded up to a whole number of records
+size_t TarHeader::paddedSize(uint64_t size)
+{
+    return static_cast<size_t>((size + recordSize - 1) / recordSize * recordSize);
+}
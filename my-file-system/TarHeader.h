@@ -0,0 +1,31 @@
+#ifndef TARHEADER_H
+#define TARHEADER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// One POSIX ustar header record. Archives are a sequence of 512-byte records: a header, the data
+// padded to a whole record, and two zero records at the end.
+class TarHeader
+{
+public:
+    static const size_t recordSize = 512;
+    static const char regularFile = '0';
+    static const char directory = '5';
+
+    std::string path;
+    uint64_t size;
+    uint32_t mode;
+    int64_t modificationTime;
+    char type;
+
+    TarHeader();
+
+    bool encode(char *record) const;
+    bool decode(const char *record);
+    static bool isZeroRecord(const char *record);
+    static size_t paddedSize(uint64_t size);
+};
+
+#endif // TARHEADER_H
@@ -0,0 +1,154 @@
+#include "ThreadPool.h"
+
+namespace
+{
+    // Lets submit() recognise a call made from one of the pool's own workers
+    thread_local const ThreadPool *currentPool = nullptr;
+    thread_local size_t currentWorker = 0;
+}
+
+ThreadPool::ThreadPool(unsigned int threadCount) : queuedTasks(0), activeTasks(0), stopping(false)
+{
+    if (threadCount == 0)
+    {
+        threadCount = std::thread::hardware_concurrency();
+    }
+    if (threadCount == 0)
+    {
+        threadCount = 1;
+    }
+
+    for (unsigned int i = 0; i < threadCount; ++i)
+    {
+        workerQueues.push_back(std::make_unique<WorkerQueue>());
+    }
+    for (unsigned int i = 0; i < threadCount; ++i)
+    {
+        workers.emplace_back(&ThreadPool::workerLoop, this, i);
+    }
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    taskReady.notify_all();
+    for (auto &worker : workers)
+    {
+        worker.join();
+    }
+}
+
+void ThreadPool::submit(std::function<void()> task)
+{
+    bool fromWorker = currentPool == this;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        // Counted before it is queued so wait() cannot see the pool idle in between
+        ++queuedTasks;
+        if (!fromWorker)
+        {
+            tasks.push_back(std::move(task));
+        }
+    }
+    if (fromWorker)
+    {
+        WorkerQueue &own = *workerQueues[currentWorker];
+        std::lock_guard<std::mutex> lock(own.mutex);
+        own.tasks.push_back(std::move(task));
+    }
+    taskReady.notify_one();
+}
+
+// Blocks until every submitted task has finished
+void ThreadPool::wait()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    allDone.wait(lock, [this]
+                 { return queuedTasks == 0 && activeTasks == 0; });
+}
+
+unsigned int ThreadPool::getThreadCount() const
+{
+    return workers.size();
+}
+
+// Own newest task first, then the oldest outside submission, then the oldest task of another worker
+bool ThreadPool::takeTask(size_t worker, std::function<void()> &task)
+{
+    bool found = false;
+    {
+        WorkerQueue &own = *workerQueues[worker];
+        std::lock_guard<std::mutex> lock(own.mutex);
+        if (!own.tasks.empty())
+        {
+            task = std::move(own.tasks.back());
+            own.tasks.pop_back();
+            found = true;
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!found && !tasks.empty())
+    {
+        task = std::move(tasks.front());
+        tasks.pop_front();
+        found = true;
+    }
+    for (size_t i = 1; !found && i < workerQueues.size(); ++i)
+    {
+        WorkerQueue &victim = *workerQueues[(worker + i) % workerQueues.size()];
+        std::lock_guard<std::mutex> victimLock(victim.mutex);
+        if (!victim.tasks.empty())
+        {
+            task = std::move(victim.tasks.front());
+            victim.tasks.pop_front();
+            found = true;
+        }
+    }
+    if (found)
+    {
+        --queuedTasks;
+        ++activeTasks;
+    }
+    return found;
+}
+
+void ThreadPool::workerLoop(size_t worker)
+{
+    currentPool = this;
+    currentWorker = worker;
+    while (true)
+    {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            taskReady.wait(lock, [this]
+                           { return stopping || queuedTasks > 0; });
+            if (queuedTasks == 0)
+            {
+                return;
+            }
+        }
+
+        std::function<void()> task;
+        if (!takeTask(worker, task))
+        {
+            // A worker's submission is counted but not queued yet
+            std::this_thread::yield();
+            continue;
+        }
+
+        task();
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            --activeTasks;
+            if (queuedTasks == 0 && activeTasks == 0)
+            {
+                allDone.notify_all();
+            }
+        }
+    }
+}
@@ -0,0 +1,45 @@
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Tasks submitted from outside run in submission order. A task submitted by a worker goes on that
+// worker's own queue: the owner takes its newest task and idle workers steal the oldest ones.
+class ThreadPool
+{
+public:
+    explicit ThreadPool(unsigned int threadCount = 0);
+    ~ThreadPool();
+
+    void submit(std::function<void()> task);
+    void wait();
+    unsigned int getThreadCount() const;
+
+private:
+    struct WorkerQueue
+    {
+        std::mutex mutex;
+        std::deque<std::function<void()>> tasks;
+    };
+
+    void workerLoop(size_t worker);
+    bool takeTask(size_t worker, std::function<void()> &task);
+
+    std::vector<std::thread> workers;
+    std::vector<std::unique_ptr<WorkerQueue>> workerQueues;
+    std::deque<std::function<void()>> tasks;
+    std::mutex mutex;
+    std::condition_variable taskReady;
+    std::condition_variable allDone;
+    size_t queuedTasks;
+    size_t activeTasks;
+    bool stopping;
+};
+
+#endif // THREADPOOL_H
@@ -1,14 +1,61 @@
 #include "FileSystem.h"
 #include <iostream>
 #include <cstring>
+#include <vector>
 
 void printUsage()
 {
-    std::cerr << "Usage: fileSystemOper <fileName> <operation> <parameters>\n";
+    std::cerr << "Usage: fileSystemOper [--queue-depth=N] [--verify-reads] [--sync=none|commit|periodic] [--sync-interval=MS] <fileName> <operation> <parameters>\n";
 }
 
 int main(int argc, char *argv[])
 {
+    // Global options may appear anywhere and are removed before the positional arguments are read
+    unsigned int queueDepth = 32;
+    bool verifyReads = false;
+    FileSystem::SyncPolicy syncPolicy = FileSystem::SyncPolicy::None;
+    unsigned int syncIntervalMs = 1000;
+    std::vector<char *> args;
+    for (int i = 0; i < argc; ++i)
+    {
+        std::string arg = argv[i];
+        if (arg.compare(0, 14, "--queue-depth=") == 0)
+        {
+            queueDepth = std::stoul(arg.substr(14));
+        }
+        else if (arg == "--verify-reads")
+        {
+            verifyReads = true;
+        }
+        else if (arg == "--sync=none")
+        {
+            syncPolicy = FileSystem::SyncPolicy::None;
+        }
+        else if (arg == "--sync=commit")
+        {
+            syncPolicy = FileSystem::SyncPolicy::Commit;
+        }
+        else if (arg == "--sync=periodic")
+        {
+            syncPolicy = FileSystem::SyncPolicy::Periodic;
+        }
+        else if (arg.compare(0, 7, "--sync=") == 0)
+        {
+            printUsage();
+            return 1;
+        }
+        else if (arg.compare(0, 16, "--sync-interval=") == 0)
+        {
+            syncIntervalMs = std::stoul(arg.substr(16));
+        }
+        else
+        {
+            args.push_back(argv[i]);
+        }
+    }
+    argc = static_cast<int>(args.size());
+    argv = args.data();
+
     if (argc < 3)
     {
         printUsage();
@@ -18,17 +65,53 @@ int main(int argc, char *argv[])
     std::string fileName = argv[1];
     std::string operation = argv[2];
 
-    FileSystem fs(1, fileName); // Block size doesn't matter here since we're loading an existing file system
+    FileSystem fs(1, fileName, queueDepth); // Block size doesn't matter here since we're loading an existing file system
+    fs.setVerifyReads(verifyReads);
+    fs.setSyncPolicy(syncPolicy, syncIntervalMs);
 
     if (operation == "dir")
     {
-        if (argc != 4)
+        if (argc < 4)
         {
             printUsage();
             return 1;
         }
         std::string path = argv[3];
-        fs.listDirectory(path);
+        FileSystem::ListOptions options;
+        for (int i = 4; i < argc; ++i)
+        {
+            std::string option = argv[i];
+            if (option == "--json")
+            {
+                options.json = true;
+            }
+            else if (option == "--sort=name")
+            {
+                options.sort = FileSystem::ListSort::Name;
+            }
+            else if (option == "--sort=size")
+            {
+                options.sort = FileSystem::ListSort::Size;
+            }
+            else if (option == "--sort=mtime")
+            {
+                options.sort = FileSystem::ListSort::ModificationTime;
+            }
+            else if (option.compare(0, 9, "--offset=") == 0)
+            {
+                options.offset = std::stoul(option.substr(9));
+            }
+            else if (option.compare(0, 8, "--limit=") == 0)
+            {
+                options.limit = std::stoul(option.substr(8));
+            }
+            else
+            {
+                printUsage();
+                return 1;
+            }
+        }
+        fs.listDirectory(path, options);
     }
     else if (operation == "mkdir")
     {
@@ -50,10 +133,126 @@ int main(int argc, char *argv[])
         std::string path = argv[3];
         fs.removeDirectory(path);
     }
+    else if (operation == "rm")
+    {
+        if (argc != 5 || std::string(argv[3]) != "-r")
+        {
+            printUsage();
+            return 1;
+        }
+        std::string path = argv[4];
+        fs.removeTree(path);
+    }
+    else if (operation == "cp")
+    {
+        if (argc != 6 || std::string(argv[3]) != "-r")
+        {
+            printUsage();
+            return 1;
+        }
+        std::string source = argv[4];
+        std::string target = argv[5];
+        fs.copyTree(source, target);
+    }
     else if (operation == "dumpe2fs")
     {
         fs.dumpe2fs();
     }
+    else if (operation == "statfs")
+    {
+        fs.statfs();
+    }
+    else if (operation == "du")
+    {
+        if (argc != 4)
+        {
+            printUsage();
+            return 1;
+        }
+        std::string path = argv[3];
+        fs.diskUsage(path);
+    }
+    else if (operation == "find")
+    {
+        if (argc < 4 || argc % 2 != 0)
+        {
+            printUsage();
+            return 1;
+        }
+        std::string path = argv[3];
+        FileSystem::FindOptions options;
+        for (int i = 4; i < argc; i += 2)
+        {
+            std::string test = argv[i];
+            std::string value = argv[i + 1];
+            bool valid = true;
+            if (test == "-name")
+            {
+                options.name = value;
+            }
+            else if (test == "-type")
+            {
+                options.type = value[0];
+                valid = value == "f" || value == "d";
+            }
+            else if (test == "-newer")
+            {
+                options.newer = value;
+            }
+            else if (test == "-size")
+            {
+                // [+|-]N[c|w|b|k|M|G], in 512-byte blocks by default
+                options.sizeCompare = value[0] == '+' || value[0] == '-' ? value[0] : '=';
+                size_t digits = options.sizeCompare == '=' ? 0 : 1;
+                size_t end = value.find_first_not_of("0123456789", digits);
+                valid = end != digits;
+                if (valid)
+                {
+                    options.size = std::stoull(value.substr(digits, end - digits));
+                }
+                if (valid && end != std::string::npos)
+                {
+                    static const std::string units = "cwbkMG";
+                    static const uint64_t unitSizes[] = {1, 2, 512, 1024, 1024 * 1024, 1024 * 1024 * 1024};
+                    size_t unit = units.find(value[end]);
+                    valid = end + 1 == value.size() && unit != std::string::npos;
+                    options.sizeUnit = valid ? unitSizes[unit] : 512;
+                }
+            }
+            else if (test == "-perm")
+            {
+                // rwc letters; a leading - needs all of them, a leading / any of them
+                options.permCompare = value[0] == '-' || value[0] == '/' ? value[0] : '=';
+                for (size_t j = options.permCompare == '=' ? 0 : 1; j < value.size() && valid; ++j)
+                {
+                    size_t bit = std::string("rwc").find(value[j]);
+                    valid = bit != std::string::npos;
+                    options.permissions |= valid ? 1 << bit : 0;
+                }
+            }
+            else
+            {
+                valid = false;
+            }
+            if (!valid || value.empty())
+            {
+                printUsage();
+                return 1;
+            }
+        }
+        fs.find(path, options);
+    }
+    else if (operation == "grep")
+    {
+        if (argc != 5)
+        {
+            printUsage();
+            return 1;
+        }
+        std::string pattern = argv[3];
+        std::string path = argv[4];
+        fs.grep(pattern, path);
+    }
     else if (operation == "writeDirect")
     {
         if (argc != 5)
@@ -67,14 +266,15 @@ int main(int argc, char *argv[])
     }
     else if (operation == "write")
     {
-        if (argc != 5)
+        if (argc < 5 || argc > 6 || (argc == 6 && std::string(argv[5]) != "--clone"))
         {
             printUsage();
             return 1;
         }
         std::string path = argv[3];
         std::string linuxFile = argv[4];
-        fs.writeFileToFile(path, linuxFile);
+        bool clone = argc == 6;
+        fs.writeFileToFile(path, linuxFile, clone);
     }
     else if (operation == "read")
     {
@@ -121,6 +321,180 @@ int main(int argc, char *argv[])
         std::string password = argv[4];
         fs.addPassword(path, password);
     }
+    else if (operation == "import")
+    {
+        if (argc != 5)
+        {
+            printUsage();
+            return 1;
+        }
+        std::string hostDir = argv[3];
+        std::string path = argv[4];
+        fs.importDirectory(hostDir, path);
+    }
+    else if (operation == "export")
+    {
+        if (argc < 5 || argc > 7 || (argc > 5 && std::string(argv[5]) != "--perms"))
+        {
+            printUsage();
+            return 1;
+        }
+        std::string path = argv[3];
+        std::string hostDir = argv[4];
+        bool honourPermissions = argc > 5;
+        std::string password = argc == 7 ? argv[6] : "";
+        fs.exportDirectory(path, hostDir, honourPermissions, password);
+    }
+    else if (operation == "tar-out")
+    {
+        if (argc != 4)
+        {
+            printUsage();
+            return 1;
+        }
+        // The archive is the only thing written to stdout
+        fs.tarOut(argv[3], std::cout);
+    }
+    else if (operation == "tar-in")
+    {
+        if (argc != 4)
+        {
+            printUsage();
+            return 1;
+        }
+        fs.tarIn(argv[3], std::cin);
+    }
+    else if (operation == "append")
+    {
+        if (argc != 5)
+        {
+            printUsage();
+            return 1;
+        }
+        std::string path = argv[3];
+        std::string content = argv[4];
+        fs.appendFile(path, content);
+    }
+    else if (operation == "pwrite")
+    {
+        if (argc != 6)
+        {
+            printUsage();
+            return 1;
+        }
+        std::string path = argv[3];
+        size_t offset = std::stoul(argv[4]);
+        std::string content = argv[5];
+        fs.writeFileAt(path, offset, content);
+    }
+    else if (operation == "truncate")
+    {
+        if (argc != 5)
+        {
+            printUsage();
+            return 1;
+        }
+        std::string path = argv[3];
+        size_t size = std::stoul(argv[4]);
+        fs.truncateFile(path, size);
+    }
+    else if (operation == "discard")
+    {
+        if (argc != 4 || (std::string(argv[3]) != "on" && std::string(argv[3]) != "off"))
+        {
+            printUsage();
+            return 1;
+        }
+        fs.setDiscard(std::string(argv[3]) == "on");
+    }
+    else if (operation == "trim")
+    {
+        if (argc != 3)
+        {
+            printUsage();
+            return 1;
+        }
+        fs.trim();
+    }
+    else if (operation == "checksum")
+    {
+        if (argc != 4 || (std::string(argv[3]) != "on" && std::string(argv[3]) != "off"))
+        {
+            printUsage();
+            return 1;
+        }
+        fs.setChecksums(std::string(argv[3]) == "on");
+    }
+    else if (operation == "snapshot")
+    {
+        std::string action = argc >= 4 ? argv[3] : "";
+        if (action == "list" && argc == 4)
+        {
+            fs.listSnapshots();
+        }
+        else if (argc != 5)
+        {
+            printUsage();
+            return 1;
+        }
+        else if (action == "create")
+        {
+            fs.createSnapshot(argv[4]);
+        }
+        else if (action == "delete")
+        {
+            fs.deleteSnapshot(argv[4]);
+        }
+        else if (action == "restore")
+        {
+            fs.restoreSnapshot(argv[4]);
+        }
+        else
+        {
+            printUsage();
+            return 1;
+        }
+    }
+    else if (operation == "scrub")
+    {
+        if (argc != 3)
+        {
+            printUsage();
+            return 1;
+        }
+        fs.scrub();
+    }
+    else if (operation == "resize")
+    {
+        if (argc != 4)
+        {
+            printUsage();
+            return 1;
+        }
+        fs.resize(std::stoi(argv[3]));
+    }
+    else if (operation == "dedupe")
+    {
+        if (argc > 4)
+        {
+            printUsage();
+            return 1;
+        }
+        std::string mode = argc == 4 ? argv[3] : "";
+        if (mode == "on" || mode == "off")
+        {
+            fs.setDedupe(mode == "on");
+        }
+        else if (mode.empty())
+        {
+            fs.deduplicate();
+        }
+        else
+        {
+            printUsage();
+            return 1;
+        }
+    }
     else if (operation == "test")
     {
         fs.printFileSystem();
@@ -1,9 +1,10 @@
 #include "FileSystem.h"
+#include <algorithm>
 #include <iostream>
 
 void printUsage()
 {
-    std::cerr << "Usage: fileSystemOper <fileName> <operation> <parameters>\n";
+    std::cerr << "Usage: makeFileSystem <blockSizeKB> <fileName> [--stripe-unit=KB] [memberFile...]\n";
 }
 int main(int argc, char *argv[])
 {
@@ -15,9 +16,29 @@ int main(int argc, char *argv[])
     }
     double blockSizeKB = std::stod(argv[1]);
     std::string fileName = argv[2];
+
+    // Any further files hold the data blocks, striped in units of 64 KB unless given
+    double stripeUnitKB = 64;
+    std::vector<std::string> members;
+    for (int i = 3; i < argc; ++i)
+    {
+        std::string arg = argv[i];
+        if (arg.compare(0, 14, "--stripe-unit=") == 0)
+        {
+            stripeUnitKB = std::stod(arg.substr(14));
+        }
+        else
+        {
+            members.push_back(arg);
+        }
+    }
     
     // Initialize file system
     FileSystem fs(blockSizeKB, fileName);
+    if (!members.empty())
+    {
+        fs.stripe(members, std::max(1, static_cast<int>(stripeUnitKB / blockSizeKB)));
+    }
 
     fs.saveFileSystem();
     return 0;
@@ -30,4 +30,29 @@ make
 ./fileSystemOper fileSystem.data read "/usr/file2" "/usr/lf2" "test1234" # Should be OK
 ./fileSystemOper fileSystem.data test
 
-rm fileSystem.data
\ No newline at end of file
+rm fileSystem.data
+
+# More inline files than the image has blocks; they take no data block, and all must survive the reloads
+./makeFileSystem 1 inline.data
+for i in $(seq 4200); do ./fileSystemOper inline.data writeDirect "/i$i" "inline $i"; done
+./fileSystemOper inline.data statfs | grep "Files:"                     # Should print Files: 4200
+rm inline.data
+
+# More clones than the image has blocks; clones share the source's blocks, and all must survive the reloads
+./makeFileSystem 1 clone.data
+./fileSystemOper clone.data writeDirect "/c" "$(printf 'clone source %.0s' $(seq 20))"
+for i in $(seq 4200); do ./fileSystemOper clone.data write "/c$i" "/c" --clone; done
+./fileSystemOper clone.data statfs | grep "Files:"                      # Should print Files: 4201
+rm clone.data
+
+# The same short name in two directories; each lookup must find the file in its own directory
+./makeFileSystem 1 names.data
+./fileSystemOper names.data mkdir "/d1"
+./fileSystemOper names.data mkdir "/d2"
+./fileSystemOper names.data writeDirect "/d1/same" "first"
+./fileSystemOper names.data writeDirect "/d2/same" "second one"
+./fileSystemOper names.data append "/d2/same" "!"
+./fileSystemOper names.data del "/d1/same"
+./fileSystemOper names.data du "/d2/same"                               # Should print 11 bytes
+./fileSystemOper names.data del "/d1"                                   # Should produce an error
+rm names.data
@@ -0,0 +1,1170 @@
+#include "FileSystem.h"
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <filesystem>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <streambuf>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+// Heap allocations made by a thread while it sets countAllocations, for --path-allocations
+static thread_local bool countAllocations = false;
+static thread_local uint64_t allocationCount = 0;
+
+void *operator new(std::size_t size)
+{
+    if (countAllocations)
+    {
+        ++allocationCount;
+    }
+    void *memory = std::malloc(size == 0 ? 1 : size);
+    if (!memory)
+    {
+        throw std::bad_alloc();
+    }
+    return memory;
+}
+
+// Kept out of line: inlined into a caller, GCC pairs the free with that caller's new and warns
+__attribute__((noinline)) void operator delete(void *memory) noexcept
+{
+    std::free(memory);
+}
+
+__attribute__((noinline)) void operator delete(void *memory, std::size_t) noexcept
+{
+    std::free(memory);
+}
+
+namespace
+{
+    // Each thread's std::cerr output goes to its own buffer so every call's result can be checked
+    thread_local std::string capturedErrors;
+
+    class CaptureBuffer : public std::streambuf
+    {
+    protected:
+        int overflow(int ch) override
+        {
+            if (ch != traits_type::eof())
+            {
+                capturedErrors.push_back(static_cast<char>(ch));
+            }
+            return ch;
+        }
+
+        std::streamsize xsputn(const char *data, std::streamsize count) override
+        {
+            capturedErrors.append(data, static_cast<size_t>(count));
+            return count;
+        }
+    };
+
+    class NullBuffer : public std::streambuf
+    {
+    protected:
+        int overflow(int ch) override
+        {
+            return ch;
+        }
+
+        std::streamsize xsputn(const char *, std::streamsize count) override
+        {
+            return count;
+        }
+    };
+
+    // Log-linear histogram: exact below 8 ns, then eight buckets per power of two, so a reported
+    // percentile is at most 12.5% above the true value. Fixed size, so runs can last for hours.
+    class LatencyHistogram
+    {
+    public:
+        void record(uint64_t ns)
+        {
+            ++buckets[bucketOf(ns)];
+            ++total;
+            maximum = std::max(maximum, ns);
+        }
+
+        void merge(const LatencyHistogram &other)
+        {
+            for (size_t i = 0; i < buckets.size(); ++i)
+            {
+                buckets[i] += other.buckets[i];
+            }
+            total += other.total;
+            maximum = std::max(maximum, other.maximum);
+        }
+
+        uint64_t percentile(double fraction) const
+        {
+            uint64_t rank = static_cast<uint64_t>(fraction * static_cast<double>(total));
+            uint64_t seen = 0;
+            for (size_t i = 0; i < buckets.size(); ++i)
+            {
+                seen += buckets[i];
+                if (seen > rank)
+                {
+                    return std::min(upperBound(i), maximum);
+                }
+            }
+            return maximum;
+        }
+
+        uint64_t count() const
+        {
+            return total;
+        }
+
+        uint64_t max() const
+        {
+            return maximum;
+        }
+
+    private:
+        static const int subBuckets = 8;
+        std::array<uint64_t, 64 * subBuckets> buckets{};
+        uint64_t total = 0;
+        uint64_t maximum = 0;
+
+        static size_t bucketOf(uint64_t ns)
+        {
+            if (ns < subBuckets)
+            {
+                return static_cast<size_t>(ns);
+            }
+            int exponent = 63 - __builtin_clzll(ns);
+            uint64_t sub = (ns >> (exponent - 3)) & (subBuckets - 1);
+            return static_cast<size_t>((exponent - 2) * subBuckets + sub);
+        }
+
+        static uint64_t upperBound(size_t bucket)
+        {
+            if (bucket < subBuckets)
+            {
+                return bucket;
+            }
+            int exponent = static_cast<int>(bucket / subBuckets) + 2;
+            uint64_t lower = (subBuckets + bucket % subBuckets) << (exponent - 3);
+            return lower + (uint64_t(1) << (exponent - 3)) - 1;
+        }
+    };
+
+    enum Operation
+    {
+        opMkdir,
+        opWrite,
+        opRead,
+        opAppend,
+        opDelete,
+        opChmod,
+        opAddPassword,
+        opPasswordRead,
+        opWriteExisting,
+        opMissing,
+        operationCount
+    };
+
+    const char *operationNames[operationCount] = {"mkdir", "write", "read", "append", "del", "chmod", "addpw", "pwread", "exists", "missing"};
+    // Out of 100; read-heavy with enough deletes to keep the working set churning
+    const int operationWeights[operationCount] = {3, 18, 30, 14, 10, 7, 5, 5, 3, 5};
+    const char *modes[] = {"+rw", "+r", "+w", "-rw", "-r", "-w", "+c", "-c"};
+    const size_t recentDeletes = 64;
+    const size_t maxDirectories = 64;
+
+    struct FileModel
+    {
+        std::string content;
+        char attributes = 0x23;
+        std::string password;
+        size_t index = 0;
+    };
+
+    struct Statistics
+    {
+        std::array<LatencyHistogram, operationCount> latency;
+
+        void merge(const Statistics &other)
+        {
+            for (int i = 0; i < operationCount; ++i)
+            {
+                latency[i].merge(other.latency[i]);
+            }
+        }
+
+        uint64_t operations() const
+        {
+            uint64_t total = 0;
+            for (const LatencyHistogram &histogram : latency)
+            {
+                total += histogram.count();
+            }
+            return total;
+        }
+    };
+
+    // One thread's share of the workload. Names start with the worker's letter and are never reused,
+    // so workers stay out of each other's way in the image's single name space.
+    struct Worker
+    {
+        char letter = 'a';
+        std::mt19937_64 random;
+        std::vector<std::string> directories;
+        std::vector<std::string> filePaths;
+        std::unordered_map<std::string, FileModel> files;
+        std::vector<std::string> deleted;
+        size_t nextDeleted = 0;
+        uint64_t nextName = 0;
+        size_t blocksUsed = 0;
+        size_t blockBudget = 0;
+        size_t blockSize = 1024;
+        uint64_t operations = 0;
+        uint64_t operationLimit = 0;
+        Statistics round;
+        std::string failure;
+    };
+
+    std::atomic<bool> stopRequested(false);
+
+    std::string describe(const std::string &errors)
+    {
+        if (errors.empty())
+        {
+            return "success";
+        }
+        std::string text = "\"" + errors.substr(0, errors.size() - (errors.back() == '\n')) + "\"";
+        std::replace(text.begin(), text.end(), '\n', '|');
+        return text;
+    }
+
+    // Conservative block estimate; compressed chunks carry an 8-byte header per 16 KB
+    size_t blocksFor(const Worker &worker, size_t size)
+    {
+        size_t stored = size + 8 * (size / (16 * 1024) + 1);
+        return std::max<size_t>(1, (stored + worker.blockSize - 1) / worker.blockSize);
+    }
+
+    std::string newName(Worker &worker)
+    {
+        static const char digits[] = "0123456789abcdefghijklmnopqrstuvwxyz";
+        std::string name(1, worker.letter);
+        uint64_t value = worker.nextName++;
+        do
+        {
+            name.insert(name.begin() + 1, digits[value % 36]);
+            value /= 36;
+        } while (value != 0);
+        return name;
+    }
+
+    // Zero runs become holes, small alphabets compress and random bytes do neither
+    std::string makeContent(Worker &worker)
+    {
+        uint64_t roll = worker.random() % 100;
+        size_t size = roll < 70 ? worker.random() % 2048 : roll < 95 ? 2048 + worker.random() % (30 * 1024) : 32 * 1024 + worker.random() % (224 * 1024);
+        std::string content(size, '\0');
+        int kind = static_cast<int>(worker.random() % 3);
+        for (char &ch : content)
+        {
+            ch = kind == 0 ? 0 : kind == 1 ? static_cast<char>('a' + worker.random() % 4) : static_cast<char>(worker.random());
+        }
+        return content;
+    }
+
+    std::string makePassword(Worker &worker)
+    {
+        std::string password(1 + worker.random() % 9, 'a');
+        for (char &ch : password)
+        {
+            ch = static_cast<char>('a' + worker.random() % 26);
+        }
+        return password;
+    }
+
+    template <typename T>
+    const T &pick(Worker &worker, const std::vector<T> &items)
+    {
+        return items[worker.random() % items.size()];
+    }
+
+    void addFile(Worker &worker, const std::string &path, const FileModel &model)
+    {
+        FileModel &added = worker.files[path] = model;
+        added.index = worker.filePaths.size();
+        worker.filePaths.push_back(path);
+        worker.blocksUsed += blocksFor(worker, model.content.size());
+    }
+
+    void removeFile(Worker &worker, const std::string &path)
+    {
+        auto it = worker.files.find(path);
+        worker.blocksUsed -= blocksFor(worker, it->second.content.size());
+        size_t index = it->second.index;
+        worker.filePaths[index] = worker.filePaths.back();
+        worker.files[worker.filePaths[index]].index = index;
+        worker.filePaths.pop_back();
+        worker.files.erase(it);
+
+        if (worker.deleted.size() < recentDeletes)
+        {
+            worker.deleted.push_back(path);
+        }
+        else
+        {
+            worker.deleted[worker.nextDeleted++ % recentDeletes] = path;
+        }
+    }
+
+    bool check(Worker &worker, Operation operation, const std::string &path, const std::string &expected)
+    {
+        if (capturedErrors == expected)
+        {
+            return true;
+        }
+        worker.failure = std::string(operationNames[operation]) + " " + path + ": expected " + describe(expected) + ", got " + describe(capturedErrors);
+        return false;
+    }
+
+    bool checkContent(Worker &worker, Operation operation, const std::string &path, const std::string &expected, const std::string &actual)
+    {
+        if (actual == expected)
+        {
+            return true;
+        }
+        size_t position = std::mismatch(expected.begin(), expected.begin() + std::min(expected.size(), actual.size()), actual.begin()).first - expected.begin();
+        worker.failure = std::string(operationNames[operation]) + " " + path + ": read " + std::to_string(actual.size()) + " bytes, expected " +
+                         std::to_string(expected.size()) + ", first difference at byte " + std::to_string(position);
+        return false;
+    }
+
+    Operation chooseOperation(Worker &worker)
+    {
+        int roll = static_cast<int>(worker.random() % 100);
+        int operation = 0;
+        while (roll >= operationWeights[operation])
+        {
+            roll -= operationWeights[operation++];
+        }
+        if (worker.files.empty() && operation != opMkdir)
+        {
+            return opWrite;
+        }
+        if (operation == opMkdir && worker.directories.size() >= maxDirectories)
+        {
+            return opRead;
+        }
+        if (operation == opMissing && worker.deleted.empty())
+        {
+            return opRead;
+        }
+        return static_cast<Operation>(operation);
+    }
+
+    // Issues one operation, predicts its outcome from the model and checks the file system agrees
+    bool runOperation(Worker &worker, FileSystem &fs)
+    {
+        Operation operation = chooseOperation(worker);
+        std::string path = worker.files.empty() ? std::string() : pick(worker, worker.filePaths);
+        std::string data;
+        std::string expected;
+        std::string content;
+        std::string target;
+        std::string password;
+        size_t mode = 0;
+        bool missingRead = false;
+        FileModel *model = path.empty() ? nullptr : &worker.files[path];
+
+        // Writes that would overrun this worker's share of the image delete a file instead
+        if ((operation == opWrite || operation == opAppend || operation == opPasswordRead) && model)
+        {
+            data = operation == opPasswordRead ? std::string() : makeContent(worker);
+            size_t grown = operation == opWrite ? blocksFor(worker, data.size()) : operation == opAppend ? blocksFor(worker, model->content.size() + data.size()) - blocksFor(worker, model->content.size()) : blocksFor(worker, model->content.size());
+            if (worker.blocksUsed + grown > worker.blockBudget)
+            {
+                operation = opDelete;
+            }
+        }
+        else if (operation == opWrite)
+        {
+            data = makeContent(worker);
+        }
+
+        capturedErrors.clear();
+        auto start = std::chrono::steady_clock::now();
+        switch (operation)
+        {
+        case opMkdir:
+            path = pick(worker, worker.directories) + "/" + newName(worker);
+            start = std::chrono::steady_clock::now();
+            fs.makeDirectory(path);
+            break;
+        case opWrite:
+            path = pick(worker, worker.directories) + "/" + newName(worker);
+            start = std::chrono::steady_clock::now();
+            fs.writeFile(path, data);
+            break;
+        case opWriteExisting:
+            fs.writeFile(path, "x");
+            break;
+        case opRead:
+            fs.readFile(path, content);
+            break;
+        case opAppend:
+            fs.appendFile(path, data);
+            break;
+        case opDelete:
+            fs.deleteFile(path);
+            break;
+        case opChmod:
+            mode = worker.random() % (sizeof(modes) / sizeof(modes[0]));
+            start = std::chrono::steady_clock::now();
+            fs.changeMode(path, modes[mode]);
+            break;
+        case opAddPassword:
+            password = makePassword(worker);
+            start = std::chrono::steady_clock::now();
+            fs.addPassword(path, password);
+            break;
+        case opPasswordRead:
+            // Half the attempts use the right password; a hit copies the file inside the image
+            password = worker.random() % 2 ? model->password : makePassword(worker);
+            target = pick(worker, worker.directories) + "/" + newName(worker);
+            start = std::chrono::steady_clock::now();
+            fs.readFile(path, target, password);
+            break;
+        case opMissing:
+            path = pick(worker, worker.deleted);
+            missingRead = worker.random() % 2;
+            if (missingRead)
+            {
+                fs.readFile(path, content);
+            }
+            else
+            {
+                fs.deleteFile(path);
+            }
+            break;
+        default:
+            break;
+        }
+        uint64_t ns = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
+        worker.round.latency[operation].record(ns);
+        ++worker.operations;
+
+        switch (operation)
+        {
+        case opMkdir:
+            worker.directories.push_back(path);
+            return check(worker, operation, path, "");
+        case opWrite:
+            addFile(worker, path, FileModel{data, 0x23, "", 0});
+            return check(worker, operation, path, "");
+        case opWriteExisting:
+            return check(worker, operation, path, "File already exists.\n");
+        case opRead:
+            if (!(model->attributes & 0x01))
+            {
+                return check(worker, operation, path, "Read permission denied.\n") && checkContent(worker, operation, path, "", content);
+            }
+            return check(worker, operation, path, "") && checkContent(worker, operation, path, model->content, content);
+        case opAppend:
+            if (!(model->attributes & 0x02))
+            {
+                return check(worker, operation, path, "Write permission denied.\n");
+            }
+            worker.blocksUsed += blocksFor(worker, model->content.size() + data.size()) - blocksFor(worker, model->content.size());
+            model->content += data;
+            return check(worker, operation, path, "");
+        case opDelete:
+            removeFile(worker, path);
+            return check(worker, operation, path, "");
+        case opChmod:
+        {
+            static const char bits[] = {0x03, 0x01, 0x02, 0x03, 0x01, 0x02, 0x04, 0x04};
+            model->attributes = modes[mode][0] == '+' ? (model->attributes | bits[mode]) : (model->attributes & ~bits[mode]);
+            // The file is rewritten without its password
+            model->password.clear();
+            return check(worker, operation, path, "");
+        }
+        case opAddPassword:
+            model->attributes = 0x23 | (model->attributes & 0x04);
+            model->password = password;
+            return check(worker, operation, path, "");
+        case opPasswordRead:
+            if (!(model->attributes & 0x01))
+            {
+                expected = "Read permission denied.\n";
+            }
+            else if (password != model->password)
+            {
+                expected = "Password is incorrect.\n";
+            }
+            else
+            {
+                // The copy replaces the target, which is new and so reported missing first
+                expected = "File not found in parent directory.\n";
+                if (!(model->attributes & 0x02))
+                {
+                    expected += "Write permission denied.\n";
+                }
+                else
+                {
+                    addFile(worker, target, FileModel{model->content, static_cast<char>(0x23 | (model->attributes & 0x04)), "", 0});
+                }
+            }
+            return check(worker, operation, path + " -> " + target, expected);
+        case opMissing:
+            return check(worker, operation, path, missingRead ? "File not found.\n" : "File not found in parent directory.\n");
+        default:
+            return true;
+        }
+    }
+
+    void runWorker(Worker &worker, FileSystem &fs, std::chrono::steady_clock::time_point deadline)
+    {
+        while (!stopRequested && worker.operations < worker.operationLimit && std::chrono::steady_clock::now() < deadline)
+        {
+            if (!runOperation(worker, fs))
+            {
+                stopRequested = true;
+                return;
+            }
+        }
+    }
+
+    // Reads every modelled file back and checks each recently deleted one stays gone
+    bool verifyAll(Worker &worker, FileSystem &fs)
+    {
+        for (const std::string &path : worker.filePaths)
+        {
+            const FileModel &model = worker.files[path];
+            std::string content;
+            capturedErrors.clear();
+            fs.readFile(path, content);
+            bool readable = model.attributes & 0x01;
+            if (!check(worker, opRead, path, readable ? "" : "Read permission denied.\n") ||
+                !checkContent(worker, opRead, path, readable ? model.content : std::string(), content))
+            {
+                return false;
+            }
+        }
+        for (const std::string &path : worker.deleted)
+        {
+            std::string content;
+            capturedErrors.clear();
+            fs.readFile(path, content);
+            if (!check(worker, opMissing, path, "File not found.\n"))
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    double microseconds(uint64_t ns)
+    {
+        return static_cast<double>(ns) / 1000.0;
+    }
+
+    void printStatistics(std::ostream &out, const Statistics &statistics)
+    {
+        out << std::fixed << std::setprecision(1);
+        for (int i = 0; i < operationCount; ++i)
+        {
+            const LatencyHistogram &latency = statistics.latency[i];
+            if (latency.count() == 0)
+            {
+                continue;
+            }
+            out << "    " << std::left << std::setw(8) << operationNames[i] << std::right << std::setw(10) << latency.count()
+                << " ops  p50 " << microseconds(latency.percentile(0.50)) << " us  p99 " << microseconds(latency.percentile(0.99))
+                << " us  p99.9 " << microseconds(latency.percentile(0.999)) << " us  max " << microseconds(latency.max()) << " us\n";
+        }
+    }
+
+    // Reads random files with 1 to threads readers, each count for an equal share of the run, and checks
+    // every read against what was written. There is one directory per thread, so readers meet both inside
+    // a directory (shared locks) and across directories; names are unique image-wide like the workload's.
+    bool runReadScaling(FileSystem &fs, int threads, double seconds, uint64_t seed, std::ostream &report, std::ostream &errors)
+    {
+        const int filesPerDirectory = 16;
+        const size_t fileSize = 16 * 1024;
+        std::mt19937_64 random(seed);
+        std::vector<std::string> paths;
+        std::vector<std::string> contents;
+        capturedErrors.clear();
+        for (int i = 0; i < threads; ++i)
+        {
+            std::string directory = std::string("/r") + static_cast<char>('a' + i);
+            fs.makeDirectory(directory);
+            for (int j = 0; j < filesPerDirectory; ++j)
+            {
+                std::string content(fileSize, '\0');
+                for (char &ch : content)
+                {
+                    ch = static_cast<char>(random());
+                }
+                paths.push_back(directory + "/" + static_cast<char>('a' + i) + std::to_string(j));
+                fs.writeFile(paths.back(), content);
+                contents.push_back(std::move(content));
+            }
+        }
+        if (!capturedErrors.empty())
+        {
+            errors << "Failed to set up the read-scaling files: " << describe(capturedErrors) << "\n";
+            return false;
+        }
+
+        report << "Read scaling: " << paths.size() << " files of " << fileSize / 1024 << " KB, up to " << threads << " readers, "
+               << std::thread::hardware_concurrency() << " hardware threads\n";
+        double singleRate = 0;
+        for (int count = 1; count <= threads; ++count)
+        {
+            std::vector<uint64_t> reads(count, 0);
+            std::vector<std::string> failures(count);
+            auto start = std::chrono::steady_clock::now();
+            auto deadline = start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(seconds / threads));
+            std::vector<std::thread> readers;
+            for (int i = 0; i < count; ++i)
+            {
+                readers.emplace_back([&, i]
+                                     {
+                    std::mt19937_64 pickRandom(seed + i);
+                    std::string content;
+                    while (std::chrono::steady_clock::now() < deadline)
+                    {
+                        size_t file = pickRandom() % paths.size();
+                        capturedErrors.clear();
+                        fs.readFile(paths[file], content);
+                        if (!capturedErrors.empty() || content != contents[file])
+                        {
+                            failures[i] = paths[file] + ": " + (capturedErrors.empty() ? "content differs" : describe(capturedErrors));
+                            return;
+                        }
+                        ++reads[i];
+                    } });
+            }
+            for (std::thread &reader : readers)
+            {
+                reader.join();
+            }
+            double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            for (const std::string &failure : failures)
+            {
+                if (!failure.empty())
+                {
+                    errors << "Mismatch with " << count << " readers: " << failure << "\n";
+                    return false;
+                }
+            }
+
+            uint64_t total = 0;
+            for (uint64_t value : reads)
+            {
+                total += value;
+            }
+            double rate = total / std::max(elapsed, 1e-9);
+            if (count == 1)
+            {
+                singleRate = rate;
+            }
+            report << std::fixed << std::setprecision(1) << "    " << std::setw(2) << count << " readers  " << std::setw(10) << rate << " reads/s  "
+                   << std::setw(8) << rate * fileSize / (1024 * 1024) << " MB/s  " << std::setprecision(2) << rate / std::max(singleRate, 1e-9) << "x\n";
+        }
+        return true;
+    }
+
+    // Resolves paths of growing depth through readFile, for a file that exists but cannot be read and for
+    // a missing one, so every call stops right after the lookup. Resolution must not touch the heap: the
+    // calls are counted by the operator new above and any allocation fails the run.
+    bool runPathAllocations(FileSystem &fs, double seconds, std::ostream &report, std::ostream &errors)
+    {
+        const int depths[] = {1, 4, 16, 32};
+        const int maxDepth = 32;
+        std::vector<std::string> directories;
+        std::string directory;
+        capturedErrors.clear();
+        for (int depth = 1; depth <= maxDepth; ++depth)
+        {
+            directory += "/pd" + std::to_string(depth);
+            fs.makeDirectory(directory);
+            std::string file = directory + "/pf" + std::to_string(depth);
+            fs.writeFile(file, "x");
+            fs.changeMode(file, "-r");
+            directories.push_back(directory);
+        }
+        if (!capturedErrors.empty())
+        {
+            errors << "Failed to set up the path-allocation tree: " << describe(capturedErrors) << "\n";
+            return false;
+        }
+        // Error messages are captured into a buffer that must not grow while counting
+        capturedErrors.reserve(256);
+
+        report << "Path resolution: " << maxDepth << " nested directories, lookups through readFile\n";
+        std::string content;
+        for (int depth : depths)
+        {
+            for (bool found : {true, false})
+            {
+                std::string path = directories[depth - 1] + (found ? "/pf" : "/pm") + std::to_string(depth);
+                const char *expected = found ? "Read permission denied.\n" : "File not found.\n";
+                capturedErrors.clear();
+                fs.readFile(path, content); // Warm-up, so lazily created state is not counted
+
+                uint64_t lookups = 0;
+                bool matched = true;
+                allocationCount = 0;
+                auto start = std::chrono::steady_clock::now();
+                auto deadline = start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(seconds / (2 * std::size(depths))));
+                countAllocations = true;
+                while (matched && std::chrono::steady_clock::now() < deadline)
+                {
+                    for (int i = 0; i < 1024 && matched; ++i, ++lookups)
+                    {
+                        capturedErrors.clear();
+                        fs.readFile(path, content);
+                        matched = capturedErrors == expected;
+                    }
+                }
+                countAllocations = false;
+                double elapsed = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+
+                if (!matched)
+                {
+                    errors << "Unexpected result for " << path << ": " << describe(capturedErrors) << "\n";
+                    return false;
+                }
+                report << std::fixed << std::setprecision(1) << "    depth " << std::setw(2) << depth << (found ? "  found   " : "  missing ")
+                       << std::setw(10) << elapsed / lookups << " ns/lookup  " << std::setprecision(3) << static_cast<double>(allocationCount) / lookups << " allocations/lookup\n";
+                if (allocationCount > 0)
+                {
+                    errors << "Resolving " << path << " allocated " << allocationCount << " times in " << lookups << " lookups\n";
+                    return false;
+                }
+            }
+        }
+        return true;
+    }
+
+    // Every thread works in its own directory on the same few short names, so a lookup that matched a
+    // name in the wrong directory shows up as an error or as another thread's content
+    bool runSameNames(FileSystem &fs, int threads, double seconds, uint64_t seed, std::ostream &report, std::ostream &errors)
+    {
+        const int names = 8;
+        capturedErrors.clear();
+        for (int i = 0; i < threads; ++i)
+        {
+            fs.makeDirectory(std::string("/n") + static_cast<char>('a' + i));
+        }
+        if (!capturedErrors.empty())
+        {
+            errors << "Failed to set up the same-name directories: " << describe(capturedErrors) << "\n";
+            return false;
+        }
+
+        std::vector<uint64_t> operations(threads, 0);
+        std::vector<std::string> failures(threads);
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(seconds));
+        std::vector<std::thread> running;
+        for (int i = 0; i < threads; ++i)
+        {
+            running.emplace_back([&, i]
+                                 {
+                std::mt19937_64 random(seed + i);
+                const std::string directory = std::string("/n") + static_cast<char>('a' + i);
+                std::vector<std::string> contents(names);
+                std::vector<bool> exists(names, false);
+                std::string content;
+                while (std::chrono::steady_clock::now() < deadline)
+                {
+                    int name = static_cast<int>(random() % names);
+                    std::string path = directory + "/s" + std::to_string(name);
+                    std::string step;
+                    capturedErrors.clear();
+                    if (!exists[name])
+                    {
+                        // Sizes on both sides of the inline limit, filled with this thread's letter
+                        contents[name] = std::string(1 + random() % 400, static_cast<char>('a' + i));
+                        step = "write";
+                        fs.writeFile(path, contents[name]);
+                        exists[name] = true;
+                    }
+                    else
+                    {
+                        switch (random() % 5)
+                        {
+                        case 0:
+                            step = "read";
+                            fs.readFile(path, content);
+                            if (capturedErrors.empty() && content != contents[name])
+                            {
+                                capturedErrors = "content differs\n";
+                            }
+                            break;
+                        case 1:
+                        {
+                            std::string data(1 + random() % 64, static_cast<char>('A' + i));
+                            step = "append";
+                            fs.appendFile(path, data);
+                            contents[name] += data;
+                            break;
+                        }
+                        case 2:
+                            step = "chmod";
+                            fs.changeMode(path, random() % 2 ? "+c" : "-c");
+                            break;
+                        case 3:
+                            step = "addpw";
+                            fs.addPassword(path, "pw");
+                            break;
+                        default:
+                            step = "del";
+                            fs.deleteFile(path);
+                            exists[name] = false;
+                            break;
+                        }
+                    }
+                    if (!capturedErrors.empty())
+                    {
+                        failures[i] = step + " " + path + ": " + describe(capturedErrors);
+                        return;
+                    }
+                    ++operations[i];
+                } });
+        }
+        for (std::thread &thread : running)
+        {
+            thread.join();
+        }
+        for (const std::string &failure : failures)
+        {
+            if (!failure.empty())
+            {
+                errors << "Same-name mismatch: " << failure << "\n";
+                return false;
+            }
+        }
+
+        uint64_t total = 0;
+        for (uint64_t value : operations)
+        {
+            total += value;
+        }
+        report << "Same names: " << threads << " directories sharing " << names << " file names, " << total << " operations, no mismatches\n";
+        return true;
+    }
+
+    // Times file writes with the checksum table off and on, alternating between the two every round so
+    // drift in the host's cache or clock speed hits both alike. Each batch is deleted untimed afterwards.
+    bool runChecksumCost(FileSystem &fs, double seconds, uint64_t seed, std::ostream &report, std::ostream &errors)
+    {
+        const int rounds = 6;
+        const int batchFiles = 32;
+        const size_t fileSize = 64 * 1024;
+        std::mt19937_64 random(seed);
+        std::vector<std::string> contents(batchFiles, std::string(fileSize, '\0'));
+        for (std::string &content : contents)
+        {
+            for (char &ch : content)
+            {
+                ch = static_cast<char>(random());
+            }
+        }
+        capturedErrors.clear();
+        fs.makeDirectory("/cs");
+        if (!capturedErrors.empty())
+        {
+            errors << "Failed to set up the checksum benchmark: " << describe(capturedErrors) << "\n";
+            return false;
+        }
+
+        report << "Checksum cost: batches of " << batchFiles << " files of " << fileSize / 1024 << " KB, " << rounds << " rounds\n";
+        double writeTime[2] = {0, 0};
+        uint64_t bytesWritten[2] = {0, 0};
+        for (int round = 0; round < rounds; ++round)
+        {
+            bool checksums = round % 2 == 1;
+            fs.setChecksums(checksums); // Turning them on hashes every block, outside the timed writes
+            double roundTime = 0;
+            while (roundTime < seconds / rounds)
+            {
+                capturedErrors.clear();
+                auto start = std::chrono::steady_clock::now();
+                for (int i = 0; i < batchFiles; ++i)
+                {
+                    fs.writeFile("/cs/k" + std::to_string(i), contents[i]);
+                }
+                roundTime += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+                for (int i = 0; i < batchFiles; ++i)
+                {
+                    fs.deleteFile("/cs/k" + std::to_string(i));
+                }
+                if (!capturedErrors.empty())
+                {
+                    errors << "Write failed with checksums " << (checksums ? "on" : "off") << ": " << describe(capturedErrors) << "\n";
+                    return false;
+                }
+                bytesWritten[checksums] += batchFiles * fileSize;
+            }
+            writeTime[checksums] += roundTime;
+        }
+
+        double rates[2];
+        for (int checksums = 0; checksums < 2; ++checksums)
+        {
+            rates[checksums] = bytesWritten[checksums] / std::max(writeTime[checksums], 1e-9) / (1024 * 1024);
+            report << std::fixed << std::setprecision(1) << "    checksums " << (checksums ? "on " : "off") << std::setw(10) << rates[checksums] << " MB/s\n";
+        }
+        report << std::fixed << std::setprecision(1) << "    overhead " << (rates[0] / std::max(rates[1], 1e-9) - 1) * 100 << "% of write throughput\n";
+        return true;
+    }
+
+    void printUsage()
+    {
+        std::cerr << "Usage: workloadDriver <fileName> [--seconds=N] [--ops=N] [--threads=N] [--seed=N] [--block-size=KB] [--blocks=N] [--report=SECONDS] [--reload-every=REPORTS] [--sync=none|commit|periodic] [--sync-interval=MS] [--read-scaling | --path-allocations | --checksum-cost | --same-names]\n";
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    std::string fileName;
+    double seconds = 60;
+    uint64_t operationLimit = UINT64_MAX;
+    int threads = 1;
+    uint64_t seed = std::random_device()();
+    double blockSizeKB = 1;
+    int blocks = 16384;
+    double reportSeconds = 10;
+    int reloadEvery = 6;
+    FileSystem::SyncPolicy syncPolicy = FileSystem::SyncPolicy::None;
+    unsigned int syncIntervalMs = 1000;
+    bool readScaling = false;
+    bool pathAllocations = false;
+    bool checksumCost = false;
+    bool sameNames = false;
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string arg = argv[i];
+        if (arg.compare(0, 10, "--seconds=") == 0)
+        {
+            seconds = std::stod(arg.substr(10));
+        }
+        else if (arg.compare(0, 6, "--ops=") == 0)
+        {
+            operationLimit = std::stoull(arg.substr(6));
+        }
+        else if (arg.compare(0, 10, "--threads=") == 0)
+        {
+            threads = std::stoi(arg.substr(10));
+        }
+        else if (arg.compare(0, 7, "--seed=") == 0)
+        {
+            seed = std::stoull(arg.substr(7));
+        }
+        else if (arg.compare(0, 13, "--block-size=") == 0)
+        {
+            blockSizeKB = std::stod(arg.substr(13));
+        }
+        else if (arg.compare(0, 9, "--blocks=") == 0)
+        {
+            blocks = std::stoi(arg.substr(9));
+        }
+        else if (arg.compare(0, 9, "--report=") == 0)
+        {
+            reportSeconds = std::stod(arg.substr(9));
+        }
+        else if (arg.compare(0, 15, "--reload-every=") == 0)
+        {
+            reloadEvery = std::stoi(arg.substr(15));
+        }
+        else if (arg == "--sync=none")
+        {
+            syncPolicy = FileSystem::SyncPolicy::None;
+        }
+        else if (arg == "--sync=commit")
+        {
+            syncPolicy = FileSystem::SyncPolicy::Commit;
+        }
+        else if (arg == "--sync=periodic")
+        {
+            syncPolicy = FileSystem::SyncPolicy::Periodic;
+        }
+        else if (arg.compare(0, 16, "--sync-interval=") == 0)
+        {
+            syncIntervalMs = std::stoul(arg.substr(16));
+        }
+        else if (arg == "--read-scaling")
+        {
+            readScaling = true;
+        }
+        else if (arg == "--path-allocations")
+        {
+            pathAllocations = true;
+        }
+        else if (arg == "--checksum-cost")
+        {
+            checksumCost = true;
+        }
+        else if (arg == "--same-names")
+        {
+            sameNames = true;
+        }
+        else if (fileName.empty() && arg.compare(0, 2, "--") != 0)
+        {
+            fileName = arg;
+        }
+        else
+        {
+            printUsage();
+            return 1;
+        }
+    }
+    if (fileName.empty() || threads < 1 || threads > 26 || reportSeconds <= 0 || reloadEvery < 1)
+    {
+        printUsage();
+        return 1;
+    }
+    if (std::filesystem::exists(fileName))
+    {
+        std::cerr << "File system " << fileName << " already exists.\n";
+        return 1;
+    }
+
+    // Results are read from std::cerr; everything the file system prints to std::cout is dropped
+    std::ostream report(std::cout.rdbuf());
+    std::ostream errors(std::cerr.rdbuf());
+    CaptureBuffer captureBuffer;
+    NullBuffer nullBuffer;
+    std::cerr.rdbuf(&captureBuffer);
+    std::cout.rdbuf(&nullBuffer);
+
+    auto fs = std::make_unique<FileSystem>(blockSizeKB, fileName);
+    fs->setSyncPolicy(syncPolicy, syncIntervalMs);
+    if (blocks != FAT12::defaultTotalBlocks)
+    {
+        fs->resize(blocks);
+    }
+    fs->saveFileSystem();
+
+    if (readScaling || pathAllocations || checksumCost || sameNames)
+    {
+        bool passed = readScaling       ? runReadScaling(*fs, threads, seconds, seed, report, errors)
+                      : pathAllocations ? runPathAllocations(*fs, seconds, report, errors)
+                      : checksumCost    ? runChecksumCost(*fs, seconds, seed, report, errors)
+                                        : runSameNames(*fs, threads, seconds, seed, report, errors);
+        report.flush();
+        std::cout.rdbuf(report.rdbuf());
+        std::cerr.rdbuf(errors.rdbuf());
+        return passed ? 0 : 1;
+    }
+
+    // Half the image is left for directory pages and the slack the estimates do not cover
+    std::vector<Worker> workers(threads);
+    for (int i = 0; i < threads; ++i)
+    {
+        Worker &worker = workers[i];
+        worker.letter = static_cast<char>('a' + i);
+        worker.random.seed(seed + i);
+        worker.blockSize = static_cast<size_t>(blockSizeKB * 1024);
+        worker.blockBudget = static_cast<size_t>(blocks) / 2 / threads;
+        worker.operationLimit = operationLimit == UINT64_MAX ? UINT64_MAX : operationLimit / threads + (static_cast<uint64_t>(i) < operationLimit % threads);
+        worker.directories.push_back(std::string("/_") + worker.letter);
+        capturedErrors.clear();
+        fs->makeDirectory(worker.directories.back());
+    }
+    if (!capturedErrors.empty())
+    {
+        errors << "Failed to set up the workload: " << describe(capturedErrors) << "\n";
+        return 1;
+    }
+
+    report << "Workload on " << fileName << ": " << threads << " threads, seed " << seed << ", " << blocks << " blocks of " << blockSizeKB << " KB, sync "
+           << (syncPolicy == FileSystem::SyncPolicy::Commit ? "commit" : syncPolicy == FileSystem::SyncPolicy::Periodic ? "periodic" : "none") << "\n";
+    Statistics totals;
+    auto begin = std::chrono::steady_clock::now();
+    auto end = begin + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(seconds));
+    bool failed = false;
+    for (int round = 1;; ++round)
+    {
+        auto roundStart = std::chrono::steady_clock::now();
+        auto deadline = std::min(end, roundStart + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(reportSeconds)));
+        std::vector<std::thread> running;
+        for (Worker &worker : workers)
+        {
+            running.emplace_back(runWorker, std::ref(worker), std::ref(*fs), deadline);
+        }
+        for (std::thread &thread : running)
+        {
+            thread.join();
+        }
+
+        Statistics roundTotals;
+        bool finished = true;
+        for (Worker &worker : workers)
+        {
+            roundTotals.merge(worker.round);
+            worker.round = Statistics();
+            failed = failed || !worker.failure.empty();
+            finished = finished && worker.operations >= worker.operationLimit;
+        }
+        finished = finished || std::chrono::steady_clock::now() >= end;
+        totals.merge(roundTotals);
+
+        double roundTime = std::chrono::duration<double>(std::chrono::steady_clock::now() - roundStart).count();
+        double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+        report << std::fixed << std::setprecision(1) << "[" << elapsed << " s] " << roundTotals.operations() / std::max(roundTime, 1e-9)
+               << " ops/s, " << totals.operations() << " ops total\n";
+        printStatistics(report, roundTotals);
+
+        // Every few reports the image is saved, loaded into a fresh instance and checked in full
+        if (!failed && (finished || round % reloadEvery == 0))
+        {
+            auto saveStart = std::chrono::steady_clock::now();
+            fs->saveFileSystem();
+            double saveTime = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - saveStart).count();
+            fs.reset();
+            capturedErrors.clear();
+            fs = std::make_unique<FileSystem>(blockSizeKB, fileName);
+            fs->setSyncPolicy(syncPolicy, syncIntervalMs);
+            if (!capturedErrors.empty())
+            {
+                workers[0].failure = "reload: " + describe(capturedErrors);
+                failed = true;
+            }
+            report << "    reloaded " << fileName << " (save took " << saveTime << " ms)\n";
+        }
+        for (Worker &worker : workers)
+        {
+            failed = failed || !verifyAll(worker, *fs);
+        }
+        if (failed || finished)
+        {
+            break;
+        }
+    }
+
+    report.flush();
+    for (const Worker &worker : workers)
+    {
+        if (!worker.failure.empty())
+        {
+            errors << "Mismatch in worker " << worker.letter << " after " << worker.operations << " ops (seed " << seed << "): " << worker.failure << "\n";
+        }
+    }
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+    report << std::fixed << std::setprecision(1) << "Total: " << totals.operations() << " ops in " << elapsed << " s, "
+           << totals.operations() / std::max(elapsed, 1e-9) << " ops/s" << (failed ? ", FAILED" : ", all results matched the model") << "\n";
+    printStatistics(report, totals);
+
+    std::cout.rdbuf(report.rdbuf());
+    std::cerr.rdbuf(errors.rdbuf());
+    return failed ? 1 : 0;
+}